@@ -0,0 +1,298 @@
+// Synthetic camera emulator for load testing the base station.
+//
+// Renders tagCustom48h12 windows the way the detection firmware cuts them
+// out of a frame, a grayscale wwidth x wwidth square behind a TagHeader, and
+// sends them from N emulated cameras, each with its own socket and camera id,
+// at a target rate. Every camera sends one window per tag per frame, tags
+// orbit around the frame centre so the filters see motion, and windows get
+// a random sub-window offset and gaussian noise. A few noisy variants of each
+// tag are rendered up front so rendering does not limit the send rate.
+// Prints the achieved send rate once a second and at the end. With
+// --transport rtp the windows go out as RTP packets like the firmware sends
+// with CONFIG_TRANSPORT_RTP.
+//
+//   cargo run --release --bin cam_emulator -- [--target ADDR:PORT] [--cameras N]
+//     [--tags ID,..] [--rate PKT/S] [--seconds S] [--window PX] [--tag-px PX]
+//     [--noise SIGMA] [--jitter PX] [--orbit PX] [--period FRAMES]
+//     [--frame WxH] [--variants N] [--transport tagstream|rtp]
+
+#[allow(dead_code)]
+#[path = "../net"]
+mod net {
+  pub mod protocol;
+}
+
+use bytes::Bytes;
+use net::protocol::Packet;
+use net::protocol::ts_custom::{TagStreamHeader, TagStreamPacket};
+use net::protocol::rtp::{RtpHeader, RtpPacket, TagStreamExtension, RTP_PAYLOAD_TYPE};
+use std::net::UdpSocket;
+use std::time::{Duration, Instant};
+
+const USAGE: &str = "usage: cam_emulator [--target ADDR:PORT] [--cameras N] [--tags ID,..] \
+  [--rate PKT/S] [--seconds S] [--window PX] [--tag-px PX] [--noise SIGMA] [--jitter PX] \
+  [--orbit PX] [--period FRAMES] [--frame WxH] [--variants N] [--transport tagstream|rtp]";
+
+struct Options {
+  target: String,
+  cameras: usize,
+  tags: Vec<usize>,
+  rate: f64,
+  seconds: f64,
+  window: usize,
+  tag_px: usize,
+  noise: f64,
+  jitter: usize,
+  orbit: f64,
+  period: f64,
+  frame: (usize, usize),
+  variants: usize,
+  rtp: bool,
+}
+
+impl Options {
+  fn from_args() -> Options {
+    let mut o = Options {
+      target: "127.0.0.1:3310".to_string(),
+      cameras: 3,
+      tags: vec![0, 1, 2],
+      rate: 1000.0,
+      seconds: 10.0,
+      window: 40,
+      tag_px: 0,
+      noise: 4.0,
+      jitter: 2,
+      orbit: 60.0,
+      period: 300.0,
+      frame: (320, 240),
+      variants: 8,
+      rtp: false,
+    };
+    fn num<T: std::str::FromStr>(a: Option<String>) -> T {
+      a.and_then(|a| a.parse().ok()).expect(USAGE)
+    }
+    let mut args = std::env::args().skip(1);
+    while let Some(arg) = args.next() {
+      match arg.as_str() {
+        "--target" => o.target = args.next().expect(USAGE),
+        "--cameras" => o.cameras = num(args.next()),
+        "--tags" => o.tags = args.next().expect(USAGE)
+          .split(',').map(|t| t.trim().parse().expect(USAGE)).collect(),
+        "--rate" => o.rate = num(args.next()),
+        "--seconds" => o.seconds = num(args.next()),
+        "--window" => o.window = num(args.next()),
+        "--tag-px" => o.tag_px = num(args.next()),
+        "--noise" => o.noise = num(args.next()),
+        "--jitter" => o.jitter = num(args.next()),
+        "--orbit" => o.orbit = num(args.next()),
+        "--period" => o.period = num(args.next()),
+        "--frame" => {
+          let f = args.next().expect(USAGE);
+          let (w, h) = f.split_once('x').expect(USAGE);
+          o.frame = (w.parse().expect(USAGE), h.parse().expect(USAGE));
+        }
+        "--variants" => o.variants = num(args.next()),
+        "--transport" => o.rtp = match args.next().expect(USAGE).as_str() {
+          "tagstream" => false,
+          "rtp" => true,
+          _ => panic!("{}", USAGE),
+        },
+        _ => panic!("{}", USAGE),
+      }
+    }
+    if o.tag_px == 0 {
+      o.tag_px = o.window * 3 / 5;
+    }
+    assert!(o.cameras > 0 && o.cameras <= 256, "1 to 256 cameras");
+    assert!(!o.tags.is_empty() && o.rate > 0.0, "{}", USAGE);
+    assert!(o.tag_px + 2 * o.jitter <= o.window, "tag plus jitter does not fit the window");
+    o.variants = o.variants.max(1);
+    o
+  }
+}
+
+// xorshift64*, plenty for pixel noise
+struct Rng(u64);
+
+impl Rng {
+  fn next(&mut self) -> u64 {
+    self.0 ^= self.0 >> 12;
+    self.0 ^= self.0 << 25;
+    self.0 ^= self.0 >> 27;
+    self.0.wrapping_mul(0x2545f4914f6cdd1d)
+  }
+
+  fn uniform(&mut self) -> f64 {
+    (self.next() >> 11) as f64 / (1u64 << 53) as f64
+  }
+
+  fn gaussian(&mut self) -> f64 {
+    let u = self.uniform().max(1e-12);
+    let v = self.uniform();
+    (-2.0 * u.ln()).sqrt() * (2.0 * std::f64::consts::PI * v).cos()
+  }
+}
+
+// Cells of each tag, total_width x total_width, 0 black 255 white
+fn render_tags(ids: &[usize]) -> (usize, Vec<Vec<u8>>) {
+  unsafe {
+    let fam = apriltag_sys::tagCustom48h12_create();
+    let ncodes = (*fam).ncodes as usize;
+    let mut width = 0;
+    let tags = ids.iter().map(|&id| {
+      assert!(id < ncodes, "tagCustom48h12 has {} codes", ncodes);
+      let im = apriltag_sys::apriltag_to_image(fam, id as _);
+      width = (*im).width as usize;
+      let stride = (*im).stride as usize;
+      let mut cells = vec![0u8; width * width];
+      for y in 0..width {
+        let row = std::slice::from_raw_parts((*im).buf.add(y * stride), width);
+        cells[y * width..(y + 1) * width].copy_from_slice(row);
+      }
+      apriltag_sys::image_u8_destroy(im);
+      cells
+    }).collect();
+    apriltag_sys::tagCustom48h12_destroy(fam);
+    (width, tags)
+  }
+}
+
+// One window: white paper, the tag scaled to tag_px at offset (ox, oy), noise
+fn render_window(o: &Options, cells: &[u8], width: usize, ox: usize, oy: usize, rng: &mut Rng) -> Bytes {
+  let w = o.window;
+  let mut img = vec![255u8; w * w];
+  for y in 0..o.tag_px {
+    let cy = y * width / o.tag_px;
+    let row = &mut img[(oy + y) * w + ox..(oy + y) * w + ox + o.tag_px];
+    for (x, px) in row.iter_mut().enumerate() {
+      *px = cells[cy * width + x * width / o.tag_px];
+    }
+  }
+  if o.noise > 0.0 {
+    for px in img.iter_mut() {
+      *px = (*px as f64 + o.noise * rng.gaussian()).round().clamp(0.0, 255.0) as u8;
+    }
+  }
+  Bytes::from(img)
+}
+
+fn main() {
+  let o = Options::from_args();
+  let mut rng = Rng(0x9e3779b97f4a7c15);
+
+  let (width, tags) = render_tags(&o.tags);
+  let variants: Vec<Vec<Bytes>> = tags.iter().map(|cells| {
+    (0..o.variants).map(|_| {
+      let j = 2 * o.jitter + 1;
+      let base = (o.window - o.tag_px) / 2 - o.jitter;
+      let ox = base + (rng.next() % j as u64) as usize;
+      let oy = base + (rng.next() % j as u64) as usize;
+      render_window(&o, cells, width, ox, oy, &mut rng)
+    }).collect()
+  }).collect();
+
+  let socks: Vec<UdpSocket> = (0..o.cameras)
+    .map(|_| UdpSocket::bind("0.0.0.0:0").expect("unable to open a socket"))
+    .collect();
+  for s in &socks {
+    s.connect(&o.target).expect("unable to reach the target");
+  }
+
+  println!("{} cameras x {} tags, {}px windows ({} bytes), {:.0} packets/s to {} for {} s",
+    o.cameras, o.tags.len(), o.window, o.window * o.window + if o.rtp { 24 } else { 12 }, o.rate, o.target, o.seconds);
+
+  let interval = Duration::from_secs_f64(1.0 / o.rate);
+  let start = Instant::now();
+  let end = start + Duration::from_secs_f64(o.seconds);
+  let (mut sent, mut bytes, mut errors) = (0u64, 0u64, 0u64);
+  let (mut last_report, mut last_sent, mut last_bytes) = (start, 0u64, 0u64);
+  let mut next = start;
+  let mut buf: Vec<u8> = Vec::with_capacity(o.window * o.window + 24);
+  let mut seqs: Vec<u16> = (0..o.cameras).map(|_| rng.next() as u16).collect();
+  let (cx, cy) = (o.frame.0 as f64 / 2.0, o.frame.1 as f64 / 2.0);
+  let half = (o.window / 2) as f64;
+
+  'frames: for frame in 0u32.. {
+    for cam in 0..o.cameras {
+      for t in 0..o.tags.len() {
+        let now = Instant::now();
+        if now >= end {
+          break 'frames;
+        }
+        if next > now {
+          if next - now > Duration::from_millis(1) {
+            std::thread::sleep(next - now);
+          }
+          while Instant::now() < next {
+            std::hint::spin_loop();
+          }
+        } else if now - next > Duration::from_millis(100) {
+          // fell far behind, do not try to catch up with a burst
+          next = now;
+        }
+        next += interval;
+
+        let phase = frame as f64 / o.period + t as f64 / o.tags.len() as f64 + cam as f64 * 0.1;
+        let angle = 2.0 * std::f64::consts::PI * phase;
+        let px = (cx + o.orbit * angle.cos()).clamp(half, o.frame.0 as f64 - half);
+        let py = (cy + o.orbit * angle.sin()).clamp(half, o.frame.1 as f64 - half);
+        let v = &variants[t][(frame as usize + cam) % o.variants];
+        let header = TagStreamHeader {
+          width: o.window as u16,
+          px: px as u16,
+          py: py as u16,
+          cam_id: cam as u8,
+          flags: 0,
+          ts: frame,
+        };
+        buf.clear();
+        if o.rtp {
+          let packet = RtpPacket {
+            header: RtpHeader {
+              marker: false,
+              payload_type: RTP_PAYLOAD_TYPE,
+              seq: seqs[cam],
+              ts: frame,
+              ssrc: cam as u32,
+            },
+            ext: TagStreamExtension {
+              width: header.width,
+              px: header.px,
+              py: header.py,
+              flags: header.flags,
+            },
+            data: v.clone(),
+          };
+          seqs[cam] = seqs[cam].wrapping_add(1);
+          packet.marshal(&mut buf);
+        } else {
+          TagStreamPacket { header, data: v.clone() }.marshal(&mut buf);
+        }
+        match socks[cam].send(&buf) {
+          Ok(n) => {
+            sent += 1;
+            bytes += n as u64;
+          }
+          Err(_) => errors += 1,
+        }
+
+        let now = Instant::now();
+        if now - last_report >= Duration::from_secs(1) {
+          let dt = (now - last_report).as_secs_f64();
+          println!("[{:6.1} s] {:8.0} packets/s {:8.2} MB/s, {} send errors",
+            (now - start).as_secs_f64(),
+            (sent - last_sent) as f64 / dt,
+            (bytes - last_bytes) as f64 / dt / 1e6,
+            errors);
+          last_report = now;
+          last_sent = sent;
+          last_bytes = bytes;
+        }
+      }
+    }
+  }
+
+  let secs = start.elapsed().as_secs_f64();
+  println!("sent {} packets in {:.2} s: {:.0} packets/s ({:.1}% of target), {:.2} MB/s, {} send errors",
+    sent, secs, sent as f64 / secs, 100.0 * sent as f64 / secs / o.rate, bytes as f64 / secs / 1e6, errors);
+}
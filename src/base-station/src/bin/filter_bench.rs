@@ -0,0 +1,246 @@
+// Cost of a filter step per tag: one EKF per tag, as the filters ran with a
+// task each, against the structure-of-arrays FilterBank the server uses.
+//
+// A tag with a frame is seen by every camera; both sides get the same
+// sightings. In lockstep every tag has a frame in every step, in the sparse
+// runs only a --visible share of the tags (0.1 by default) does, as when
+// most tags are out of view. Prints nanoseconds per tag frame for 3, 100
+// and 1000 tags and each motion model, then the measurement updates per
+// second of the SVD pseudo-inverse update the filters used to make against
+// the closed-form kernels of EKF::filter and of FilterBank, which is the
+// one the server runs.
+//
+//   cargo run --release --bin filter_bench -- [--cameras N] [--frames N] [--tags N,..] [--visible F] [--updates N]
+
+#[allow(dead_code)]
+#[path = "../net"]
+mod net {
+  pub mod protocol;
+  pub mod capture;
+  pub mod loss;
+}
+
+#[allow(dead_code)]
+#[path = "../tag_detector"]
+mod tag_detector {
+  pub mod detector;
+  pub mod image;
+}
+
+#[allow(dead_code)]
+#[path = "../config.rs"]
+mod config;
+#[allow(dead_code)]
+#[path = "../queue.rs"]
+mod queue;
+#[allow(dead_code)]
+#[path = "../ekf.rs"]
+mod ekf;
+#[allow(dead_code)]
+#[path = "../filter_bank.rs"]
+mod filter_bank;
+
+use config::Motion;
+use ekf::{CalData, Model, Observation, Sighting, EKF};
+use filter_bank::FilterBank;
+use nalgebra::{Matrix2, SMatrix, SVector, Vector2};
+use std::hint::black_box;
+use std::time::{Duration, Instant};
+
+const USAGE: &str = "usage: filter_bench [--cameras N] [--frames N] [--tags N,..] [--visible F] [--updates N]";
+
+struct Options {
+  cameras: usize,
+  frames: u32,
+  tags: Vec<usize>,
+  // share of the tags with a frame in each step of the sparse runs
+  visible: f64,
+  // measurement updates timed per kernel
+  updates: u32,
+}
+
+fn options() -> Options {
+  let mut args = std::env::args().skip(1);
+  let mut o = Options { cameras: 3, frames: 2000, tags: vec![3, 100, 1000], visible: 0.1, updates: 1_000_000 };
+  while let Some(arg) = args.next() {
+    let mut value = || args.next().expect(USAGE);
+    match arg.as_str() {
+      "--cameras" => o.cameras = value().parse().expect(USAGE),
+      "--frames" => o.frames = value().parse().expect(USAGE),
+      "--tags" => o.tags = value().split(',').map(|n| n.trim().parse().expect(USAGE)).collect(),
+      "--visible" => o.visible = value().parse().expect(USAGE),
+      "--updates" => o.updates = value().parse().expect(USAGE),
+      _ => panic!("{}", USAGE),
+    }
+  }
+  o
+}
+
+// Deterministic noise in -0.5..0.5
+struct Lcg(u64);
+
+impl Lcg {
+  fn next(&mut self) -> f64 {
+    self.0 = self.0.wrapping_mul(6364136223846793005).wrapping_add(1442695040888963407);
+    (self.0 >> 11) as f64 / (1u64 << 53) as f64 - 0.5
+  }
+}
+
+// Every tag's sightings of every frame, in camera order
+fn sightings(tags: usize, cameras: usize, frames: u32) -> Vec<Vec<Vec<Sighting>>> {
+  let mut rng = Lcg(1);
+  let cams: Vec<CalData> = (0..cameras).map(|_| {
+    CalData::from_fn(|_, c| if c == 3 { 320.0 + 100.0 * rng.next() } else { 500.0 * rng.next() })
+  }).collect();
+  (0..frames).map(|f| (0..tags).map(|t| {
+    let pos = nalgebra::Vector3::new((t as f64 * 0.1 + f as f64 * 0.01).sin(), (f as f64 * 0.02).cos(), 2.0);
+    cams.iter().enumerate().map(|(c, cam)| {
+      let p = cam.fixed_slice::<2, 3>(0, 0) * pos + cam.fixed_slice::<2, 1>(0, 3);
+      let center = Vector2::new(p.x + rng.next(), p.y + rng.next());
+      (c, *cam, Observation { center })
+    }).collect()
+  }).collect()).collect()
+}
+
+// Whether tag has a frame in step frame, for a share visible of the tags
+fn seen(tag: usize, frame: usize, visible: f64) -> bool {
+  let h = (tag as u64).wrapping_mul(0x9e3779b97f4a7c15) ^ (frame as u64).wrapping_mul(0xc2b2ae3d27d4eb4f);
+  ((h.wrapping_mul(0x94d049bb133111eb) >> 11) as f64 / (1u64 << 53) as f64) < visible
+}
+
+// Tag frames filtered over the run
+fn tag_frames(frames: &[Vec<Vec<Sighting>>], visible: f64) -> usize {
+  frames.iter().enumerate().map(|(f, frame)| (0..frame.len()).filter(|t| seen(*t, f, visible)).count()).sum()
+}
+
+fn per_tag<const N: usize>(model: &Model, frames: &[Vec<Vec<Sighting>>], visible: f64) -> Duration {
+  let tags = frames[0].len();
+  let mut filters: Vec<EKF<N>> = (0..tags).map(|_| {
+    EKF::new(Matrix2::identity(), model.process_noise, model.frame_rate,
+             SVector::zeros(), SMatrix::identity() * config::INITIAL_VARIANCE)
+  }).collect();
+  let start = Instant::now();
+  for (f, frame) in frames.iter().enumerate() {
+    for (t, (ekf, s)) in filters.iter_mut().zip(frame).enumerate() {
+      if seen(t, f, visible) {
+        ekf.filter(f as u32 + 1, s);
+      }
+    }
+    black_box(&filters);
+  }
+  start.elapsed()
+}
+
+fn bank(model: &Model, frames: &[Vec<Vec<Sighting>>], visible: f64) -> Duration {
+  let tags = frames[0].len();
+  let ids: Vec<usize> = (0..tags).collect();
+  let mut bank = FilterBank::new(&ids, model);
+  let mut step: Vec<(usize, u32, &[Sighting])> = Vec::with_capacity(tags);
+  let start = Instant::now();
+  for (f, frame) in frames.iter().enumerate() {
+    step.clear();
+    step.extend(frame.iter().enumerate()
+      .filter(|(t, _)| seen(*t, f, visible))
+      .map(|(t, s)| (t, f as u32 + 1, &s[..])));
+    bank.filter(&step);
+    black_box(&bank);
+  }
+  start.elapsed()
+}
+
+// The update EKF::filter made before the closed-form kernel: an SVD
+// pseudo-inverse of the innovation and the plain covariance update
+fn pseudo_inverse_update<const N: usize>(x: &mut SVector<f64, N>, cov: &mut SMatrix<f64, N, N>,
+                                         (_, t, obs): &Sighting) {
+  let mut h = SMatrix::<f64, 2, N>::zeros();
+  h.fixed_columns_mut::<3>(0).copy_from(&t.fixed_slice::<2, 3>(0, 0));
+  let y = obs.center - (t.fixed_slice::<2, 3>(0, 0) * x.fixed_rows::<3>(0) + t.fixed_slice::<2, 1>(0, 3));
+  let s = &h * &*cov * h.transpose() + Matrix2::identity();
+  let s_dg = s.pseudo_inverse(1e-8).unwrap();
+  let k = &*cov * (h.transpose() * s_dg);
+  *x += &k * y;
+  *cov = (SMatrix::<f64, N, N>::identity() - &k * &h) * &*cov;
+}
+
+// Lanes of the bank timed by kernels
+const KERNEL_LANES: usize = 1000;
+
+// Measurement updates per second of the old kernel, of EKF::filter and of
+// FilterBank::filter, the filters getting frames of `cameras` sightings
+fn kernels<const N: usize>(updates: u32, cameras: usize, motion: Motion, sighting: &Sighting) -> (f64, f64, f64) {
+  let (mut x, mut cov) = (SVector::<f64, N>::zeros(), SMatrix::<f64, N, N>::identity());
+  let start = Instant::now();
+  for _ in 0..updates {
+    pseudo_inverse_update(&mut x, &mut cov, sighting);
+    black_box((&x, &cov));
+  }
+  let old = updates as f64 / start.elapsed().as_secs_f64();
+
+  let model = Model { motion, frame_rate: 1.0, process_noise: 1.0, lead: 0.0 };
+  let mut ekf: EKF<N> = EKF::new(Matrix2::identity(), model.process_noise, model.frame_rate,
+                                 SVector::zeros(), SMatrix::identity());
+  let sightings = vec![*sighting; cameras];
+  let frames = (updates as usize / cameras).max(1);
+  let start = Instant::now();
+  for _ in 0..frames {
+    // the same frame over and over, so no prediction
+    ekf.filter(0, &sightings);
+    black_box(&ekf);
+  }
+  let single = (frames * cameras) as f64 / start.elapsed().as_secs_f64();
+
+  // Every lane in the same frame over and over: a step is a zero-length
+  // prediction, the updates of each lane's sightings and the gather and
+  // scatter around them, as in a step of the server's bank
+  let ids: Vec<usize> = (0..KERNEL_LANES).collect();
+  let mut bank = FilterBank::new(&ids, &model);
+  let step: Vec<(usize, u32, &[Sighting])> = ids.iter().map(|&lane| (lane, 0, &sightings[..])).collect();
+  let steps = (updates as usize / (KERNEL_LANES * cameras)).max(1);
+  let start = Instant::now();
+  for _ in 0..steps {
+    bank.filter(&step);
+    black_box(&bank);
+  }
+  (old, single, (steps * KERNEL_LANES * cameras) as f64 / start.elapsed().as_secs_f64())
+}
+
+fn main() {
+  let o = options();
+  println!("{} cameras, {} frames, ns per tag frame", o.cameras, o.frames);
+  println!("{:>6} {:>13} {:>10} {:>14} {:>14} {:>8}", "tags", "motion", "steps", "per-tag ns", "bank ns", "speedup");
+  for &tags in &o.tags {
+    let frames = sightings(tags, o.cameras, o.frames);
+    for motion in [Motion::Still, Motion::Velocity, Motion::Acceleration] {
+      let model = Model {
+        motion,
+        frame_rate: config::FRAME_RATE,
+        process_noise: config::PROCESS_NOISE,
+        lead: 0.0,
+      };
+      for (steps, visible) in [("lockstep", 1.0), ("sparse", o.visible)] {
+        let single = match motion {
+          Motion::Still => per_tag::<3>(&model, &frames, visible),
+          Motion::Velocity => per_tag::<6>(&model, &frames, visible),
+          Motion::Acceleration => per_tag::<9>(&model, &frames, visible),
+        };
+        let banked = bank(&model, &frames, visible);
+        let updates = tag_frames(&frames, visible).max(1) as f64;
+        let (a, b) = (single.as_nanos() as f64 / updates, banked.as_nanos() as f64 / updates);
+        println!("{:>6} {:>13} {:>10} {:>14.1} {:>14.1} {:>7.2}x", tags, format!("{:?}", motion), steps, a, b, a / b);
+      }
+    }
+  }
+
+  let sighting = sightings(1, 1, 1)[0][0][0];
+  println!();
+  println!("{} sightings per frame, measurement updates per second", o.cameras);
+  println!("{:>6} {:>13} {:>16} {:>14} {:>14} {:>8}", "state", "motion", "pseudo-inv M/s", "EKF M/s", "bank M/s", "speedup");
+  for (n, motion, (old, single, banked)) in [
+    (3, Motion::Still, kernels::<3>(o.updates, o.cameras, Motion::Still, &sighting)),
+    (6, Motion::Velocity, kernels::<6>(o.updates, o.cameras, Motion::Velocity, &sighting)),
+    (9, Motion::Acceleration, kernels::<9>(o.updates, o.cameras, Motion::Acceleration, &sighting)),
+  ] {
+    println!("{:>6} {:>13} {:>16.2} {:>14.2} {:>14.2} {:>7.2}x", n, format!("{:?}", motion),
+             old / 1e6, single / 1e6, banked / 1e6, banked / old);
+  }
+}
@@ -0,0 +1,200 @@
+// Offline tuner for the detector profiles of --profiles.
+//
+// Reads the windows of a capture log made with --record, sorts them into
+// width buckets and detects every bucket's windows with each profile of a
+// grid of decimation, blur, edge refinement and sharpening settings on one
+// single-threaded detector, like a pool worker. A tag counts as in a window
+// when any profile finds it there; per bucket the fastest profile that finds
+// at least the target share of them is picked. Prints the candidates and
+// writes the picks as a profile file.
+//
+//   cargo run --release --bin tune_profiles -- CAPTURE [--transport tagstream|rtp]
+//     [--buckets W,..] [--recall R] [--min-margin X] [--windows N] [--out FILE]
+
+#[allow(dead_code)]
+#[path = "../net"]
+mod net {
+  pub mod protocol;
+  pub mod capture;
+}
+
+#[allow(dead_code)]
+#[path = "../tag_detector"]
+mod tag_detector {
+  pub mod detector;
+  pub mod image;
+  pub mod profile;
+}
+
+use apriltag::Detector;
+use net::capture::Capture;
+use net::protocol::Packet;
+use net::protocol::rtp::RtpPacket;
+use net::protocol::ts_custom::TagStreamPacket;
+use tag_detector::detector::{DetectorExt, TagID};
+use tag_detector::image::ImagePool;
+use tag_detector::profile::{Profile, Profiles};
+use std::time::{Duration, Instant};
+
+const USAGE: &str = "usage: tune_profiles CAPTURE [--transport tagstream|rtp] [--buckets W,..] \
+  [--recall R] [--min-margin X] [--windows N] [--out FILE]";
+
+struct Options {
+  capture: String,
+  rtp: bool,
+  // widest window of every bucket but the last, which takes the rest
+  buckets: Vec<usize>,
+  recall: f64,
+  min_margin: f32,
+  // windows tried per bucket
+  windows: usize,
+  out: Option<String>,
+}
+
+fn options() -> Options {
+  let mut args = std::env::args().skip(1);
+  let mut o = Options {
+    capture: String::new(),
+    rtp: false,
+    buckets: vec![64, 96, 128, 192],
+    recall: 0.99,
+    min_margin: 25.0,
+    windows: 500,
+    out: None,
+  };
+  while let Some(arg) = args.next() {
+    let mut value = || args.next().expect(USAGE);
+    match arg.as_str() {
+      "--transport" => o.rtp = match value().as_str() {
+        "tagstream" => false,
+        "rtp" => true,
+        _ => panic!("{}", USAGE),
+      },
+      "--buckets" => o.buckets = value().split(',').map(|w| w.trim().parse().expect(USAGE)).collect(),
+      "--recall" => o.recall = value().parse().expect(USAGE),
+      "--min-margin" => o.min_margin = value().parse().expect(USAGE),
+      "--windows" => o.windows = value().parse().expect(USAGE),
+      "--out" => o.out = Some(value()),
+      path if o.capture.is_empty() && !path.starts_with("--") => o.capture = path.to_string(),
+      _ => panic!("{}", USAGE),
+    }
+  }
+  if o.capture.is_empty() {
+    panic!("{}", USAGE);
+  }
+  o.buckets.sort();
+  o.buckets.push(usize::MAX);
+  o
+}
+
+fn candidates() -> Vec<Profile> {
+  let mut grid = Vec::new();
+  for decimation in [1.0, 1.5, 2.0, 3.0] {
+    for sigma in [0.0, 1.0, 2.0] {
+      for refine_edges in [true, false] {
+        for sharpening in [0.0, 0.25] {
+          grid.push(Profile { decimation, sigma, refine_edges, sharpening });
+        }
+      }
+    }
+  }
+  grid
+}
+
+struct Run {
+  profile: Profile,
+  time: Duration,
+  // tags found, by window
+  found: Vec<Vec<TagID>>,
+}
+
+fn main() {
+  let o = options();
+  let capture = Capture::open(&o.capture).expect("unable to open the capture log");
+
+  let mut buckets: Vec<Vec<TagStreamPacket>> = o.buckets.iter().map(|_| Vec::new()).collect();
+  for r in capture.records() {
+    let mut data = r.data;
+    let p: Result<TagStreamPacket, ()> = if o.rtp {
+      RtpPacket::unmarshal(&mut data).map(|p| p.into())
+    } else {
+      TagStreamPacket::unmarshal(&mut data)
+    };
+    let Ok(p) = p else { continue };
+    let w = p.header.width as usize;
+    if w == 0 || p.data.len() < w * w {
+      continue;
+    }
+    let b = o.buckets.iter().position(|max| w <= *max).unwrap();
+    if buckets[b].len() < o.windows {
+      buckets[b].push(p);
+    }
+  }
+
+  let mut det = Detector::new("tagCustom48h12");
+  det.set_thread_number(1);
+  let mut images = ImagePool::new();
+  let mut picks = Vec::new();
+  for (b, windows) in buckets.iter().enumerate() {
+    let max = o.buckets[b];
+    let lo = if b == 0 { 1 } else { o.buckets[b - 1] + 1 };
+    if windows.is_empty() {
+      println!("windows {}..{}: none in the capture", lo, max);
+      continue;
+    }
+
+    let runs: Vec<Run> = candidates().into_iter().map(|profile| {
+      profile.apply(&mut det);
+      let start = Instant::now();
+      let found = windows.iter().map(|p| {
+        let w = p.header.width as usize;
+        let img = images.window(&p.data, w, w);
+        let mut ids: Vec<TagID> = det.detect_all(&img, o.min_margin).iter().map(|d| d.id).collect();
+        ids.sort();
+        ids.dedup();
+        ids
+      }).collect();
+      Run { profile, time: start.elapsed(), found }
+    }).collect();
+
+    // every tag some profile found is taken to be there
+    let tags: Vec<Vec<TagID>> = (0..windows.len()).map(|i| {
+      let mut ids: Vec<TagID> = runs.iter().flat_map(|r| r.found[i].iter().copied()).collect();
+      ids.sort();
+      ids.dedup();
+      ids
+    }).collect();
+    let total = tags.iter().map(|t| t.len()).sum::<usize>();
+    let recall = |r: &Run| {
+      let hits = r.found.iter().map(|f| f.len()).sum::<usize>();
+      if total == 0 { 1.0 } else { hits as f64 / total as f64 }
+    };
+
+    let mut order: Vec<&Run> = runs.iter().collect();
+    order.sort_by_key(|r| r.time);
+    let pick = order.iter().find(|r| recall(r) >= o.recall)
+      .or_else(|| order.iter().max_by(|a, b| recall(a).total_cmp(&recall(b))))
+      .unwrap();
+
+    println!("windows {}..{}: {} windows, {} tags", lo, max, windows.len(), total);
+    println!("  {:>10} {:>6} {:>7} {:>11} {:>10} {:>8}",
+      "decimation", "sigma", "refine", "sharpening", "us/window", "recall");
+    for r in &order {
+      let p = &r.profile;
+      println!("{} {:>10} {:>6} {:>7} {:>11} {:>10.0} {:>8.4}",
+        if std::ptr::eq(*r, *pick) { "*" } else { " " },
+        p.decimation, p.sigma, p.refine_edges, p.sharpening,
+        r.time.as_secs_f64() * 1e6 / windows.len() as f64, recall(r));
+    }
+    picks.push((max, pick.profile));
+  }
+
+  let profiles = Profiles::new(picks).to_string();
+  match o.out {
+    Some(path) => {
+      std::fs::write(&path, &profiles).expect("unable to write the profiles");
+      println!("wrote {}", path);
+    }
+    None => print!("{}", profiles),
+  }
+}
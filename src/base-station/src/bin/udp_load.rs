@@ -0,0 +1,243 @@
+// Loopback load test for the batched UDP ingest path.
+//
+// A sender thread floods a loopback socket with camera sized datagrams while
+// the receiver drains it the way a camera connection does: RecvRing,
+// TagStreamPacket parsing, Ingest and CamSink::flush into a camera queue,
+// once per batch size given on the command line. The receiver then takes
+// the batches out of the queue and recycles them like a detection worker.
+// Reports packets/s and receiver CPU time per packet, so batch size 1 is
+// the one syscall per datagram baseline. A counting allocator checks that
+// steady state ingest does not allocate: packets from the last HELD_BATCHES
+// batches are kept alive like a busy detector would, the allocs/pkt column
+// only counts after a warm-up, and any steady state allocation fails the
+// run with exit status 1.
+//
+//   cargo run --release --bin udp_load -- [payload bytes] [seconds] [batch sizes...]
+
+#[allow(dead_code)]
+#[path = "../net"]
+mod net {
+  pub mod protocol;
+  pub mod capture;
+  pub mod loss;
+  pub mod cam_ctn;
+}
+
+#[allow(dead_code)]
+#[path = "../tag_detector"]
+mod tag_detector {
+  pub mod detector;
+  pub mod image;
+}
+
+#[allow(dead_code)]
+#[path = "../config.rs"]
+mod config;
+#[allow(dead_code)]
+#[path = "../queue.rs"]
+mod queue;
+#[allow(dead_code)]
+#[path = "../util.rs"]
+mod util;
+
+use net::cam_ctn::batch::{self, RecvRing};
+use net::cam_ctn::{CamSink, Ingest};
+use net::protocol::Packet;
+use net::protocol::ts_custom::TagStreamPacket;
+use std::alloc::{GlobalAlloc, Layout, System};
+use std::collections::HashMap;
+use std::net::UdpSocket;
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use std::sync::Arc;
+use std::time::Instant;
+
+// 32x32 window plus the 12 byte tag stream header
+const DEFAULT_PAYLOAD: usize = 1036;
+const DEFAULT_SECONDS: f64 = 2.0;
+const POOL: usize = 8;
+const HELD_BATCHES: usize = 4;
+// batches queued between the receiver and its stand-in detector
+const QUEUE: usize = 4;
+const WARMUP_SECONDS: f64 = 0.2;
+
+struct CountingAlloc;
+
+static ALLOCS: AtomicU64 = AtomicU64::new(0);
+
+unsafe impl GlobalAlloc for CountingAlloc {
+  unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+    ALLOCS.fetch_add(1, Ordering::Relaxed);
+    System.alloc(layout)
+  }
+  unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+    System.dealloc(ptr, layout)
+  }
+  unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, size: usize) -> *mut u8 {
+    ALLOCS.fetch_add(1, Ordering::Relaxed);
+    System.realloc(ptr, layout, size)
+  }
+}
+
+#[global_allocator]
+static GLOBAL: CountingAlloc = CountingAlloc;
+
+fn thread_cpu_seconds() -> f64 {
+  #[cfg(target_os = "linux")]
+  let who = libc::RUSAGE_THREAD;
+  #[cfg(not(target_os = "linux"))]
+  let who = libc::RUSAGE_SELF;
+  let mut ru: libc::rusage = unsafe { std::mem::zeroed() };
+  unsafe { libc::getrusage(who, &mut ru) };
+  let t = |tv: libc::timeval| tv.tv_sec as f64 + tv.tv_usec as f64 * 1e-6;
+  t(ru.ru_utime) + t(ru.ru_stime)
+}
+
+fn recv_batch(socket: &UdpSocket, ring: &mut RecvRing) -> std::io::Result<usize> {
+  #[cfg(target_os = "linux")]
+  {
+    use std::os::fd::AsRawFd;
+    ring.recv_mmsg(socket.as_raw_fd(), libc::MSG_DONTWAIT)
+  }
+  #[cfg(not(target_os = "linux"))]
+  {
+    ring.recv_each(|buf| socket.recv(buf))
+  }
+}
+
+struct Run {
+  packets: u64,
+  bytes: u64,
+  calls: u64,
+  wall: f64,
+  cpu: f64,
+  steady_packets: u64,
+  steady_allocs: u64,
+  pool_misses: u64,
+  kernel_drops: u64,
+}
+
+fn run(batch: usize, payload: usize, seconds: f64) -> Run {
+  let rx = UdpSocket::bind("127.0.0.1:0").unwrap();
+  rx.set_nonblocking(true).unwrap();
+  #[cfg(target_os = "linux")]
+  unsafe {
+    use std::os::fd::AsRawFd;
+    let on: libc::c_int = 1;
+    libc::setsockopt(rx.as_raw_fd(), libc::SOL_SOCKET, libc::SO_RXQ_OVFL,
+                     &on as *const libc::c_int as *const libc::c_void,
+                     std::mem::size_of::<libc::c_int>() as libc::socklen_t);
+  }
+  let tx = UdpSocket::bind("127.0.0.1:0").unwrap();
+  tx.connect(rx.local_addr().unwrap()).unwrap();
+
+  let stop = Arc::new(AtomicBool::new(false));
+  let sender = {
+    let stop = stop.clone();
+    std::thread::spawn(move || {
+      let mut dgram = vec![0x5au8; payload.max(12)];
+      // 12 byte header of a window as wide as the payload allows, camera 0,
+      // one frame per datagram so the frame tracker passes every window
+      let w = (((payload.max(12) - 12) as f64).sqrt() as u16).to_le_bytes();
+      dgram[..12].copy_from_slice(&[w[0], w[1], 0, 0, 0, 0, 0, 0, 0, 0, 0, 0]);
+      let mut ts = 0u32;
+      while !stop.load(Ordering::Relaxed) {
+        ts = ts.wrapping_add(1);
+        dgram[8..12].copy_from_slice(&ts.to_le_bytes());
+        // a full receive queue shows up as ENOBUFS on some systems, keep going
+        let _ = tx.send(&dgram);
+      }
+    })
+  };
+
+  let mut ring = RecvRing::new(batch, payload, POOL);
+  let (queue_tx, mut queue) = queue::bounded::<Vec<TagStreamPacket>>(
+    format!("udp_load batch {}", batch), QUEUE, queue::Overflow::DropOldest);
+  let mut sink = CamSink::new(move |_| Some(queue_tx.clone()));
+  let mut cameras: HashMap<usize, Ingest<TagStreamPacket>> = HashMap::new();
+  let mut batches: HashMap<usize, Vec<TagStreamPacket>> = HashMap::new();
+  let mut held: Vec<Vec<TagStreamPacket>> =
+    (0..HELD_BATCHES).map(|_| Vec::with_capacity(batch::MAX_BATCH)).collect();
+  let mut r = Run {
+    packets: 0, bytes: 0, calls: 0, wall: 0.0, cpu: 0.0,
+    steady_packets: 0, steady_allocs: 0, pool_misses: 0, kernel_drops: 0
+  };
+  let mut steady: Option<(u64, u64)> = None;
+  let start = Instant::now();
+  let cpu_start = thread_cpu_seconds();
+  while start.elapsed().as_secs_f64() < seconds {
+    if steady.is_none() && start.elapsed().as_secs_f64() >= WARMUP_SECONDS {
+      steady = Some((r.packets, ALLOCS.load(Ordering::Relaxed)));
+    }
+    match recv_batch(&rx, &mut ring) {
+      Ok(n) => {
+        ring.drain(|mut d| {
+          r.bytes += d.len() as u64;
+          let p = TagStreamPacket::unmarshal(&mut d).unwrap();
+          let cam = p.cam_id().unwrap();
+          cameras.entry(cam)
+            .or_insert_with(|| Ingest::new(cam))
+            .push(p, batches.entry(cam).or_default());
+        });
+        sink.flush(&mut batches);
+        // what a detection worker does with a camera's batch
+        while let Some(mut b) = queue.try_recv() {
+          let out = &mut held[r.calls as usize % HELD_BATCHES];
+          out.clear();
+          out.extend(b.drain(..));
+          queue.recycle(b);
+        }
+        r.calls += 1;
+        r.packets += n as u64;
+      }
+      Err(e) if e.kind() == std::io::ErrorKind::WouldBlock => std::thread::yield_now(),
+      Err(e) => panic!("receive failed: {}", e),
+    }
+  }
+  r.cpu = thread_cpu_seconds() - cpu_start;
+  r.wall = start.elapsed().as_secs_f64();
+  if let Some((packets, allocs)) = steady {
+    r.steady_packets = r.packets - packets;
+    r.steady_allocs = ALLOCS.load(Ordering::Relaxed) - allocs;
+  }
+  r.pool_misses = ring.pool_misses();
+  r.kernel_drops = ring.kernel_drops();
+
+  stop.store(true, Ordering::Relaxed);
+  sender.join().unwrap();
+  r
+}
+
+fn main() {
+  let args: Vec<String> = std::env::args().skip(1).collect();
+  let payload = args.get(0).map_or(DEFAULT_PAYLOAD, |a| a.parse().expect("payload bytes"));
+  let seconds = args.get(1).map_or(DEFAULT_SECONDS, |a| a.parse().expect("seconds"));
+  let mut batches: Vec<usize> = args.iter().skip(2).map(|a| a.parse().expect("batch size")).collect();
+  if batches.is_empty() {
+    batches = vec![1, 8, 32, batch::MAX_BATCH];
+  }
+
+  println!("{} byte datagrams, {:.1} s per run", payload, seconds);
+  let mut allocating = Vec::new();
+  println!("{:>6} {:>12} {:>10} {:>12} {:>10} {:>11} {:>11} {:>12}",
+    "batch", "packets/s", "MB/s", "cpu ns/pkt", "pkt/call", "allocs/pkt", "pool miss", "kernel drop");
+  for &b in &batches {
+    let r = run(b, payload, seconds);
+    let pkts = r.packets.max(1) as f64;
+    println!("{:>6} {:>12.0} {:>10.1} {:>12.0} {:>10.2} {:>11.4} {:>11} {:>12}",
+      b.min(batch::MAX_BATCH),
+      r.packets as f64 / r.wall,
+      r.bytes as f64 / r.wall / 1e6,
+      r.cpu * 1e9 / pkts,
+      pkts / r.calls.max(1) as f64,
+      r.steady_allocs as f64 / r.steady_packets.max(1) as f64,
+      r.pool_misses,
+      r.kernel_drops);
+    if r.steady_allocs > 0 {
+      allocating.push(b);
+    }
+  }
+  if !allocating.is_empty() {
+    println!("steady state ingest allocated at batch sizes {:?}", allocating);
+    std::process::exit(1);
+  }
+}
@@ -1,9 +1,201 @@
 use crate::tag_detector::detector::TagID;
+use crate::net::capture::{Replay, Speed};
+use std::time::Duration;
 
 pub const CALIBRATION_FILE: &str = "./calibration.npy";
 pub const ADDRESS: &str = "0.0.0.0";
-// Ports range form START_PORT to (START_PORT + NUM_CAMERAS - 1)
-pub const START_PORT: usize = 3310;
-pub const MTU: usize = 100000;
-pub const NUM_CAMERAS: usize = 3;
+// Every camera sends to this port and is told apart by the id in its header
+pub const PORT: usize = 3310;
+// Sockets sharing PORT through SO_REUSEPORT, the kernel spreads cameras over them
+pub const SOCKETS: usize = 1;
 pub const TAGS: [usize;3] = [0, 1, 2];
+// Kernel receive buffer per socket
+pub const RECV_BUFFER: usize = 16 << 20;
+// SO_BUSY_POLL budget in microseconds with --busy-poll
+pub const BUSY_POLL_USEC: i32 = 50;
+// Largest datagram a camera sends, header included (MAX_WINDOW_SIZE in the firmware)
+pub const MAX_DATAGRAM: usize = 50000;
+// Datagrams pulled from an ingest socket per receive call
+pub const RECV_BATCH: usize = 32;
+// Receive chunks of RECV_BATCH datagrams per socket that packets in flight can reference
+pub const RECV_POOL: usize = 8;
+// Batches queued between the ingest sockets and the detection pool per camera, oldest dropped first
+pub const PACKET_QUEUE: usize = 4;
+// Packets an RTP camera can run ahead of a missing one before it is given up
+pub const JITTER_DEPTH: usize = 64;
+// Longest a missing RTP packet holds up the ones behind it
+pub const JITTER_HOLD: Duration = Duration::from_millis(20);
+// Detections decoded with a smaller decision margin are dropped as unsure
+pub const MIN_DECISION_MARGIN: f32 = 25.0;
+// Frames a tag track outlives its last sighting by
+pub const TRACK_MAX_AGE: i32 = 30;
+// Darkest to brightest spread below which a tracked window is decoded in full
+pub const TRACK_MIN_CONTRAST: u8 = 20;
+// Side of the square image windows are packed into with --mosaic
+pub const MOSAIC_SIZE: usize = 1024;
+// Most windows a detection worker packs into one mosaic
+pub const MOSAIC_WINDOWS: usize = 32;
+// How long a tag's filter waits for the other cameras' sightings of a frame
+// before updating with the ones it has
+pub const FUSE_HOLD: Duration = Duration::from_millis(5);
+// Filter banks the tags are split over, by id, each run by one task
+pub const FILTER_SHARDS: usize = 2;
+// Frames per second of the cameras, turns frame numbers into seconds
+pub const FRAME_RATE: f64 = 30.0;
+// Density of the process noise; with Motion::Still and FRAME_RATE this is
+// an identity covariance per frame
+pub const PROCESS_NOISE: f64 = 30.0;
+// Variance of every state component when a filter starts on its tag's
+// first sighting, or over after the camera's frame counter went back
+pub const INITIAL_VARIANCE: f64 = 100.0;
+// Side of the printed tags in metres, the unit of poses with --intrinsics
+pub const TAG_SIZE: f64 = 0.05;
+// Seconds between queue depth and drop reports, 0 to disable
+pub const QUEUE_REPORT_SECONDS: u64 = 5;
+
+const USAGE: &str = "usage: cam-server [--port N] [--sockets N] [--io-cores CORE,..] [--busy-poll] [--mosaic MS] [--min-margin X] [--track N] [--profiles FILE] [--intrinsics FILE [--tag-size M]] [--motion still|velocity|acceleration] [--frame-rate HZ] [--process-noise Q] [--lead MS] [--cameras ID,..] [--tags ID,..] [--calibration FILE] [--transport tagstream|rtp] [--record FILE] [--replay FILE [--speed X|max]]";
+
+/// How cameras wrap their windows, set with CONFIG_TRANSPORT_RTP in the firmware
+#[derive(Copy, Clone, PartialEq, Eq, Debug)]
+pub enum Transport {
+  TagStream,
+  Rtp,
+}
+
+/// What the tag filters assume about how tags move between frames
+#[derive(Copy, Clone, PartialEq, Eq, Debug)]
+pub enum Motion {
+  /// Stays put up to noise; the state is the position
+  Still,
+  /// Constant velocity; the state adds the velocity
+  Velocity,
+  /// Constant acceleration; the state adds velocity and acceleration
+  Acceleration,
+}
+
+/// Settings picked at startup, defaults come from the constants above.
+/// Cameras are only known by the id in their packets; without --cameras every
+/// camera that has a row in the calibration file is accepted.
+pub struct Settings {
+  pub port: usize,
+  pub sockets: usize,
+  // cores the ingest socket threads are pinned to, in turn; the compute
+  // pool keeps off them
+  pub io_cores: Option<Vec<usize>>,
+  pub busy_poll: bool,
+  // how long a detection worker waits for more windows to pack into a
+  // mosaic; every window is detected on its own without
+  pub mosaic: Option<Duration>,
+  pub min_margin: f32,
+  // decode windows of tracked tags in full only every this many frames
+  pub track: Option<u32>,
+  // detector settings by window size, written by tune_profiles
+  pub profiles: Option<String>,
+  // fx, fy, cx, cy per camera, to work out tag poses from
+  pub intrinsics: Option<String>,
+  pub tag_size: f64,
+  pub motion: Motion,
+  pub frame_rate: f64,
+  pub process_noise: f64,
+  // how far past their last frame the filtered positions are predicted to
+  pub lead: Duration,
+  pub cameras: Option<Vec<usize>>,
+  pub tags: Vec<TagID>,
+  pub calibration: String,
+  pub transport: Transport,
+  // capture log to write everything received to
+  pub record: Option<String>,
+  // capture log to play back instead of listening for cameras
+  pub replay: Option<Replay>,
+}
+
+fn parse_ids(arg: Option<String>) -> Vec<usize> {
+  arg.expect(USAGE)
+    .split(',')
+    .map(|id| id.trim().parse().expect(USAGE))
+    .collect()
+}
+
+impl Settings {
+  pub fn from_args() -> Settings {
+    let mut settings = Settings {
+      port: PORT,
+      sockets: SOCKETS,
+      io_cores: None,
+      busy_poll: false,
+      mosaic: None,
+      min_margin: MIN_DECISION_MARGIN,
+      track: None,
+      profiles: None,
+      intrinsics: None,
+      tag_size: TAG_SIZE,
+      motion: Motion::Still,
+      frame_rate: FRAME_RATE,
+      process_noise: PROCESS_NOISE,
+      lead: Duration::ZERO,
+      cameras: None,
+      tags: TAGS.to_vec(),
+      calibration: CALIBRATION_FILE.to_string(),
+      transport: Transport::TagStream,
+      record: None,
+      replay: None,
+    };
+    let mut speed = Speed::Scaled(1.0);
+    let mut args = std::env::args().skip(1);
+    while let Some(arg) = args.next() {
+      match arg.as_str() {
+        "--port" => settings.port = args.next().and_then(|a| a.parse().ok()).expect(USAGE),
+        "--sockets" => settings.sockets = args.next().and_then(|a| a.parse().ok()).expect(USAGE),
+        "--io-cores" => settings.io_cores = Some(parse_ids(args.next())),
+        "--busy-poll" => settings.busy_poll = true,
+        "--mosaic" => settings.mosaic = Some(Duration::from_secs_f64(
+          args.next().and_then(|a| a.parse().ok()).filter(|ms: &f64| *ms >= 0.0).expect(USAGE) / 1000.0)),
+        "--min-margin" => settings.min_margin = args.next().and_then(|a| a.parse().ok()).expect(USAGE),
+        "--track" => settings.track = Some(args.next().and_then(|a| a.parse().ok()).expect(USAGE)),
+        "--profiles" => settings.profiles = Some(args.next().expect(USAGE)),
+        "--intrinsics" => settings.intrinsics = Some(args.next().expect(USAGE)),
+        "--tag-size" => settings.tag_size = args.next().and_then(|a| a.parse().ok()).expect(USAGE),
+        "--motion" => settings.motion = match args.next().expect(USAGE).as_str() {
+          "still" => Motion::Still,
+          "velocity" => Motion::Velocity,
+          "acceleration" => Motion::Acceleration,
+          _ => panic!("{}", USAGE),
+        },
+        "--frame-rate" => settings.frame_rate =
+          args.next().and_then(|a| a.parse().ok()).filter(|hz: &f64| *hz > 0.0).expect(USAGE),
+        "--process-noise" => settings.process_noise = args.next().and_then(|a| a.parse().ok()).expect(USAGE),
+        "--lead" => settings.lead = Duration::from_secs_f64(
+          args.next().and_then(|a| a.parse().ok()).filter(|ms: &f64| *ms >= 0.0).expect(USAGE) / 1000.0),
+        "--cameras" => settings.cameras = Some(parse_ids(args.next())),
+        "--tags" => settings.tags = parse_ids(args.next()),
+        "--calibration" => settings.calibration = args.next().expect(USAGE),
+        "--transport" => settings.transport = match args.next().expect(USAGE).as_str() {
+          "tagstream" => Transport::TagStream,
+          "rtp" => Transport::Rtp,
+          _ => panic!("{}", USAGE),
+        },
+        "--record" => settings.record = Some(args.next().expect(USAGE)),
+        "--replay" => settings.replay = Some(Replay { path: args.next().expect(USAGE), speed }),
+        "--speed" => speed = match args.next().expect(USAGE).as_str() {
+          "max" => Speed::Max,
+          x => Speed::Scaled(x.parse().ok().filter(|x: &f64| *x > 0.0).expect(USAGE)),
+        },
+        _ => panic!("{}", USAGE),
+      }
+    }
+    settings.sockets = settings.sockets.max(1);
+    if let Some(replay) = settings.replay.as_mut() {
+      replay.speed = speed;
+    }
+    settings
+  }
+
+  /// Cores left for detection and filtering, every core not given to the
+  /// socket threads (all of them if nothing is left)
+  pub fn compute_cores(&self) -> Vec<usize> {
+    let cores = std::thread::available_parallelism().map_or(1, |n| n.get());
+    let io_cores = self.io_cores.as_deref().unwrap_or_default();
+    let compute: Vec<usize> = (0..cores).filter(|c| !io_cores.contains(c)).collect();
+    if compute.is_empty() { (0..cores).collect() } else { compute }
+  }
+}
@@ -1,69 +1,185 @@
 extern crate nalgebra as na;
-use na::{Vector2, Vector3, Matrix2, Matrix3, Matrix3x4, Matrix2x3};
+use na::{Vector2, Vector3, Matrix2, Matrix3x4, SMatrix, SVector};
 use std::collections::HashMap;
 use tokio::task::JoinHandle;
-use tokio::sync::{mpsc, mpsc::{UnboundedSender, UnboundedReceiver}};
+use tokio::time::{timeout_at, Instant};
 use npyz;
 use crate::config;
+use crate::config::Motion;
+use crate::queue;
+use crate::filter_bank::FilterBank;
+use crate::net::loss::{self, MAX_FRAME_BACKSTEP};
 
 use crate::tag_detector::detector::TagID;
 
-// Assuming the camera_matrix is a 3x4 matrix and x is a 3x1 vector
-fn motion_model(x: &Vector3<f64>, dt: u32) -> Vector3<f64> {
-  *x
+// The state is N/3 blocks of 3: the position, then as many of its
+// derivatives as the motion model carries
+fn factorial(n: usize) -> f64 {
+  (1..=n).product::<usize>() as f64
 }
 
-fn motion_jacobian(x: &Vector3<f64>) -> Matrix3<f64> {
-  Matrix3::identity()
+// Each derivative carries the ones below it along over dt seconds
+fn motion_jacobian<const N: usize>(dt: f64) -> SMatrix<f64, N, N> {
+  let mut f = SMatrix::<f64, N, N>::zeros();
+  for i in 0..N / 3 {
+    for j in i..N / 3 {
+      let c = dt.powi((j - i) as i32) / factorial(j - i);
+      for k in 0..3 {
+        f[(3 * i + k, 3 * j + k)] = c;
+      }
+    }
+  }
+  f
+}
+
+fn motion_model<const N: usize>(x: &SVector<f64, N>, dt: f64) -> SVector<f64, N> {
+  motion_jacobian::<N>(dt) * x
+}
+
+// White noise of density q on the highest derivative, integrated over dt
+// seconds down to the position
+fn process_noise<const N: usize>(q: f64, dt: f64) -> SMatrix<f64, N, N> {
+  let n = N / 3;
+  let mut m = SMatrix::<f64, N, N>::zeros();
+  for i in 0..n {
+    for j in 0..n {
+      let p = 2 * n - 1 - i - j;
+      let c = q * dt.powi(p as i32) / (factorial(n - 1 - i) * factorial(n - 1 - j) * p as f64);
+      for k in 0..3 {
+        m[(3 * i + k, 3 * j + k)] = c;
+      }
+    }
+  }
+  m
 }
 
-fn measurement_model(x: &Vector3<f64>, camera_matrix: &Matrix3x4<f64>) -> Vector2<f64> {
-  camera_matrix.fixed_slice::<2,3>(0, 0) * x + camera_matrix.fixed_slice::<2,1>(0, 3)
+// Assuming the camera_matrix is a 3x4 matrix; only the position is seen
+fn measurement_model<const N: usize>(x: &SVector<f64, N>, camera_matrix: &Matrix3x4<f64>) -> Vector2<f64> {
+  camera_matrix.fixed_slice::<2,3>(0, 0) * x.fixed_rows::<3>(0) + camera_matrix.fixed_slice::<2,1>(0, 3)
 }
-fn measurement_jacobian(camera_matrix: &Matrix3x4<f64>) -> Matrix2x3<f64> {
-  Matrix2x3::from(camera_matrix.fixed_slice::<2,3>(0, 0))
+fn measurement_jacobian<const N: usize>(camera_matrix: &Matrix3x4<f64>) -> SMatrix<f64, 2, N> {
+  let mut h = SMatrix::<f64, 2, N>::zeros();
+  h.fixed_columns_mut::<3>(0).copy_from(&camera_matrix.fixed_slice::<2,3>(0, 0));
+  h
+}
+
+// An innovation covariance whose determinant is below this share of the
+// product of its diagonal is too close to singular to invert
+const MIN_CONDITION: f64 = 1e-12;
+
+/// Closed-form inverse (i00, i01, i11) of the symmetric innovation
+/// covariance [s00 s01; s01 s11], None when it is too close to singular
+/// for the sighting to be used
+#[inline]
+pub fn invert_innovation(s00: f64, s01: f64, s11: f64) -> Option<(f64, f64, f64)> {
+  let det = s00 * s11 - s01 * s01;
+  if !(s00 > 0.0 && s11 > 0.0 && det > MIN_CONDITION * s00 * s11) {
+    return None;
+  }
+  Some((s11 / det, -s01 / det, s00 / det))
+}
+
+/// How the filters predict between frames
+#[derive(Copy, Clone, Debug)]
+pub struct Model {
+  pub motion: Motion,
+  // turns frame numbers into seconds
+  pub frame_rate: f64,
+  // density of the white noise driving the highest derivative of the state
+  pub process_noise: f64,
+  // seconds past its last frame each position is predicted to before it is
+  // passed on, to make up for the pipeline's latency
+  pub lead: f64,
+}
+
+/// One sighting of a tag by a camera: its centre in camera pixels
+#[derive(Copy, Clone, Debug)]
+pub struct Observation {
+  pub center: Vector2<f64>,
+}
+
+/// Frames from last to timestep, negative for an older frame; None when
+/// timestep is so far behind that the camera restarted and a filter should
+/// start over
+pub fn frames_since(last: Timestamp, timestep: Timestamp) -> Option<i64> {
+  let d = timestep.wrapping_sub(last) as i32 as i64;
+  if d < -MAX_FRAME_BACKSTEP { None } else { Some(d) }
 }
 
-pub struct EKF {
+/// Filter for one tag, with a state of N/3 blocks of 3 (see Motion)
+pub struct EKF<const N: usize> {
   r: Matrix2<f64>,
-  q: Matrix3<f64>,
-  pub x: Vector3<f64>,
-  cov: Matrix3<f64>,
-  cov_init: Matrix3<f64>,
-  most_recent_timestep: u32,
-  dt: u32
+  q: f64,
+  frame_rate: f64,
+  pub x: SVector<f64, N>,
+  cov: SMatrix<f64, N, N>,
+  x_init: SVector<f64, N>,
+  cov_init: SMatrix<f64, N, N>,
+  // None until the first sighting
+  most_recent_timestep: Option<u32>,
+  // seconds between the last two frames
+  dt: f64
 }
 
-impl EKF {
-  pub fn new(meas_cov: Matrix2<f64>, proc_cov: Matrix3<f64>, 
-             x_init: Vector3<f64>, cov_init: Matrix3<f64>) -> EKF {
+impl<const N: usize> EKF<N> {
+  pub fn new(meas_cov: Matrix2<f64>, proc_noise: f64, frame_rate: f64,
+             x_init: SVector<f64, N>, cov_init: SMatrix<f64, N, N>) -> EKF<N> {
     EKF {
       r: meas_cov,
-      q: proc_cov,
+      q: proc_noise,
+      frame_rate,
       x: x_init,
       cov: cov_init,
-      cov_init: cov_init,
-      most_recent_timestep: 0,
-      dt: 0
+      x_init,
+      cov_init,
+      most_recent_timestep: None,
+      dt: 0.0
     }
   }
 
-  pub fn filter(&mut self, meas: Vector2<f64>, t: Matrix3x4<f64>, timestep: u32) {
-    if timestep > self.most_recent_timestep {
-      self.dt = timestep - self.most_recent_timestep;
-      self.most_recent_timestep = timestep;
+  /// Fold in every camera's sighting of the tag in frame timestep: one
+  /// prediction, then an update per camera in camera order. The measurement
+  /// model is linear in the position, so this is the same as one update
+  /// with all cameras stacked, whatever order their packets came in.
+  /// Everything is fixed-size, nothing is allocated. The first frame, and
+  /// one far behind the last, start the filter over from x_init and
+  /// cov_init without a prediction.
+  pub fn filter(&mut self, timestep: u32, sightings: &[Sighting]) {
+    match self.most_recent_timestep.and_then(|last| frames_since(last, timestep)) {
+      None => {
+        self.x = self.x_init;
+        self.cov = self.cov_init;
+        self.dt = 0.0;
+        self.most_recent_timestep = Some(timestep);
+      }
+      Some(d) if d > 0 => {
+        self.dt = d as f64 / self.frame_rate;
+        self.most_recent_timestep = Some(timestep);
 
-      let f = motion_jacobian(&self.x);
-      self.x = motion_model(&self.x, self.dt);
-      self.cov = &f * &self.cov * f.transpose() + &self.q;
+        let f = motion_jacobian::<N>(self.dt);
+        self.x = f * self.x;
+        self.cov = f * self.cov * f.transpose() + process_noise::<N>(self.q, self.dt);
+      }
+      Some(_) => {}
+    }
+    for (_, t, obs) in sightings {
+      let h = measurement_jacobian::<N>(t);
+      let y = obs.center - measurement_model(&self.x, t);
+      let r = self.r;
+      let ph = self.cov * h.transpose();
+      let s = h * ph + r;
+      let Some((i00, i01, i11)) = invert_innovation(s.m11, 0.5 * (s.m12 + s.m21), s.m22) else { continue };
+      let k = ph * Matrix2::new(i00, i01, i01, i11);
+      self.x += k * y;
+      // Joseph form, stays symmetric and positive where P - KHP drifts
+      let a = SMatrix::<f64, N, N>::identity() - k * h;
+      self.cov = a * self.cov * a.transpose() + k * r * k.transpose();
     }
-    let h = measurement_jacobian(&t);
-    let y = meas - measurement_model(&self.x, &t);
-    let s = &h * &self.cov * h.transpose() + &self.r;
-    let s_dg = s.pseudo_inverse(1e-8).unwrap();
-    let k = &self.cov * (h.transpose() * s_dg);
-    self.x += &k * y;
-    self.cov = (Matrix3::identity() - &k * &h) * &self.cov;
+  }
+
+  /// Where the tag is predicted to be secs after its last frame
+  pub fn position_at(&self, secs: f64) -> Vector3<f64> {
+    motion_model(&self.x, secs).fixed_rows::<3>(0).into_owned()
   }
 }
 
@@ -71,13 +187,35 @@ pub type CamID = usize;
 pub type Timestamp = u32;
 pub type DetectionInfo = (CamID, TagID, Timestamp, f64,f64);
 pub type CalData = Matrix3x4<f64>;
-pub type FilterArgs = (CalData, Vector2<f64>, Timestamp);
+pub type FilterArgs = (CamID, CalData, Observation, Timestamp);
+/// A camera's sighting of a tag, with the camera's calibration
+pub type Sighting = (CamID, CalData, Observation);
 
-type Snd<T> = UnboundedSender<T>;
-type Recv<T> = UnboundedReceiver<T>;
+type Snd<T> = queue::Tx<T>;
+type Recv<T> = queue::Rx<T>;
+
+// Sightings of one tag in one frame, gathered until deadline at the latest
+struct Frame {
+  timestamp: Timestamp,
+  deadline: Instant,
+  sightings: Vec<Sighting>,
+}
+
+impl Frame {
+  fn new(timestamp: Timestamp, cameras: usize) -> Frame {
+    Frame {
+      timestamp,
+      deadline: Instant::now() + config::FUSE_HOLD,
+      sightings: Vec::with_capacity(cameras),
+    }
+  }
+}
 
 pub struct EKFThreadPool {
-  threads: HashMap<TagID, (Snd<FilterArgs>, JoinHandle<()>)>,
+  // a filter bank's queue and task per shard, with the shard and lane of
+  // every tag; the queues carry sightings by lane
+  shards: Vec<(Snd<(usize, FilterArgs)>, JoinHandle<()>)>,
+  shard_of: HashMap<TagID, (usize, usize)>,
   calibration: HashMap<TagID, CalData>,
   tx: Snd<(TagID, Vector3<f64>)>,
 }
@@ -85,54 +223,148 @@ pub struct EKFThreadPool {
 
 impl EKFThreadPool {
   pub fn new(tagpos_tx:Snd<(TagID, Vector3<f64>)>,
+             model: Model,
              cal_file_path: &str,
+             cameras: Option<&[CamID]>,
              ids: &[TagID]) -> EKFThreadPool {
     //read in calibration data
     let cal_file = std::fs::read(cal_file_path)
       .expect(&format!("unable to find the specified configuration at \"{}\"", cal_file_path));
     let cal_data = npyz::NpyFile::new(&cal_file[..]).unwrap().into_vec::<f64>().unwrap();
+    // one 3x4 projection per camera, camera ids index the rows
+    let rows = cal_data.len() / 12;
+    let cameras = cameras.map_or((0..rows).collect(), |c| c.to_vec());
     let mut calibration: HashMap<usize, Matrix3x4<f64>> = HashMap::new();
-    for i in 0..config::NUM_CAMERAS {
+    for i in cameras {
+      if i >= rows {
+        panic!("camera {} has no calibration in \"{}\"", i, cal_file_path);
+      }
       calibration.insert(i,Matrix3x4::<f64>::from_row_slice(&cal_data[i*12..(i*12+12)]));
     }
+    let num_cameras = calibration.len();
 
-    // create an ekf for each tag and parallelize it into a thread
-    let threads = ids.iter().fold(HashMap::new(), |mut tds, id| {
-      let (detinfo_tx, mut detinfo_rx) = mpsc::unbounded_channel::<FilterArgs>();
-      let ekf = EKF::new(1.0 * Matrix2::identity(),
-                         1.0 * Matrix3::identity(),
-                         Vector3::zeros(),
-                         Matrix3::zeros());
-      tds.insert(*id, (detinfo_tx, Self::new_proxy(ekf, tagpos_tx.clone(), detinfo_rx, *id))); 
-      return tds
-    });
+    // split the tags over a few filter banks, each run by one task
+    let shards = config::FILTER_SHARDS.min(ids.len()).max(1);
+    let mut shard_of = HashMap::new();
+    let mut shard_ids: Vec<Vec<TagID>> = vec![Vec::new(); shards];
+    for id in ids {
+      let shard = id % shards;
+      if !shard_of.contains_key(id) {
+        shard_of.insert(*id, (shard, shard_ids[shard].len()));
+        shard_ids[shard].push(*id);
+      }
+    }
+    let shards = shard_ids.iter().enumerate().map(|(n, ids)| {
+      let (tx, rx) = queue::bounded::<(usize, FilterArgs)>(
+        format!("filter bank {}", n), ids.len() * num_cameras, queue::Overflow::LatestWins);
+      let bank = FilterBank::new(ids, &model);
+      (tx, Self::new_shard(bank, tagpos_tx.clone(), rx, num_cameras, model.lead))
+    }).collect();
 
     EKFThreadPool {
-      threads, 
+      shards,
+      shard_of,
       calibration,
       tx: tagpos_tx,
     }
   }
-  // Wraps an ekf into a thread and consolidates
-  // output into the same channel
-  fn new_proxy(mut ekf: EKF, current_pos_tx: Snd<(TagID, Vector3<f64>)>,
-                mut rx: Recv<FilterArgs>, id: usize) -> JoinHandle<()>{
+
+  // Runs a filter bank as a task and consolidates output into the same
+  // channel. Each tag's sightings are gathered a frame at a time: until
+  // every camera has reported, a newer frame turns up or config::FUSE_HOLD
+  // has passed since the first one. Sightings of an older frame, or of one
+  // already closed, are counted as stale and dropped. Whatever frames are
+  // complete when the queue runs dry go through the bank in one step.
+  fn new_shard(mut bank: FilterBank, current_pos_tx: Snd<(TagID, Vector3<f64>)>,
+               mut rx: Recv<(usize, FilterArgs)>, cameras: usize, lead: f64) -> JoinHandle<()> {
     tokio::spawn(async move {
+      let mut open: Vec<Option<Frame>> = (0..bank.lanes()).map(|_| None).collect();
+      // timestamp of each lane's last closed frame
+      let mut closed: Vec<Option<Timestamp>> = vec![None; bank.lanes()];
+      let mut ready: Vec<(usize, Timestamp, Vec<Sighting>)> = Vec::new();
+      let mut step: Vec<(usize, Timestamp, Vec<Sighting>)> = Vec::new();
+      let mut stepped = vec![false; bank.lanes()];
       loop {
-        let (calmat, pos, timestamp) = rx.recv().await.unwrap();
-        //println!("reaceived detected tag on ekf {}", id);
-        ekf.filter(pos, calmat, timestamp);
-        //println!("[EKF {}] sending <{},{},{}>", id, ekf.x.x, ekf.x.y, ekf.x.z );
-        current_pos_tx.send((id, ekf.x));
+        let deadline = open.iter().flatten().map(|f| f.deadline).min();
+        let next = match deadline {
+          Some(d) => timeout_at(d, rx.recv()).await.ok(),
+          None => Some(rx.recv().await),
+        };
+        let mut next = match next {
+          Some(None) => return,
+          Some(Some(args)) => Some(args),
+          None => None,
+        };
+        while let Some((lane, (camid, calmat, obs, timestamp))) = next.take().or_else(|| rx.try_recv()) {
+          // a sighting of a frame older than the lane's open one, or of one
+          // already closed, would mix frames whichever order they arrived in
+          let stale = match (&open[lane], closed[lane]) {
+            (Some(f), _) => frames_since(f.timestamp, timestamp).map_or(false, |d| d < 0),
+            (None, Some(t)) => frames_since(t, timestamp).map_or(false, |d| d <= 0),
+            (None, None) => false,
+          };
+          if stale {
+            loss::Counters::add(&loss::counters(camid).stale, 1);
+            continue;
+          }
+          // a newer frame closes the open one, and so does a restarted camera's
+          if open[lane].as_ref().map_or(false, |f| f.timestamp != timestamp) {
+            let f = open[lane].take().unwrap();
+            closed[lane] = Some(f.timestamp);
+            ready.push((lane, f.timestamp, f.sightings));
+          }
+          let frame = open[lane].get_or_insert_with(|| Frame::new(timestamp, cameras));
+          // a camera's newer window of the same frame replaces its older one
+          match frame.sightings.iter_mut().find(|s| s.0 == camid) {
+            Some(s) => *s = (camid, calmat, obs),
+            None => frame.sightings.push((camid, calmat, obs)),
+          }
+        }
+
+        let now = Instant::now();
+        for (lane, slot) in open.iter_mut().enumerate() {
+          if slot.as_ref().map_or(false, |f| f.sightings.len() >= cameras || f.deadline <= now) {
+            let f = slot.take().unwrap();
+            closed[lane] = Some(f.timestamp);
+            ready.push((lane, f.timestamp, f.sightings));
+          }
+        }
+        // a lane goes through the bank once per step, older frames first
+        while !ready.is_empty() {
+          let mut later = Vec::new();
+          for (lane, timestamp, mut sightings) in ready.drain(..) {
+            if stepped[lane] {
+              later.push((lane, timestamp, sightings));
+            } else {
+              stepped[lane] = true;
+              sightings.sort_by_key(|s| s.0);
+              step.push((lane, timestamp, sightings));
+            }
+          }
+          bank.filter(&step);
+          for (lane, _, _) in step.drain(..) {
+            stepped[lane] = false;
+            let id = bank.id(lane);
+            current_pos_tx.send(id, (id, bank.position_at(lane, lead)));
+          }
+          ready = later;
+        }
       }
     })
   }
 
+  pub fn has_camera(&self, camid: CamID) -> bool {
+    self.calibration.contains_key(&camid)
+  }
+
   pub fn send(&self, tid: TagID, camid: usize,
-              px: f64, py: f64, timestamp: u32 ) {
-    let calmat = self.calibration[&camid];
-    let pos = Vector2::<f64>::new(px, py);
-    self.threads[&tid].0.send((calmat, pos, timestamp));
+              obs: Observation, timestamp: u32 ) {
+    // tags outside the configured set have no filter
+    if let Some(&(shard, lane)) = self.shard_of.get(&tid) {
+      let calmat = self.calibration[&camid];
+      // the newest sighting per tag and camera waits
+      self.shards[shard].0.send((tid << 16) | camid, (lane, (camid, calmat, obs, timestamp)));
+    }
   }
 }
 
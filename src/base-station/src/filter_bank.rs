@@ -0,0 +1,439 @@
+// Tag filters kept side by side.
+//
+// Every tag of a bank is a lane. The state and covariance are stored
+// component-major: component c of every lane is one contiguous run, so a
+// filter step is a series of loops over lanes doing the same arithmetic on
+// each, which the compiler can vectorize. A step only covers the lanes with
+// a new frame: their state and covariance are gathered into packed runs,
+// one slot per lane, stepped and scattered back, so a step costs what its
+// lanes cost however many tags the bank holds. A slot with fewer sightings
+// than the others is updated with a zero measurement jacobian in the extra
+// rounds, which leaves it as it is. A lane starts
+// on its tag's first frame, and starts over when the frame counter jumps
+// back, at the origin with config::INITIAL_VARIANCE and no prediction.
+
+extern crate nalgebra as na;
+use na::Vector3;
+use crate::ekf::{frames_since, invert_innovation, Model, Sighting, Timestamp};
+use crate::config;
+use crate::config::Motion;
+use crate::tag_detector::detector::TagID;
+
+fn factorial(n: usize) -> f64 {
+  (1..=n).product::<usize>() as f64
+}
+
+pub struct FilterBank {
+  // tag of every lane
+  ids: Vec<TagID>,
+  // blocks of 3 in the state: position, velocity, acceleration
+  blocks: usize,
+  // state size, 3 * blocks
+  n: usize,
+  lanes: usize,
+  r: [[f64; 2]; 2],
+  q: f64,
+  frame_rate: f64,
+  // state component c of lane s at x[c * lanes + s], covariance element
+  // (a, b) at cov[(a * n + b) * lanes + s]
+  x: Vec<f64>,
+  cov: Vec<f64>,
+  // None until the lane's first frame
+  last_ts: Vec<Option<Timestamp>>,
+  // lane of each of the step's active slots, and the slots' state and
+  // covariance, laid out like x and cov with active in place of lanes
+  slots: Vec<usize>,
+  active: usize,
+  px: Vec<f64>,
+  pcov: Vec<f64>,
+  // scratch, one run per quantity, slot count long
+  dt: Vec<f64>,
+  coef: Vec<f64>,
+  h: Vec<f64>,
+  off: Vec<f64>,
+  z: Vec<f64>,
+  s_inv: Vec<f64>,
+  ph: Vec<f64>,
+  k: Vec<f64>,
+}
+
+impl FilterBank {
+  pub fn new(ids: &[TagID], model: &Model) -> FilterBank {
+    let blocks = match model.motion {
+      Motion::Still => 1,
+      Motion::Velocity => 2,
+      Motion::Acceleration => 3,
+    };
+    let (n, lanes) = (3 * blocks, ids.len());
+    let mut bank = FilterBank {
+      ids: ids.to_vec(),
+      blocks,
+      n,
+      lanes,
+      r: [[1.0, 0.0], [0.0, 1.0]],
+      q: model.process_noise,
+      frame_rate: model.frame_rate,
+      x: vec![0.0; n * lanes],
+      cov: vec![0.0; n * n * lanes],
+      last_ts: vec![None; lanes],
+      slots: vec![0; lanes],
+      active: 0,
+      px: vec![0.0; n * lanes],
+      pcov: vec![0.0; n * n * lanes],
+      dt: vec![0.0; lanes],
+      coef: vec![0.0; blocks * lanes],
+      h: vec![0.0; 6 * lanes],
+      off: vec![0.0; 2 * lanes],
+      z: vec![0.0; 2 * lanes],
+      s_inv: vec![0.0; 3 * lanes],
+      ph: vec![0.0; 2 * n * lanes],
+      k: vec![0.0; 2 * n * lanes],
+    };
+    for lane in 0..lanes {
+      bank.reset(lane);
+    }
+    bank
+  }
+
+  pub fn id(&self, lane: usize) -> TagID {
+    self.ids[lane]
+  }
+
+  pub fn lanes(&self) -> usize {
+    self.lanes
+  }
+
+  /// One filter step for every lane with a frame in frames: (lane, frame,
+  /// sightings in camera order), each lane at most once. Lanes get one
+  /// prediction and an update per sighting, like EKF::filter.
+  pub fn filter<S: AsRef<[Sighting]>>(&mut self, frames: &[(usize, Timestamp, S)]) {
+    let l = frames.len();
+    self.active = l;
+    self.dt[..l].fill(0.0);
+    for (slot, &(lane, ts, _)) in frames.iter().enumerate() {
+      self.slots[slot] = lane;
+      match self.last_ts[lane].and_then(|last| frames_since(last, ts)) {
+        None => self.reset(lane),
+        Some(d) if d > 0 => self.dt[slot] = d as f64 / self.frame_rate,
+        Some(_) => continue,
+      }
+      self.last_ts[lane] = Some(ts);
+    }
+    self.gather();
+    self.predict();
+
+    let rounds = frames.iter().map(|(_, _, s)| s.as_ref().len()).max().unwrap_or(0);
+    for round in 0..rounds {
+      self.h[..6 * l].fill(0.0);
+      self.off[..2 * l].fill(0.0);
+      self.z[..2 * l].fill(0.0);
+      for (slot, (_, _, sightings)) in frames.iter().enumerate() {
+        let Some((_, t, obs)) = sightings.as_ref().get(round) else { continue };
+        for row in 0..2 {
+          for col in 0..3 {
+            self.h[(row * 3 + col) * l + slot] = t[(row, col)];
+          }
+          self.off[row * l + slot] = t[(row, 3)];
+        }
+        self.z[slot] = obs.center.x;
+        self.z[l + slot] = obs.center.y;
+      }
+      self.update();
+    }
+    self.scatter();
+  }
+
+  /// Where lane's tag is predicted to be secs after its last frame
+  pub fn position_at(&self, lane: usize, secs: f64) -> Vector3<f64> {
+    let l = self.lanes;
+    let mut p = [0.0; 3];
+    for k in 0..3 {
+      for j in 0..self.blocks {
+        p[k] += secs.powi(j as i32) / factorial(j) * self.x[(3 * j + k) * l + lane];
+      }
+    }
+    Vector3::new(p[0], p[1], p[2])
+  }
+
+  // Put lane back at the origin with the initial covariance
+  fn reset(&mut self, lane: usize) {
+    let (n, l) = (self.n, self.lanes);
+    for a in 0..n {
+      self.x[a * l + lane] = 0.0;
+      for b in 0..n {
+        self.cov[(a * n + b) * l + lane] = if a == b { config::INITIAL_VARIANCE } else { 0.0 };
+      }
+    }
+  }
+
+  // Whether the step's slots are every lane in lane order, so gather and
+  // scatter can hand the storage over instead of copying it
+  fn dense(&self) -> bool {
+    self.active == self.lanes && self.slots.iter().enumerate().all(|(slot, &lane)| slot == lane)
+  }
+
+  // Copy the step's lanes into their slots
+  fn gather(&mut self) {
+    if self.dense() {
+      std::mem::swap(&mut self.x, &mut self.px);
+      std::mem::swap(&mut self.cov, &mut self.pcov);
+      return;
+    }
+    let (lanes, l) = (self.lanes, self.active);
+    for c in 0..self.n {
+      for (slot, &lane) in self.slots[..l].iter().enumerate() {
+        self.px[c * l + slot] = self.x[c * lanes + lane];
+      }
+    }
+    for e in 0..self.n * self.n {
+      for (slot, &lane) in self.slots[..l].iter().enumerate() {
+        self.pcov[e * l + slot] = self.cov[e * lanes + lane];
+      }
+    }
+  }
+
+  // Copy the slots back to their lanes
+  fn scatter(&mut self) {
+    if self.dense() {
+      std::mem::swap(&mut self.x, &mut self.px);
+      std::mem::swap(&mut self.cov, &mut self.pcov);
+      return;
+    }
+    let (lanes, l) = (self.lanes, self.active);
+    for c in 0..self.n {
+      for (slot, &lane) in self.slots[..l].iter().enumerate() {
+        self.x[c * lanes + lane] = self.px[c * l + slot];
+      }
+    }
+    for e in 0..self.n * self.n {
+      for (slot, &lane) in self.slots[..l].iter().enumerate() {
+        self.cov[e * lanes + lane] = self.pcov[e * l + slot];
+      }
+    }
+  }
+
+  // x = F x, P = F P F' + Q over every slot's dt. F adds dt^d / d! of
+  // block i + d to block i, so working up from the position block each
+  // block only reads ones not changed yet.
+  fn predict(&mut self) {
+    let (n, b, l) = (self.n, self.blocks, self.active);
+    for d in 0..b {
+      let f = factorial(d);
+      for (c, dt) in self.coef[d * l..(d + 1) * l].iter_mut().zip(&self.dt) {
+        *c = dt.powi(d as i32) / f;
+      }
+    }
+    for i in 0..b {
+      for j in i + 1..b {
+        let coef = &self.coef[(j - i) * l..(j - i + 1) * l];
+        for k in 0..3 {
+          axpy(&mut self.px, (3 * i + k) * l, (3 * j + k) * l, coef);
+          for c in 0..n {
+            // rows: F P
+            axpy(&mut self.pcov, ((3 * i + k) * n + c) * l, ((3 * j + k) * n + c) * l, coef);
+          }
+        }
+      }
+    }
+    for i in 0..b {
+      for j in i + 1..b {
+        let coef = &self.coef[(j - i) * l..(j - i + 1) * l];
+        for k in 0..3 {
+          for r in 0..n {
+            // columns: (F P) F'
+            axpy(&mut self.pcov, (r * n + 3 * i + k) * l, (r * n + 3 * j + k) * l, coef);
+          }
+        }
+      }
+    }
+    for i in 0..b {
+      for j in 0..b {
+        let p = 2 * b - 1 - i - j;
+        let c = self.q / (factorial(b - 1 - i) * factorial(b - 1 - j) * p as f64);
+        for k in 0..3 {
+          let e = ((3 * i + k) * n + 3 * j + k) * l;
+          for (v, dt) in self.pcov[e..e + l].iter_mut().zip(&self.dt) {
+            *v += c * dt.powi(p as i32);
+          }
+        }
+      }
+    }
+  }
+
+  // One measurement per slot from the scratch runs h, off and z. Kept out
+  // of filter: inlined there it vectorizes worse and runs at half speed.
+  #[inline(never)]
+  fn update(&mut self) {
+    let (n, l) = (self.n, self.active);
+    // P H', n x 2
+    self.ph[..2 * n * l].fill(0.0);
+    for a in 0..n {
+      for row in 0..2 {
+        let dst = (a * 2 + row) * l;
+        for m in 0..3 {
+          let p = &self.pcov[(a * n + m) * l..(a * n + m + 1) * l];
+          let h = &self.h[(row * 3 + m) * l..(row * 3 + m + 1) * l];
+          for ((v, p), h) in self.ph[dst..dst + l].iter_mut().zip(p).zip(h) {
+            *v += p * h;
+          }
+        }
+      }
+    }
+    // S = H P H' + R, inverted in closed form; a sighting whose S is too
+    // close to singular gets no gain
+    let (r, h, ph) = (self.r, &self.h, &self.ph);
+    for s in 0..l {
+      let hs = |row: usize, m: usize| h[(row * 3 + m) * l + s];
+      let phs = |m: usize, row: usize| ph[(m * 2 + row) * l + s];
+      let mut sm = [[0.0; 2]; 2];
+      for a in 0..2 {
+        for b in 0..2 {
+          sm[a][b] = (0..3).map(|m| hs(a, m) * phs(m, b)).sum::<f64>() + r[a][b];
+        }
+      }
+      let (i00, i01, i11) = invert_innovation(sm[0][0], 0.5 * (sm[0][1] + sm[1][0]), sm[1][1])
+        .unwrap_or((0.0, 0.0, 0.0));
+      self.s_inv[s] = i00;
+      self.s_inv[l + s] = i01;
+      self.s_inv[2 * l + s] = i11;
+    }
+    // K = P H' S^-1, n x 2
+    for a in 0..n {
+      for s in 0..l {
+        let (p0, p1) = (self.ph[(a * 2) * l + s], self.ph[(a * 2 + 1) * l + s]);
+        let (i00, i01, i11) = (self.s_inv[s], self.s_inv[l + s], self.s_inv[2 * l + s]);
+        self.k[(a * 2) * l + s] = p0 * i00 + p1 * i01;
+        self.k[(a * 2 + 1) * l + s] = p0 * i01 + p1 * i11;
+      }
+    }
+    // innovation, into z
+    for row in 0..2 {
+      for s in 0..l {
+        let seen = (0..3).map(|m| self.h[(row * 3 + m) * l + s] * self.px[m * l + s]).sum::<f64>();
+        self.z[row * l + s] -= seen + self.off[row * l + s];
+      }
+    }
+    // x += K y, and the Joseph form P = (I - KH) P (I - KH)' + K R K' in
+    // two halves: T = P - K (P H')', then P = T - (T H') K' + K R K'
+    for a in 0..n {
+      for s in 0..l {
+        self.px[a * l + s] += self.k[(a * 2) * l + s] * self.z[s] + self.k[(a * 2 + 1) * l + s] * self.z[l + s];
+      }
+      for c in 0..n {
+        let e = (a * n + c) * l;
+        for s in 0..l {
+          self.pcov[e + s] -= self.k[(a * 2) * l + s] * self.ph[(c * 2) * l + s]
+            + self.k[(a * 2 + 1) * l + s] * self.ph[(c * 2 + 1) * l + s];
+        }
+      }
+    }
+    // T H', n x 2, into ph
+    self.ph[..2 * n * l].fill(0.0);
+    for a in 0..n {
+      for row in 0..2 {
+        let dst = (a * 2 + row) * l;
+        for m in 0..3 {
+          let t = &self.pcov[(a * n + m) * l..(a * n + m + 1) * l];
+          let h = &self.h[(row * 3 + m) * l..(row * 3 + m + 1) * l];
+          for ((v, t), h) in self.ph[dst..dst + l].iter_mut().zip(t).zip(h) {
+            *v += t * h;
+          }
+        }
+      }
+    }
+    for a in 0..n {
+      for c in 0..n {
+        let e = (a * n + c) * l;
+        for s in 0..l {
+          let (ka0, ka1) = (self.k[(a * 2) * l + s], self.k[(a * 2 + 1) * l + s]);
+          let (kc0, kc1) = (self.k[(c * 2) * l + s], self.k[(c * 2 + 1) * l + s]);
+          let krk = ka0 * (r[0][0] * kc0 + r[0][1] * kc1) + ka1 * (r[1][0] * kc0 + r[1][1] * kc1);
+          self.pcov[e + s] += krk - self.ph[(a * 2) * l + s] * kc0 - self.ph[(a * 2 + 1) * l + s] * kc1;
+        }
+      }
+    }
+  }
+}
+
+// v[dst..] += coef * v[src..], one run of lanes each, dst before src
+fn axpy(v: &mut [f64], dst: usize, src: usize, coef: &[f64]) {
+  let l = coef.len();
+  let (lo, hi) = v.split_at_mut(src);
+  for ((d, s), c) in lo[dst..dst + l].iter_mut().zip(&hi[..l]).zip(coef) {
+    *d += c * s;
+  }
+}
+
+#[cfg(test)]
+mod tests {
+  use super::*;
+  use crate::ekf::{CalData, Observation, EKF};
+  use na::{Matrix2, SMatrix, SVector, Vector2};
+
+  // Deterministic noise in -0.5..0.5
+  fn noise(seed: &mut u64) -> f64 {
+    *seed = seed.wrapping_mul(6364136223846793005).wrapping_add(1442695040888963407);
+    (*seed >> 11) as f64 / (1u64 << 53) as f64 - 0.5
+  }
+
+  // A bank and one EKF<N> per tag go through the same steps: a varying
+  // subset of the tags with one to three cameras each, a tag that first
+  // turns up late, and cameras that restart with their frame counter back
+  // at 1. Every tag's predicted position has to agree after every step.
+  fn matches_ekf<const N: usize>(motion: Motion) {
+    let model = Model {
+      motion,
+      frame_rate: config::FRAME_RATE,
+      process_noise: config::PROCESS_NOISE,
+      lead: 0.0,
+    };
+    let ids: Vec<TagID> = (0..7).collect();
+    let mut bank = FilterBank::new(&ids, &model);
+    let mut filters: Vec<EKF<N>> = ids.iter().map(|_| {
+      EKF::new(Matrix2::identity(), model.process_noise, model.frame_rate,
+               SVector::zeros(), SMatrix::identity() * config::INITIAL_VARIANCE)
+    }).collect();
+    let mut seed = 1;
+    let cams: Vec<CalData> = (0..3).map(|_| {
+      CalData::from_fn(|_, c| noise(&mut seed) * if c == 3 { 100.0 } else { 10.0 })
+    }).collect();
+    for f in 1..80u32 {
+      let ts = if f > 50 { f - 50 } else { f + 5000 };
+      let mut frames = Vec::new();
+      for lane in 0..ids.len() {
+        if (f as usize + lane) % 3 == 0 || (lane == 6 && f < 20) {
+          continue;
+        }
+        let sightings: Vec<Sighting> = (0..1 + (f as usize + lane) % 3).map(|c| {
+          let center = Vector2::new(50.0 * noise(&mut seed) + f as f64, 50.0 * noise(&mut seed));
+          (c, cams[c], Observation { center })
+        }).collect();
+        frames.push((lane, ts, sightings));
+      }
+      bank.filter(&frames);
+      for (lane, ts, sightings) in &frames {
+        filters[*lane].filter(*ts, sightings);
+      }
+      for (lane, ekf) in filters.iter().enumerate() {
+        let (a, b) = (bank.position_at(lane, 0.1), ekf.position_at(0.1));
+        assert!((a - b).norm() <= 1e-9 * (1.0 + b.norm()),
+                "{:?} tag {} frame {}: bank {} ekf {}", motion, lane, f, a, b);
+      }
+    }
+  }
+
+  #[test]
+  fn still_matches_ekf() {
+    matches_ekf::<3>(Motion::Still);
+  }
+
+  #[test]
+  fn velocity_matches_ekf() {
+    matches_ekf::<6>(Motion::Velocity);
+  }
+
+  #[test]
+  fn acceleration_matches_ekf() {
+    matches_ekf::<9>(Motion::Acceleration);
+  }
+}
@@ -8,84 +8,360 @@ mod net;
 mod util;
 mod config;
 mod ekf;
+mod filter_bank;
 mod visualization;
+mod queue;
 
 use tag_detector::detector::*;
 use tag_detector::image::*;
+use tag_detector::pool::{Batching, DetectorPool, Worker};
+use tag_detector::track::{Tracker, View};
+use tag_detector::profile::Profiles;
+use tag_detector::pose::{self, Intrinsics};
 use net::cam_ctn::udp::*;
-use net::cam_ctn::{CamCtn, CamCtnInfo};
+use net::cam_ctn::{CamCtn, CamCtnInfo, CamSink};
+use net::cam_ctn::replay::ReplayCtn;
+use net::capture::CaptureWriter;
 use net::protocol::ts_custom::TagStreamPacket;
 use net::protocol::ts_custom::TagStreamHeader;
+use net::protocol::rtp::RtpPacket;
 use net::protocol::Packet;
 use apriltag::Detector;
 use tokio::sync::mpsc;
 use tokio::time::Instant;
 use tokio::task::JoinHandle;
 use std::sync::Arc;
-use na::Vector3;
+use std::time::Duration;
+use na::{Vector2, Vector3};
 
 
-#[tokio::main]
-async fn main() {
+// What every detection worker hands its findings to
+struct DetectStage {
+  ekf_tp: Arc<ekf::EKFThreadPool>,
+  min_margin: f32,
+  tracker: Option<Tracker>,
+  profiles: Profiles,
+  // by camera id, empty without --intrinsics
+  intrinsics: Vec<Intrinsics>,
+  tag_size: f64,
+}
 
-  let (tag_pos_tx, mut tag_pos_rx) = mpsc::unbounded_channel::<(TagID, Vector3<f64>)>();
-  let mut ctns: Vec<(UdpCtn<TagStreamPacket>, JoinHandle<()>)> = Vec::new();
-  let ekf_tp = Arc::new(ekf::EKFThreadPool::new(
-    tag_pos_tx.clone(),
-    config::CALIBRATION_FILE,
-    &config::TAGS));
+// STAGE 1: Window Detection, on whichever pool worker picks the windows up.
+// With --track windows of known tags are followed without a decode; with
+// --mosaic the rest of a batch is packed into mosaics and detected a mosaic
+// at a time.
+fn detect_windows<P>(worker: &mut Worker, jobs: &mut Vec<(usize, P)>, stage: &DetectStage)
+where
+  P: Into<TagStreamPacket>
+{
+  // cameras and headers of the windows in the mosaic, by tile
+  let mut placed: Vec<(usize, TagStreamHeader)> = Vec::new();
+  let single = jobs.len() == 1;
+  for (i, packet) in jobs.drain(..) {
+    let link = net::loss::counters(i);
+    let packet: TagStreamPacket = packet.into();
+    let head = packet.header;
+    // went stale while queued behind a backlog
+    if link.is_stale(head.ts) {
+      net::loss::Counters::add(&link.stale, 1);
+      continue;
+    }
+    let w = head.width as usize;
+    let view = window_view(&head, &packet.data, w);
+
+    if let Some(tracker) = stage.tracker.as_ref() {
+      if let Some((id, center)) = tracker.track(i, &view) {
+        report(stage, i, &head, id, center, None);
+        continue;
+      }
+    }
+
+    if let (Some(mosaic), false) = (worker.mosaic.as_mut(), single) {
+      if mosaic.add(&packet.data, w, w) {
+        placed.push((i, head));
+        continue;
+      }
+      detect_mosaic(worker, &mut placed, stage);
+      if worker.mosaic.as_mut().unwrap().add(&packet.data, w, w) {
+        placed.push((i, head));
+        continue;
+      }
+      // too big for a mosaic of its own, detected alone
+    }
+
+    worker.use_profile(stage.profiles.for_width(w));
+    let img = worker.images.window(&packet.data, w, w);
+    for det in worker.det.detect_all(&img, stage.min_margin) {
+      if let Some(tracker) = stage.tracker.as_ref() {
+        tracker.verified(i, &view, &det);
+      }
+      report(stage, i, &head, det.id, det.center, Some(&det.corners));
+    }
+  }
+  detect_mosaic(worker, &mut placed, stage);
+}
+
+// Top-left corner of head's window in camera pixels. px, py is the window
+// centre: the camera copies the window from px - width/2, py - width/2.
+fn window_origin(head: &TagStreamHeader) -> (f64, f64) {
+  let half = head.width / 2;
+  (head.px as f64 - half as f64, head.py as f64 - half as f64)
+}
+
+// Pose of a tag decoded with corners in head's window, for a camera with
+// intrinsics k
+fn window_pose(head: &TagStreamHeader, corners: &[[f64; 2]; 4], k: &Intrinsics,
+               size: f64) -> Option<pose::TagPose> {
+  let (px, py) = window_origin(head);
+  let corners = corners.map(|[x, y]| [px + x, py + y]);
+  pose::homography(&corners).and_then(|h| pose::tag_pose(&h, k, size))
+}
+
+fn window_view<'a>(head: &TagStreamHeader, pixels: &'a [u8], stride: usize) -> View<'a> {
+  let w = head.width as usize;
+  let (px, py) = window_origin(head);
+  View { ts: head.ts, px, py, w, h: w, pixels, stride }
+}
+
+// Detect the mosaic and hand each detection to the window it is in
+fn detect_mosaic(worker: &mut Worker, placed: &mut Vec<(usize, TagStreamHeader)>,
+                 stage: &DetectStage) {
+  // the narrowest window decides the profile, wider ones are found anyway
+  let narrowest = worker.mosaic.as_ref().and_then(|m| m.tiles().iter().map(|t| t.w).min());
+  if let Some(w) = narrowest {
+    worker.use_profile(stage.profiles.for_width(w));
+    let mosaic = worker.mosaic.as_mut().unwrap();
+    let detections = worker.det.detect_all(&mosaic.image(), stage.min_margin);
+    for det in detections {
+      let [x, y] = det.center;
+      if let Some(t) = mosaic.locate(x, y) {
+        let tile = mosaic.tiles()[t];
+        let (i, head) = &placed[t];
+        let det = det.offset(-(tile.x as f64), -(tile.y as f64));
+        if let Some(tracker) = stage.tracker.as_ref() {
+          let (pixels, stride) = mosaic.pixels(t);
+          tracker.verified(*i, &window_view(head, pixels, stride), &det);
+        }
+        report(stage, *i, head, det.id, det.center, Some(&det.corners));
+      }
+    }
+    mosaic.clear();
+  }
+  placed.clear();
+}
+
+// STAGE 2: EKF, for tag id found at center of camera i's window head. The
+// corners of a decoded window only give the printed pose, the filter takes
+// the centre.
+fn report(stage: &DetectStage, i: usize, head: &TagStreamHeader,
+          id: TagID, [center_x, center_y]: [f64; 2], corners: Option<&[[f64; 2]; 4]>) {
+  let (px, py) = window_origin(head);
+  let pose = match (corners, stage.intrinsics.get(i)) {
+    (Some(c), Some(k)) => window_pose(head, c, k, stage.tag_size),
+    _ => None,
+  };
+  match pose {
+    Some(p) => {
+      let t = p.translation;
+      println!("Detected tag id {} at {:.3} {:.3} {:.3} from camera {}", id, t.x, t.y, t.z, i);
+    }
+    None => println!("Detected tag id {}", id),
+  }
+  let obs = ekf::Observation { center: Vector2::new(px + center_x, py + center_y) };
+  stage.ekf_tp.send(id, i, obs, head.ts);
+  // older windows of this camera are no longer worth decoding
+  net::loss::counters(i).processed(head.ts);
+}
+
+// Listen for cameras speaking transport P, or replay a capture of them,
+// then run the visualizer until it is closed
+fn serve<P>(settings: &config::Settings, ekf_tp: Arc<ekf::EKFThreadPool>,
+            tag_pos_rx: &mut queue::Rx<(TagID, Vector3<f64>)>)
+where
+  P: Packet + Into<TagStreamPacket> + Send + 'static
+{
+  let mut ctns: Vec<UdpCtn<P>> = Vec::new();
+  let mut replays: Vec<ReplayCtn<P>> = Vec::new();
 
-  for i in 0..config::NUM_CAMERAS {
+  // every socket feeds the same sink, which opens a camera's queue into the
+  // detection pool the first time one of its packets arrives
+  let stage = Arc::new(DetectStage {
+    ekf_tp: ekf_tp.clone(),
+    min_margin: settings.min_margin,
+    tracker: settings.track.map(Tracker::new),
+    profiles: settings.profiles.as_ref().map_or_else(Profiles::default, |path| {
+      Profiles::load(path).expect(&format!("Unable to read detector profiles \"{}\"", path))
+    }),
+    intrinsics: settings.intrinsics.as_deref().map_or_else(Vec::new, pose::load_intrinsics),
+    tag_size: settings.tag_size,
+  });
+  let pool = {
+    let stage = stage.clone();
+    let batching = settings.mosaic.map(|deadline| Batching {
+      windows: config::MOSAIC_WINDOWS,
+      deadline,
+    });
+    DetectorPool::<P>::new(&settings.compute_cores(), batching, move |worker, jobs| {
+      detect_windows(worker, jobs, &stage)
+    })
+  };
+  let sink = {
     let ekf_tp = ekf_tp.clone();
-    let (ts_tx, mut ts_rx) = mpsc::channel::<TagStreamPacket>(config::MTU);
+    CamSink::new(move |i| {
+      if ekf_tp.has_camera(i) {
+        Some(pool.camera(i, config::PACKET_QUEUE))
+      } else {
+        None
+      }
+    })
+  };
 
+  if let Some(replay) = settings.replay.clone() {
     let info: CamCtnInfo = CamCtnInfo {
       addr : config::ADDRESS,
-      port : config::START_PORT + i,
-      id : i,
+      port : settings.port,
+      id : 0,
+      reuse_port : false,
+      core : None,
+      busy_poll : false,
+      record : None,
+      replay : Some(replay),
     };
+    println!("Replaying {}", settings.replay.as_ref().unwrap().path);
+    replays.push(ReplayCtn::<P>::new(info, sink.clone())
+      .expect("Unable to open the capture log"));
+  } else {
+    let recorder = settings.record.as_ref().map(|path| CaptureWriter::recorder(path)
+      .expect(&format!("Unable to create capture log \"{}\"", path)));
+    for s in 0..settings.sockets {
+      let info: CamCtnInfo = CamCtnInfo {
+        addr : config::ADDRESS,
+        port : settings.port,
+        id : s,
+        reuse_port : settings.sockets > 1,
+        core : settings.io_cores.as_ref().map(|c| c[s % c.len()]),
+        busy_poll : settings.busy_poll,
+        record : recorder.clone(),
+        replay : None,
+      };
+      ctns.push(UdpCtn::<P>::new(info, sink.clone()).unwrap());
+    }
+    println!("Listening for cameras on port {} ({:?})", settings.port, settings.transport);
+  }
 
-    // STAGE 1: Window Detection
-    let ctn = UdpCtn::<TagStreamPacket>::new(info, ts_tx).unwrap();
-    let cam_loop = tokio::spawn(async move {
-      let mut wrap = Detwrapper{det:Detector::new("tagCustom48h12")};
-      wrap.det.set_thread_number(8);
-      wrap.det.set_decimation(1.0);
-      wrap.det.set_sigma(2.0);
-
-      println!("Finished building detector"); 
-
+  if config::QUEUE_REPORT_SECONDS > 0 {
+    tokio::spawn(async move {
+      let period = Duration::from_secs(config::QUEUE_REPORT_SECONDS);
+      let mut last = tag_detector::pool::stats();
       loop {
-        tokio::select!{
-          p = ts_rx.recv() => {
-
-            let mut packet = p.unwrap();
-            let head = &mut packet.header;
-            let w = head.width as usize;
-
-            let img = &packet.data.as_aprilimg(w,w);
-
-            let maybe_det = wrap.det.detect_one(img);
-            if let Some((id, [center_x, center_y])) = maybe_det {
-              println!("Detected tag id {}", id);
-              // STAGE 2: EKF
-              ekf_tp.send(
-                id, i,
-                (head.px as f64 + center_x),
-                (head.py as f64 + center_y),
-                head.ts
-              );
-            }
-
+        tokio::time::sleep(period).await;
+        for q in queue::stats() {
+          println!("[queue {}] depth {}/{} (max {}), dropped {} of {}",
+            q.name, q.depth, q.capacity, q.max_depth, q.dropped, q.sent);
+        }
+        for d in tag_detector::pool::stats() {
+          let busy = d.busy - last.get(d.worker).map_or(Duration::ZERO, |l| l.busy);
+          println!("[detector {}] {:.0}% busy, {} windows ({} stolen)",
+            d.worker, 100.0 * busy.as_secs_f64() / period.as_secs_f64(), d.windows, d.stolen);
+        }
+        last = tag_detector::pool::stats();
+        if let Some(tracker) = stage.tracker.as_ref() {
+          let (tracked, verified) = tracker.stats();
+          println!("[tracker] {} sightings from tracks, {} from full decodes", tracked, verified);
+        }
+        for (s, drops) in net::loss::kernel_drops() {
+          if drops > 0 {
+            println!("[socket {}] {} datagrams dropped by the kernel, receive buffer full", s, drops);
+          }
+        }
+        for l in net::loss::stats() {
+          println!("[camera {}] {} windows: {} stale dropped, {} reordered, {} duplicates, {} frames skipped ({:.2}%)",
+            l.cam, l.windows, l.stale, l.windows_reordered, l.windows_duplicate,
+            l.frames_skipped, 100.0 * l.frame_gap_rate());
+          if let Some(rate) = l.loss_rate() {
+            println!("[camera {} rtp] lost {} of {} ({:.2}%), {} reordered, {} late, {} duplicates",
+              l.cam, l.lost, l.received - l.duplicates + l.lost, 100.0 * rate,
+              l.reordered, l.late, l.duplicates);
           }
         }
       }
     });
-    ctns.push((ctn, cam_loop));
   }
 
   // STAGE 3: Visualization
-  visualization::visualize(&mut tag_pos_rx);
+  visualization::visualize(tag_pos_rx, &settings.tags);
+}
+
+fn main() {
+  let settings = config::Settings::from_args();
+
+  // filtering and reporting get a small pool of their own, off the cores
+  // the socket threads are pinned to; detection runs on the detector pool
+  let io_cores = settings.io_cores.clone().unwrap_or_default();
+  let compute_cores = settings.compute_cores();
+  let compute = tokio::runtime::Builder::new_multi_thread()
+    .worker_threads(compute_cores.len().min(2))
+    .thread_name("compute")
+    .on_thread_start(move || {
+      if !io_cores.is_empty() {
+        let _ = util::pin_thread(&compute_cores);
+      }
+    })
+    .enable_all()
+    .build()
+    .expect("unable to start the compute pool");
+  compute.block_on(run(settings));
 }
 
+async fn run(settings: config::Settings) {
+  let (tag_pos_tx, mut tag_pos_rx) = queue::bounded::<(TagID, Vector3<f64>)>(
+    "positions", settings.tags.len(), queue::Overflow::LatestWins);
+  let model = ekf::Model {
+    motion: settings.motion,
+    frame_rate: settings.frame_rate,
+    process_noise: settings.process_noise,
+    lead: settings.lead.as_secs_f64(),
+  };
+  let ekf_tp = Arc::new(ekf::EKFThreadPool::new(
+    tag_pos_tx.clone(),
+    model,
+    &settings.calibration,
+    settings.cameras.as_deref(),
+    &settings.tags));
+
+  match settings.transport {
+    config::Transport::TagStream => serve::<TagStreamPacket>(&settings, ekf_tp, &mut tag_pos_rx),
+    config::Transport::Rtp => serve::<RtpPacket>(&settings, ekf_tp, &mut tag_pos_rx),
+  }
+}
 
+#[cfg(test)]
+mod tests {
+  use super::*;
+  use na::{Rotation3, Vector3};
+
+  // A tag projected into a window centred on (px, py) gives back the pose
+  // it was projected with
+  #[test]
+  fn window_pose_at_known_position() {
+    let k = Intrinsics { fx: 600.0, fy: 610.0, cx: 320.0, cy: 240.0 };
+    let size = 0.1;
+    let rotation = Rotation3::from_euler_angles(0.2, -0.3, 0.1);
+    let translation = Vector3::new(0.12, -0.05, 1.5);
+    let project = |[x, y]: [f64; 2]| {
+      let p = rotation * Vector3::new(x, y, 0.0) * (size / 2.0) + translation;
+      [k.fx * p.x / p.z + k.cx, k.fy * p.y / p.z + k.cy]
+    };
+    let pixels = [[-1.0, 1.0], [1.0, 1.0], [1.0, -1.0], [-1.0, -1.0]].map(project);
+
+    // a window as the camera sends it, centred near the tag
+    let head = TagStreamHeader { width: 101, px: 375, py: 225, cam_id: 0, flags: 0, ts: 0 };
+    let (x0, y0) = (head.px as f64 - 50.0, head.py as f64 - 50.0);
+    let corners = pixels.map(|[u, v]| [u - x0, v - y0]);
+    assert!(corners.iter().flatten().all(|c| (0.0..head.width as f64).contains(c)));
+
+    let pose = window_pose(&head, &corners, &k, size).unwrap();
+    assert!((pose.translation - translation).norm() < 1e-9, "{}", pose.translation);
+    assert!((pose.rotation - rotation.matrix()).norm() < 1e-9, "{}", pose.rotation);
+  }
+}
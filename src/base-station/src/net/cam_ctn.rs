@@ -1,9 +1,20 @@
 pub mod udp;
+pub mod batch;
+pub mod replay;
+pub mod jitter;
+pub mod frames;
 
 use bytes::Buf;
+use std::collections::HashMap;
 use std::io::Error;
+use std::sync::{Arc, Mutex};
 use super::protocol::Packet;
-use tokio::sync::mpsc::Sender;
+use super::capture;
+use crate::queue;
+use crate::config;
+use jitter::JitterBuffer;
+use frames::FrameTracker;
+use tokio::time::Instant;
 
 #[derive(Copy, Clone)]
 pub enum Status {
@@ -15,11 +26,181 @@ pub enum Status {
 pub struct CamCtnInfo {
   pub addr: &'static str,
   pub port: usize,
-  pub id: usize
+  // camera assumed for packets that do not carry one
+  pub id: usize,
+  // share the port with other sockets through SO_REUSEPORT
+  pub reuse_port: bool,
+  // core to pin the socket's thread to
+  pub core: Option<usize>,
+  // spin on the socket instead of sleeping until datagrams arrive
+  pub busy_poll: bool,
+  // log every received datagram here
+  pub record: Option<capture::Recorder>,
+  // log a ReplayCtn reads instead of a socket
+  pub replay: Option<capture::Replay>,
+}
+
+type Route<P> = Option<queue::Tx<Vec<P>>>;
+
+/// Where connections deliver received batches, split by the camera that sent
+/// them. The queue of a camera is opened on its first packet; cameras the
+/// open function refuses are remembered and their packets dropped. Clones
+/// share the routes, so every socket of a SO_REUSEPORT group can feed one
+/// sink while looking cameras up in its own cache without locking.
+pub struct CamSink<P> {
+  routes: Arc<Mutex<HashMap<usize, Route<P>>>>,
+  cache: HashMap<usize, Route<P>>,
+  open: Arc<dyn Fn(usize) -> Route<P> + Send + Sync>,
+}
+
+impl<P> CamSink<P> {
+  pub fn new<F>(open: F) -> CamSink<P>
+  where
+    F: Fn(usize) -> Route<P> + Send + Sync + 'static
+  {
+    CamSink {
+      routes: Arc::new(Mutex::new(HashMap::new())),
+      cache: HashMap::new(),
+      open: Arc::new(open),
+    }
+  }
+
+  /// Queue a batch from camera cam, false when the camera was refused
+  pub fn send(&mut self, cam: usize, batch: Vec<P>) -> bool {
+    match self.route(cam) {
+      Some(tx) => {
+        tx.send(cam, batch);
+        true
+      }
+      None => false,
+    }
+  }
+
+  /// Like send, but wait for room in the camera's queue instead of dropping
+  pub async fn send_wait(&mut self, cam: usize, batch: Vec<P>) -> bool {
+    match self.route(cam) {
+      Some(tx) => {
+        tx.send_wait(cam, batch).await;
+        true
+      }
+      None => false,
+    }
+  }
+
+  /// Queue every camera's non-empty batch from batches, leaving it with an
+  /// empty one the detector handed back
+  pub fn flush(&mut self, batches: &mut HashMap<usize, Vec<P>>) {
+    for (cam, batch) in batches.iter_mut() {
+      if batch.is_empty() {
+        continue;
+      }
+      match self.route(*cam) {
+        Some(tx) => {
+          let spare = tx.spare();
+          tx.send(*cam, std::mem::replace(batch, spare));
+        }
+        None => batch.clear(),
+      }
+    }
+  }
+
+  /// An empty batch for camera cam, reused when its queue has one
+  pub fn spare(&mut self, cam: usize) -> Vec<P> {
+    self.route(cam).as_ref().map_or_else(Vec::new, |tx| tx.spare())
+  }
+
+  fn route(&mut self, cam: usize) -> &Route<P> {
+    if !self.cache.contains_key(&cam) {
+      let route = self.routes.lock().unwrap()
+        .entry(cam)
+        .or_insert_with(|| {
+          let route = (self.open)(cam);
+          if route.is_none() {
+            println!("ignoring packets from unknown camera {}", cam);
+          }
+          route
+        })
+        .clone();
+      self.cache.insert(cam, route);
+    }
+    &self.cache[&cam]
+  }
+}
+
+impl<P> Clone for CamSink<P> {
+  fn clone(&self) -> CamSink<P> {
+    CamSink {
+      routes: self.routes.clone(),
+      cache: HashMap::new(),
+      open: self.open.clone(),
+    }
+  }
+}
+
+/// What a receive task keeps per camera between the socket and the sink:
+/// the jitter buffer for protocols with sequence numbers, then the frame
+/// tracker that turns away duplicate and stale windows.
+pub struct Ingest<P> {
+  cam: usize,
+  frames: FrameTracker,
+  jitter: Option<JitterBuffer<P>>,
+  ordered: Vec<P>,
+}
+
+impl<P: Packet> Ingest<P> {
+  pub fn new(cam: usize) -> Ingest<P> {
+    Ingest {
+      cam,
+      frames: FrameTracker::new(cam),
+      jitter: None,
+      ordered: Vec::new(),
+    }
+  }
+
+  /// Take packet p, appending whatever is ready for the detector to batch
+  pub fn push(&mut self, p: P, batch: &mut Vec<P>) {
+    match p.seq() {
+      Some(seq) => {
+        let cam = self.cam;
+        self.jitter
+          .get_or_insert_with(|| JitterBuffer::new(cam, config::JITTER_DEPTH, config::JITTER_HOLD))
+          .push(seq, p, &mut self.ordered);
+        self.release(batch);
+      }
+      None => {
+        self.ordered.push(p);
+        self.release(batch);
+      }
+    }
+  }
+
+  /// When expire has packets to release
+  pub fn deadline(&self) -> Option<Instant> {
+    self.jitter.as_ref().and_then(|j| j.deadline())
+  }
+
+  pub fn expire(&mut self, now: Instant, batch: &mut Vec<P>) {
+    if let Some(j) = self.jitter.as_mut() {
+      j.expire(now, &mut self.ordered);
+      self.release(batch);
+    }
+  }
+
+  /// Release everything held, nothing more is coming
+  pub fn finish(&mut self, batch: &mut Vec<P>) {
+    while let Some(d) = self.deadline() {
+      self.expire(d, batch);
+    }
+  }
+
+  fn release(&mut self, batch: &mut Vec<P>) {
+    let frames = &mut self.frames;
+    batch.extend(self.ordered.drain(..).filter(|p| p.window().map_or(true, |w| frames.accept(w))));
+  }
 }
 
 pub trait CamCtn<P: Packet + Sized> {
-  fn new(info: CamCtnInfo, packet_tx: Sender<P>)
+  fn new(info: CamCtnInfo, sink: CamSink<P>)
          -> Result<Self, std::io::Error> where Self: Sized;
   fn close(self) -> Result<(), Error>;
   fn send(&mut self, p: P);
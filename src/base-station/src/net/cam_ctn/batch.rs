@@ -0,0 +1,199 @@
+use bytes::{Bytes, BytesMut};
+use std::io;
+
+/// Most datagrams pulled from the socket by a single receive call
+pub const MAX_BATCH: usize = 64;
+
+// Room for the SO_RXQ_OVFL control message of one datagram
+#[cfg(target_os = "linux")]
+#[repr(C, align(8))]
+#[derive(Copy, Clone)]
+struct Control([u8; 32]);
+
+/// Receive buffers for batches of datagrams, handed out as Bytes.
+///
+/// A batch lands in one pooled chunk of `slots` slots, each sized to the
+/// largest datagram a camera sends. Every datagram leaves as a Bytes slice of
+/// its slot, so packets reference the receive buffer instead of copying it.
+/// A chunk is reused once the last slice into it has been dropped; only when
+/// every chunk in the pool is still referenced downstream is a new one
+/// allocated, which does not happen in steady state with a big enough pool.
+pub struct RecvRing {
+  chunks: Vec<BytesMut>,
+  cur: usize,
+  slot: usize,
+  slots: usize,
+  lens: [usize; MAX_BATCH],
+  len: usize,
+  truncated: u64,
+  misses: u64,
+  // last SO_RXQ_OVFL count seen and the drops it adds up to
+  ovfl: u32,
+  drops: u64,
+}
+
+fn new_chunk(size: usize) -> BytesMut {
+  // zeroed once so the slots are always initialized memory
+  let mut chunk = BytesMut::zeroed(size);
+  chunk.clear();
+  chunk
+}
+
+impl RecvRing {
+  pub fn new(slots: usize, slot_size: usize, pool: usize) -> RecvRing {
+    let slots = slots.clamp(1, MAX_BATCH);
+    RecvRing {
+      chunks: (0..pool.max(1)).map(|_| new_chunk(slots * slot_size)).collect(),
+      cur: 0,
+      slot: slot_size,
+      slots,
+      lens: [0; MAX_BATCH],
+      len: 0,
+      truncated: 0,
+      misses: 0,
+      ovfl: 0,
+      drops: 0,
+    }
+  }
+
+  pub fn capacity(&self) -> usize {
+    self.slots
+  }
+
+  /// Datagrams held from the last receive
+  pub fn len(&self) -> usize {
+    self.len
+  }
+
+  /// Datagrams dropped so far because they did not fit in a slot
+  pub fn truncated(&self) -> u64 {
+    self.truncated
+  }
+
+  /// Chunks allocated so far because the whole pool was still in use
+  pub fn pool_misses(&self) -> u64 {
+    self.misses
+  }
+
+  /// Datagrams the kernel dropped because the socket buffer was full, as
+  /// reported by SO_RXQ_OVFL when it is enabled on the socket. Drops show up
+  /// with the next datagram that makes it into the buffer.
+  pub fn kernel_drops(&self) -> u64 {
+    self.drops
+  }
+
+  fn slot_ptr(&mut self, i: usize) -> *mut u8 {
+    let base = self.chunks[self.cur].spare_capacity_mut().as_mut_ptr() as *mut u8;
+    unsafe { base.add(i * self.slot) }
+  }
+
+  /// Hand every datagram of the last receive to `f` and move on to a free
+  /// chunk for the next one. Empty and truncated datagrams are skipped.
+  pub fn drain<F: FnMut(Bytes)>(&mut self, mut f: F) {
+    let (n, slot) = (self.len, self.slot);
+    self.len = 0;
+
+    let chunk = &mut self.chunks[self.cur];
+    unsafe { chunk.set_len(n * slot) };
+    for &len in &self.lens[..n] {
+      let mut d = chunk.split_to(slot);
+      if len > 0 {
+        d.truncate(len);
+        f(d.freeze());
+      }
+    }
+    self.next_chunk();
+  }
+
+  fn next_chunk(&mut self) {
+    let size = self.slots * self.slot;
+    let pool = self.chunks.len();
+    for k in 1..=pool {
+      let i = (self.cur + k) % pool;
+      if self.chunks[i].try_reclaim(size) {
+        self.cur = i;
+        return;
+      }
+    }
+    // every chunk still has packets downstream, let go of the oldest
+    self.misses += 1;
+    self.cur = (self.cur + 1) % pool;
+    self.chunks[self.cur] = new_chunk(size);
+  }
+
+  /// Fill the ring with a single recvmmsg call. Pass MSG_DONTWAIT for a
+  /// non-blocking socket driven by readiness, or MSG_WAITFORONE to block for
+  /// the first datagram and take whatever else is already queued.
+  #[cfg(target_os = "linux")]
+  pub fn recv_mmsg(&mut self, fd: std::os::fd::RawFd, flags: libc::c_int) -> io::Result<usize> {
+    let mut iov: [libc::iovec; MAX_BATCH] = unsafe { std::mem::zeroed() };
+    let mut hdrs: [libc::mmsghdr; MAX_BATCH] = unsafe { std::mem::zeroed() };
+    let mut control = [Control([0; 32]); MAX_BATCH];
+    for i in 0..self.slots {
+      iov[i].iov_base = self.slot_ptr(i) as *mut libc::c_void;
+      iov[i].iov_len = self.slot;
+      hdrs[i].msg_hdr.msg_iov = &mut iov[i];
+      hdrs[i].msg_hdr.msg_iovlen = 1;
+      hdrs[i].msg_hdr.msg_control = control[i].0.as_mut_ptr() as *mut libc::c_void;
+      hdrs[i].msg_hdr.msg_controllen = std::mem::size_of::<Control>() as _;
+    }
+
+    self.len = 0;
+    let n = unsafe {
+      libc::recvmmsg(fd, hdrs.as_mut_ptr(), self.slots as libc::c_uint, flags, std::ptr::null_mut())
+    };
+    if n < 0 {
+      return Err(io::Error::last_os_error());
+    }
+    for h in &hdrs[..n as usize] {
+      self.read_ovfl(&h.msg_hdr);
+      let mut len = h.msg_len as usize;
+      if h.msg_hdr.msg_flags & libc::MSG_TRUNC != 0 {
+        self.truncated += 1;
+        len = 0;
+      }
+      self.lens[self.len] = len;
+      self.len += 1;
+    }
+    Ok(self.len)
+  }
+
+  // pick the drop counter out of a datagram's control messages
+  #[cfg(target_os = "linux")]
+  fn read_ovfl(&mut self, msg: &libc::msghdr) {
+    unsafe {
+      let mut cmsg = libc::CMSG_FIRSTHDR(msg);
+      while !cmsg.is_null() {
+        if (*cmsg).cmsg_level == libc::SOL_SOCKET && (*cmsg).cmsg_type == libc::SO_RXQ_OVFL {
+          // a running total for the socket, only sent once it is nonzero
+          let count = std::ptr::read_unaligned(libc::CMSG_DATA(cmsg) as *const u32);
+          self.drops += count.wrapping_sub(self.ovfl) as u64;
+          self.ovfl = count;
+        }
+        cmsg = libc::CMSG_NXTHDR(msg, cmsg);
+      }
+    }
+  }
+
+  /// Fill the ring by calling recv once per slot until it would block. Used
+  /// where recvmmsg is not available. Returns WouldBlock only when nothing was
+  /// received, so it can run inside a readiness guard.
+  pub fn recv_each<F>(&mut self, mut recv: F) -> io::Result<usize>
+  where
+    F: FnMut(&mut [u8]) -> io::Result<usize>
+  {
+    self.len = 0;
+    while self.len < self.slots {
+      let slot = unsafe { std::slice::from_raw_parts_mut(self.slot_ptr(self.len), self.slot) };
+      match recv(slot) {
+        Ok(size) => {
+          self.lens[self.len] = size;
+          self.len += 1;
+        }
+        Err(e) if e.kind() == io::ErrorKind::WouldBlock && self.len > 0 => break,
+        Err(e) => return Err(e),
+      }
+    }
+    Ok(self.len)
+  }
+}
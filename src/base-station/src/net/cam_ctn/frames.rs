@@ -0,0 +1,72 @@
+use crate::net::loss::{self, Counters, MAX_FRAME_BACKSTEP};
+use crate::net::protocol::Window;
+use std::sync::Arc;
+
+// Windows remembered for duplicate detection
+const RECENT: usize = 64;
+
+/// Follows the frame counter of one camera's windows. Counts skipped frame
+/// numbers, windows from older frames than the newest seen, and repeated
+/// windows, and turns away windows that are duplicates or older than the
+/// last frame the filters processed for this camera, so a backlog from a
+/// Wi-Fi burst is not decoded only to be ignored by the EKF.
+pub struct FrameTracker {
+  latest: Option<u32>,
+  // recently accepted windows, a small ring scanned on every window
+  recent: [Option<Window>; RECENT],
+  next: usize,
+  counters: Arc<Counters>,
+}
+
+impl FrameTracker {
+  pub fn new(cam: usize) -> FrameTracker {
+    FrameTracker {
+      latest: None,
+      recent: [None; RECENT],
+      next: 0,
+      counters: loss::counters(cam),
+    }
+  }
+
+  /// Whether window w is worth passing on to the detector
+  pub fn accept(&mut self, w: Window) -> bool {
+    let c = &*self.counters;
+    Counters::add(&c.windows, 1);
+    if self.recent.contains(&Some(w)) {
+      Counters::add(&c.windows_duplicate, 1);
+      return false;
+    }
+
+    match self.latest {
+      Some(latest) => {
+        let d = w.ts.wrapping_sub(latest) as i32 as i64;
+        if d < -MAX_FRAME_BACKSTEP {
+          c.restart();
+          self.recent = [None; RECENT];
+          self.latest = Some(w.ts);
+          Counters::add(&c.frames, 1);
+        } else if d > 0 {
+          Counters::add(&c.frames_skipped, d as u64 - 1);
+          Counters::add(&c.frames, 1);
+          self.latest = Some(w.ts);
+        } else if d < 0 {
+          Counters::add(&c.windows_reordered, 1);
+        }
+      }
+      None => {
+        self.latest = Some(w.ts);
+        Counters::add(&c.frames, 1);
+      }
+    }
+
+    // windows of the frame being processed are still useful, older ones not
+    if c.is_stale(w.ts) {
+      Counters::add(&c.stale, 1);
+      return false;
+    }
+
+    self.recent[self.next] = Some(w);
+    self.next = (self.next + 1) % RECENT;
+    true
+  }
+}
@@ -0,0 +1,251 @@
+use crate::net::loss::{self, Counters};
+use std::sync::Arc;
+use tokio::time::{Duration, Instant};
+
+// Sequence jumps this far either way are a restarted camera, not loss
+const MAX_GAP: i32 = 1024;
+
+/// Puts the packets of one camera back in sequence order. A packet that
+/// arrives ahead of a gap is held until the gap fills, the buffer runs out of
+/// room, or the gap has held things up for longer than hold; then the missing
+/// packets are counted lost and the ones behind them released. Packets older
+/// than what was already released are dropped as late or duplicate.
+pub struct JitterBuffer<P> {
+  // indexed by sequence number modulo the depth, a power of two
+  slots: Vec<Option<P>>,
+  hold: Duration,
+  started: bool,
+  // sequence number of the next packet to release
+  next: u16,
+  highest: u16,
+  held: usize,
+  // when the gap at next started holding packets up
+  since: Option<Instant>,
+  // bit i is set when next - 1 - i was released
+  released: u64,
+  // sequence numbers next has moved past, up to 64
+  passed: u32,
+  counters: Arc<Counters>,
+}
+
+impl<P> JitterBuffer<P> {
+  pub fn new(cam: usize, depth: usize, hold: Duration) -> JitterBuffer<P> {
+    let depth = depth.clamp(1, 1 << 15).next_power_of_two();
+    JitterBuffer {
+      slots: (0..depth).map(|_| None).collect(),
+      hold,
+      started: false,
+      next: 0,
+      highest: 0,
+      held: 0,
+      since: None,
+      released: 0,
+      passed: 0,
+      counters: loss::counters(cam),
+    }
+  }
+
+  fn slot(&mut self, seq: u16) -> &mut Option<P> {
+    let depth = self.slots.len();
+    &mut self.slots[seq as usize & (depth - 1)]
+  }
+
+  /// Take packet seq, appending whatever is now in order to out
+  pub fn push(&mut self, seq: u16, p: P, out: &mut Vec<P>) {
+    let c = self.counters.clone();
+    Counters::add(&c.received, 1);
+    if !self.started {
+      self.started = true;
+      self.next = seq;
+      self.highest = seq;
+    }
+
+    let mut d = seq.wrapping_sub(self.next) as i16 as i32;
+    if d < -MAX_GAP || d >= MAX_GAP {
+      // the camera restarted, release what is held and start over at seq
+      for i in 0..self.slots.len() {
+        if let Some(p) = self.slot(self.next.wrapping_add(i as u16)).take() {
+          out.push(p);
+        }
+      }
+      self.held = 0;
+      self.since = None;
+      self.next = seq;
+      self.highest = seq;
+      self.released = 0;
+      self.passed = 0;
+      d = 0;
+    }
+    if d < 0 {
+      // too old to tell apart, or from before the first packet, is late
+      let back = (-d - 1) as u32;
+      if back < self.passed && self.released >> back & 1 != 0 {
+        Counters::add(&c.duplicates, 1);
+      } else {
+        Counters::add(&c.late, 1);
+        if back < self.passed {
+          c.found();
+        }
+      }
+      return;
+    }
+    let depth = self.slots.len();
+    if d as usize >= depth {
+      // no room, give up on the oldest missing packets
+      self.advance(d as usize - depth + 1, out);
+    }
+
+    let slot = self.slot(seq);
+    if slot.is_some() {
+      Counters::add(&c.duplicates, 1);
+      return;
+    }
+    *slot = Some(p);
+    self.held += 1;
+    if seq.wrapping_sub(self.highest) as i16 > 0 {
+      self.highest = seq;
+    } else if seq != self.highest {
+      Counters::add(&c.reordered, 1);
+    }
+    self.release(out);
+  }
+
+  /// When the current gap stops being waited for
+  pub fn deadline(&self) -> Option<Instant> {
+    self.since.map(|t| t + self.hold)
+  }
+
+  /// Give up on a gap that has been waited for long enough
+  pub fn expire(&mut self, now: Instant, out: &mut Vec<P>) {
+    if self.deadline().map_or(false, |d| d <= now) {
+      let mut missing = 0;
+      while self.held > 0 && self.slot(self.next.wrapping_add(missing)).is_none() {
+        missing += 1;
+      }
+      self.advance(missing as usize, out);
+    }
+  }
+
+  // move next forward by n, releasing held packets and counting the rest lost
+  fn advance(&mut self, n: usize, out: &mut Vec<P>) {
+    for _ in 0..n {
+      let seq = self.next;
+      match self.slot(seq).take() {
+        Some(p) => {
+          out.push(p);
+          self.held -= 1;
+          self.released = self.released << 1 | 1;
+        }
+        None => {
+          Counters::add(&self.counters.lost, 1);
+          self.released <<= 1;
+        }
+      }
+      self.next = seq.wrapping_add(1);
+      self.passed = (self.passed + 1).min(64);
+    }
+    self.since = None;
+    self.release(out);
+  }
+
+  fn release(&mut self, out: &mut Vec<P>) {
+    let mut moved = false;
+    while let Some(p) = self.slot(self.next).take() {
+      out.push(p);
+      self.held -= 1;
+      self.released = self.released << 1 | 1;
+      self.next = self.next.wrapping_add(1);
+      self.passed = (self.passed + 1).min(64);
+      moved = true;
+    }
+    if self.held == 0 {
+      self.since = None;
+    } else if moved || self.since.is_none() {
+      self.since = Some(Instant::now());
+    }
+  }
+}
+
+#[cfg(test)]
+mod tests {
+  use super::*;
+  use std::sync::atomic::Ordering;
+
+  // Counters are per camera and global, so every test has a camera of its own
+  fn buffer(cam: usize) -> (JitterBuffer<u16>, Arc<Counters>) {
+    (JitterBuffer::new(cam, 8, Duration::from_millis(5)), loss::counters(cam))
+  }
+
+  fn push(jb: &mut JitterBuffer<u16>, seqs: &[u16]) -> Vec<u16> {
+    let mut out = Vec::new();
+    for &seq in seqs {
+      jb.push(seq, seq, &mut out);
+    }
+    out
+  }
+
+  fn load(c: &std::sync::atomic::AtomicU64) -> u64 {
+    c.load(Ordering::Relaxed)
+  }
+
+  #[test]
+  fn wraps_around() {
+    let (mut jb, c) = buffer(9001);
+    assert_eq!(push(&mut jb, &[65533, 65534, 65535, 0, 1]), [65533, 65534, 65535, 0, 1]);
+    // reordered across the wrap
+    assert_eq!(push(&mut jb, &[3, 2]), [2, 3]);
+    // 65533 was released before the wrap
+    assert_eq!(push(&mut jb, &[65533, 4]), [4]);
+    assert_eq!((load(&c.lost), load(&c.reordered), load(&c.duplicates)), (0, 1, 1));
+    assert_eq!(jb.deadline(), None);
+  }
+
+  #[test]
+  fn gap_expires_after_hold() {
+    let (mut jb, c) = buffer(9002);
+    assert_eq!(push(&mut jb, &[10, 12, 13]), [10]);
+    let deadline = jb.deadline().unwrap();
+    let mut out = Vec::new();
+    jb.expire(deadline - Duration::from_millis(1), &mut out);
+    assert!(out.is_empty());
+    jb.expire(deadline, &mut out);
+    assert_eq!(out, [12, 13]);
+    assert_eq!(load(&c.lost), 1);
+    assert_eq!(jb.deadline(), None);
+    // the lost packet turning up after all is late, and no longer lost
+    assert!(push(&mut jb, &[11]).is_empty());
+    assert_eq!((load(&c.lost), load(&c.late)), (0, 1));
+  }
+
+  #[test]
+  fn full_buffer_gives_up_on_the_gap() {
+    let (mut jb, c) = buffer(9003);
+    assert_eq!(push(&mut jb, &[0, 2, 3, 4, 5, 6, 7, 8]), [0]);
+    // 9 does not fit beside the gap at 1 in a depth of 8
+    assert_eq!(push(&mut jb, &[9]), [2, 3, 4, 5, 6, 7, 8, 9]);
+    assert_eq!(load(&c.lost), 1);
+  }
+
+  #[test]
+  fn tells_duplicates_from_late() {
+    let (mut jb, c) = buffer(9004);
+    assert_eq!(push(&mut jb, &[100, 101, 103]), [100, 101]);
+    // held, and already released
+    assert!(push(&mut jb, &[103, 101]).is_empty());
+    assert_eq!(load(&c.duplicates), 2);
+    // from before the first packet
+    assert!(push(&mut jb, &[99]).is_empty());
+    assert_eq!((load(&c.late), load(&c.received)), (1, 6));
+    assert_eq!(push(&mut jb, &[102]), [102, 103]);
+    assert_eq!((load(&c.duplicates), load(&c.late), load(&c.lost)), (2, 1, 0));
+  }
+
+  #[test]
+  fn restart_releases_and_starts_over() {
+    let (mut jb, c) = buffer(9005);
+    assert_eq!(push(&mut jb, &[5000, 5002]), [5000]);
+    assert_eq!(push(&mut jb, &[7]), [5002, 7]);
+    assert_eq!(push(&mut jb, &[8]), [8]);
+    assert_eq!((load(&c.late), load(&c.lost)), (0, 0));
+  }
+}
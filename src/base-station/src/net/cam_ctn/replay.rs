@@ -0,0 +1,130 @@
+use crate::util;
+use crate::config;
+use super::Packet;
+use super::{Status, CamCtnInfo, CamCtn, CamSink, Ingest};
+use crate::net::capture::{Capture, Speed};
+
+use tokio::sync::mpsc;
+use tokio::time::{sleep_until, Duration, Instant};
+use std::collections::HashMap;
+use std::io::{Error, ErrorKind};
+use std::sync::{Arc, Mutex};
+
+/// Feeds a capture log into the pipeline in place of a socket. Datagrams keep
+/// the camera id they were recorded with and go out in batches of up to
+/// RECV_BATCH, paced by their recorded arrival times unless the speed is Max.
+pub struct ReplayCtn<P: Packet> {
+  info: CamCtnInfo,
+  close: mpsc::Sender<()>,
+  status: Arc<Mutex<Status>>,
+  handle: tokio::task::JoinHandle<()>,
+  _packet: std::marker::PhantomData<P>,
+}
+
+async fn flush<P: Packet>(sink: &mut CamSink<P>, batches: &mut HashMap<usize, Vec<P>>, wait: bool) {
+  for (cam, batch) in batches.iter_mut() {
+    if batch.is_empty() {
+      continue;
+    }
+    let spare = sink.spare(*cam);
+    let batch = std::mem::replace(batch, spare);
+    if wait {
+      sink.send_wait(*cam, batch).await;
+    } else {
+      sink.send(*cam, batch);
+    }
+  }
+}
+
+impl<P: Packet + 'static> CamCtn<P> for ReplayCtn<P> {
+  fn new(info: CamCtnInfo, mut sink: CamSink<P>)
+         -> Result<ReplayCtn<P>, std::io::Error> {
+    let replay = info.replay.clone()
+      .ok_or(Error::new(ErrorKind::InvalidInput, "no capture log to replay"))?;
+    let capture = Capture::open(&replay.path)?;
+
+    let (close_tx, mut close_rx) = mpsc::channel::<()>(1);
+    let status = Arc::new(Mutex::new(Status::Connected));
+    let task_status = status.clone();
+
+    let handle = tokio::spawn(async move {
+      let wait = matches!(replay.speed, Speed::Max);
+      let mut batches: HashMap<usize, Vec<P>> = HashMap::new();
+      let mut cameras: HashMap<usize, Ingest<P>> = HashMap::new();
+      let (mut count, mut pending) = (0u64, 0usize);
+      let start = Instant::now();
+      let mut first: Option<u64> = None;
+
+      for rec in capture.records() {
+        if let Speed::Scaled(factor) = replay.speed {
+          let t0 = *first.get_or_insert(rec.ts);
+          let due = start + Duration::from_nanos(((rec.ts - t0) as f64 / factor) as u64);
+          if Instant::now() < due {
+            flush(&mut sink, &mut batches, wait).await;
+            pending = 0;
+            tokio::select! {
+              _ = sleep_until(due) => {}
+              _ = close_rx.recv() => break,
+            }
+          }
+        }
+
+        let mut data = rec.data;
+        match P::unmarshal(&mut data) {
+          Ok(p) => {
+            let c = cameras.entry(rec.cam).or_insert_with(|| Ingest::new(rec.cam));
+            let batch = batches.entry(rec.cam).or_default();
+            c.push(p, batch);
+            c.expire(Instant::now(), batch);
+          }
+          Err(_) => println!("invalid packet in capture log!"),
+        }
+        count += 1;
+        pending += 1;
+        if pending == config::RECV_BATCH {
+          flush(&mut sink, &mut batches, wait).await;
+          pending = 0;
+          if close_rx.try_recv().is_ok() {
+            break;
+          }
+        }
+      }
+      // nothing more is coming to fill the gaps
+      for (cam, c) in cameras.iter_mut() {
+        c.finish(batches.entry(*cam).or_default());
+      }
+      flush(&mut sink, &mut batches, wait).await;
+
+      let secs = start.elapsed().as_secs_f64();
+      println!("replayed {} packets from {} in {:.3} s ({:.0} packets/s)",
+        count, replay.path, secs, count as f64 / secs.max(1e-9));
+      *task_status.lock().unwrap() = Status::Unconnected;
+    });
+
+    Ok(ReplayCtn {
+      info,
+      close: close_tx,
+      status,
+      handle,
+      _packet: std::marker::PhantomData,
+    })
+  }
+
+  fn close(self) -> Result<(), Error> {
+    self.close.try_send(());
+    Ok(util::sync(async {
+      self.handle.await
+    })?)
+  }
+
+  // nothing to send to, a replay only plays back what the cameras sent
+  fn send(&mut self, p: P) {}
+
+  fn get_status(&mut self) -> Status {
+    *self.status.lock().unwrap()
+  }
+
+  fn get_addr(&self) -> &'static str {
+    self.info.addr
+  }
+}
@@ -1,21 +1,29 @@
 use crate::util;
+use crate::config;
+use crate::queue;
+use crate::net::loss;
 use super::Packet;
-use super::{Status, CamCtnInfo, CamCtn};
+use super::{Status, CamCtnInfo, CamCtn, CamSink, Ingest};
+use super::batch::RecvRing;
 
 use tokio::sync::oneshot;
 use tokio::sync::mpsc;
 use tokio::net::UdpSocket;
-use std::io::Cursor;
+use tokio::io::Interest;
+use tokio::time::{sleep_until, Instant};
+use std::collections::HashMap;
 use std::sync::Arc;
-use std::io::Error;
+use std::sync::atomic::Ordering;
+use std::io::{Error, ErrorKind};
 
-pub const MTU: usize = 10000000;
+// Outgoing packets waiting for the socket task
+const SEND_QUEUE: usize = 16;
 
 struct NetThreadHandle<P: Packet> {
   close: mpsc::Sender<()>,
   status: (mpsc::UnboundedSender<()>, mpsc::Receiver<Status>),
   send_packet: mpsc::Sender<P>,
-  handle: tokio::task::JoinHandle<()>
+  thread: std::thread::JoinHandle<()>
 }
 
 pub struct UdpCtn<P: Packet> {
@@ -24,11 +32,9 @@ pub struct UdpCtn<P: Packet> {
 }
 
 impl<P: Packet> NetThreadHandle<P> {
-  fn req_close(self) -> Result<(), tokio::task::JoinError> {
-    self.close.send(());
-    util::sync(async {
-      self.handle.await
-    })
+  fn req_close(self) -> Result<(), Error> {
+    self.close.try_send(());
+    self.thread.join().map_err(|_| Error::new(ErrorKind::Other, "socket thread panicked"))
   }
 
   fn send_packet(&mut self, packet: P) -> Result<(), mpsc::error::TrySendError<P>> {
@@ -42,52 +48,165 @@ impl<P: Packet> NetThreadHandle<P> {
   }
 }
 
+fn recv_batch(socket: &UdpSocket, ring: &mut RecvRing) -> std::io::Result<usize> {
+  #[cfg(target_os = "linux")]
+  {
+    use std::os::fd::AsRawFd;
+    ring.recv_mmsg(socket.as_raw_fd(), libc::MSG_DONTWAIT)
+  }
+  #[cfg(not(target_os = "linux"))]
+  {
+    ring.recv_each(|buf| socket.try_recv(buf))
+  }
+}
+
+#[cfg(target_os = "linux")]
+fn set_int_option(socket: &socket2::Socket, name: libc::c_int, value: libc::c_int) -> std::io::Result<()> {
+  use std::os::fd::AsRawFd;
+  let r = unsafe {
+    libc::setsockopt(socket.as_raw_fd(), libc::SOL_SOCKET, name,
+                     &value as *const libc::c_int as *const libc::c_void,
+                     std::mem::size_of::<libc::c_int>() as libc::socklen_t)
+  };
+  if r < 0 { Err(Error::last_os_error()) } else { Ok(()) }
+}
+
+fn bind(info: &CamCtnInfo) -> std::io::Result<std::net::UdpSocket> {
+  use socket2::{Domain, Protocol, Socket, Type};
+  let addr: std::net::SocketAddr = format!("{}:{}", info.addr, info.port)
+    .parse()
+    .map_err(|_| Error::new(ErrorKind::InvalidInput, "bad address"))?;
+  let socket = Socket::new(Domain::for_address(addr), Type::DGRAM, Some(Protocol::UDP))?;
+  #[cfg(all(unix, not(any(target_os = "solaris", target_os = "illumos"))))]
+  socket.set_reuse_port(info.reuse_port)?;
+  socket.set_recv_buffer_size(config::RECV_BUFFER)?;
+  #[cfg(target_os = "linux")]
+  {
+    // past net.core.rmem_max only with CAP_NET_ADMIN; Linux reports double
+    if socket.recv_buffer_size()? < config::RECV_BUFFER
+      && set_int_option(&socket, libc::SO_RCVBUFFORCE, config::RECV_BUFFER as libc::c_int).is_err() {
+      println!("socket {}: receive buffer capped at {} bytes, raise net.core.rmem_max to {}",
+        info.id, socket.recv_buffer_size()? / 2, config::RECV_BUFFER);
+    }
+    // have the kernel's drop count delivered with every datagram
+    set_int_option(&socket, libc::SO_RXQ_OVFL, 1)?;
+    if info.busy_poll {
+      if let Err(e) = set_int_option(&socket, libc::SO_BUSY_POLL, config::BUSY_POLL_USEC) {
+        println!("socket {}: no SO_BUSY_POLL ({}), polling from user space only", info.id, e);
+      }
+    }
+  }
+  socket.set_nonblocking(true)?;
+  socket.bind(&addr.into())?;
+  Ok(socket.into())
+}
+
+// Wait until datagrams are queued. A busy polling socket does not wait: it
+// lets the other branches of the loop run and goes straight back to receive.
+async fn readable(socket: &UdpSocket, busy: bool) -> std::io::Result<()> {
+  if busy {
+    tokio::task::yield_now().await;
+    Ok(())
+  } else {
+    socket.readable().await
+  }
+}
+
 impl<P: Packet + 'static > CamCtn<P> for UdpCtn<P> {
-  fn new(info: CamCtnInfo, packet_out: mpsc::Sender<P> )
+  fn new(info: CamCtnInfo, mut sink: CamSink<P> )
          -> Result<UdpCtn<P> , std::io::Error> {
 
     let mut status = Status::Connected;
 
     let (close_tx , mut close_rx) = mpsc::channel::<()>(1);
-    let (packet_tx , mut packet_rx) = mpsc::channel::<P>(MTU);
+    let (packet_tx , mut packet_rx) = mpsc::channel::<P>(SEND_QUEUE);
     let (status_poll_tx , mut status_poll_rx) = mpsc::unbounded_channel();
-    let (status_info_tx , mut status_info_rx) = mpsc::channel::<Status>(MTU);
+    let (status_info_tx , mut status_info_rx) = mpsc::channel::<Status>(1);
 
     let id = info.id.clone(); 
-    let handle = tokio::spawn(async move {
+    let (core, busy) = (info.core, info.busy_poll);
+    let socket = bind(&info)?;
+    let record = info.record.clone();
+    let drops = loss::socket_drops(id);
+    // every socket gets a thread and runtime of its own, so a long decode on
+    // the compute pool can never hold up receiving
+    let receive = async move {
+      let socket = UdpSocket::from_std(socket).expect("unable to register socket");
       let mut status = Status::Unconnected;
-      let mut buf = Vec::with_capacity(MTU);
-      buf.resize(MTU, 0);
-      let socket = UdpSocket::bind(format!(
-          "{}:{}",
-          info.addr,
-          info.port
-      )).await.expect("Unable to bind to the specified address, check config.rs");
+      let mut ring = RecvRing::new(config::RECV_BATCH, config::MAX_DATAGRAM, config::RECV_POOL);
+      let mut batches: HashMap<usize, Vec<P>> = HashMap::new();
+      let mut cameras: HashMap<usize, Ingest<P>> = HashMap::new();
       loop {
+        let deadline = cameras.values().filter_map(|c| c.deadline()).min();
         tokio::select! {
-          p = socket.recv(&mut buf) => {
-            match p {
-              Ok(size) =>{
-                let slc = &buf[0..size];
-                let p = P::unmarshal(&mut Cursor::new(slc)).unwrap();
-                packet_out
-                  .send(p).await
-                  .expect(&format!("unable to receive packet from camera {}", id));
-
+          r = readable(&socket, busy) => {
+            if r.is_err() {
+              println!("invalid packet received!");
+              continue;
+            }
+            let r = if busy {
+              recv_batch(&socket, &mut ring)
+            } else {
+              socket.try_io(Interest::READABLE, || recv_batch(&socket, &mut ring))
+            };
+            match r {
+              Ok(_) => {
+                drops.store(ring.kernel_drops(), Ordering::Relaxed);
+                let mut log = record.as_ref().map(|r| r.lock().unwrap());
+                ring.drain(|mut d| {
+                  let raw = d.clone();
+                  let p = P::unmarshal(&mut d);
+                  let cam = p.as_ref().ok().and_then(|p| p.cam_id()).unwrap_or(id);
+                  if let Some(log) = log.as_mut() {
+                    if let Err(e) = log.append(cam, &raw) {
+                      println!("unable to record packet: {}", e);
+                    }
+                  }
+                  match p {
+                    Ok(p) => cameras.entry(cam)
+                      .or_insert_with(|| Ingest::new(cam))
+                      .push(p, batches.entry(cam).or_default()),
+                    Err(_) => println!("invalid packet received!"),
+                  }
+                });
+                drop(log);
+                sink.flush(&mut batches);
               }
+              Err(e) if e.kind() == std::io::ErrorKind::WouldBlock => {}
               Err(_) => println!("invalid packet received!"),
             }
           },
+          _ = sleep_until(deadline.unwrap_or_else(Instant::now)), if deadline.is_some() => {
+            let now = Instant::now();
+            for (cam, c) in cameras.iter_mut() {
+              c.expire(now, batches.entry(*cam).or_default());
+            }
+            sink.flush(&mut batches);
+          }
           _ = status_poll_rx.recv() => {
             status_info_tx.send(status);
           }
           _ = close_rx.recv() => {
-            println!("shutting down thread for camera {}",  id);
+            println!("shutting down socket {}",  id);
             return;
           }
         }
       }
-    });
+    };
+    let thread = std::thread::Builder::new()
+      .name(format!("net-io-{}", id))
+      .spawn(move || {
+        if let Some(core) = core {
+          if let Err(e) = util::pin_thread(&[core]) {
+            println!("socket {}: unable to pin to core {}: {}", id, core, e);
+          }
+        }
+        tokio::runtime::Builder::new_current_thread()
+          .enable_all()
+          .build()
+          .expect("unable to start socket runtime")
+          .block_on(receive)
+      })?;
 
     let mut ctn = UdpCtn::<P> { 
       info,
@@ -95,7 +214,7 @@ impl<P: Packet + 'static > CamCtn<P> for UdpCtn<P> {
         close: close_tx,
         send_packet: packet_tx,
         status: (status_poll_tx, status_info_rx),
-        handle
+        thread
       }
     };
 
@@ -0,0 +1,225 @@
+// Append-only capture log of received datagrams.
+//
+// Layout, all little-endian:
+//   file header  magic "TSCAPv1\0", u64 capture start (ns since the unix epoch)
+//   record       u64 arrival (ns since capture start), u32 length,
+//                u16 camera id, u16 reserved, datagram, zero padding to 8 bytes
+// The file is written through a shared memory mapping that grows in
+// SEGMENT steps, so appending is a memcpy. Space past the last record reads
+// as a zero length record, which is where a reader stops; a log cut short by
+// a crash is still readable up to its last complete record.
+
+use bytes::Bytes;
+use std::fs::{File, OpenOptions};
+use std::io;
+use std::sync::{Arc, Mutex};
+use std::time::{Instant, SystemTime, UNIX_EPOCH};
+
+const MAGIC: &[u8; 8] = b"TSCAPv1\0";
+const FILE_HEADER: usize = 16;
+const RECORD_HEADER: usize = 16;
+const SEGMENT: usize = 64 << 20;
+
+/// Writer shared by every connection that records into the same log
+pub type Recorder = Arc<Mutex<CaptureWriter>>;
+
+/// How fast a replay feeds the log back
+#[derive(Copy, Clone, Debug)]
+pub enum Speed {
+  /// Keep the recorded gaps between datagrams divided by this factor
+  Scaled(f64),
+  /// Send as soon as the pipeline has room, never dropping
+  Max,
+}
+
+/// Log to read and how to pace it
+#[derive(Clone, Debug)]
+pub struct Replay {
+  pub path: String,
+  pub speed: Speed,
+}
+
+struct Mapping {
+  ptr: *mut u8,
+  len: usize,
+}
+
+unsafe impl Send for Mapping {}
+unsafe impl Sync for Mapping {}
+
+impl Mapping {
+  fn new(file: &File, offset: u64, len: usize, writable: bool) -> io::Result<Mapping> {
+    use std::os::fd::AsRawFd;
+    let prot = if writable { libc::PROT_READ | libc::PROT_WRITE } else { libc::PROT_READ };
+    let ptr = unsafe {
+      libc::mmap(std::ptr::null_mut(), len, prot, libc::MAP_SHARED,
+                 file.as_raw_fd(), offset as libc::off_t)
+    };
+    if ptr == libc::MAP_FAILED {
+      return Err(io::Error::last_os_error());
+    }
+    Ok(Mapping { ptr: ptr as *mut u8, len })
+  }
+}
+
+impl AsRef<[u8]> for Mapping {
+  fn as_ref(&self) -> &[u8] {
+    unsafe { std::slice::from_raw_parts(self.ptr, self.len) }
+  }
+}
+
+impl Drop for Mapping {
+  fn drop(&mut self) {
+    unsafe { libc::munmap(self.ptr as *mut libc::c_void, self.len) };
+  }
+}
+
+fn page_size() -> u64 {
+  unsafe { libc::sysconf(libc::_SC_PAGESIZE) as u64 }
+}
+
+pub struct CaptureWriter {
+  file: File,
+  map: Option<Mapping>,
+  // file offset the mapping starts at
+  map_offset: u64,
+  // file offset of the next record
+  pos: u64,
+  start: Instant,
+  records: u64,
+}
+
+impl CaptureWriter {
+  pub fn create(path: &str) -> io::Result<CaptureWriter> {
+    let file = OpenOptions::new().read(true).write(true).create(true).truncate(true).open(path)?;
+    let mut w = CaptureWriter {
+      file,
+      map: None,
+      map_offset: 0,
+      pos: 0,
+      start: Instant::now(),
+      records: 0,
+    };
+    let epoch = SystemTime::now().duration_since(UNIX_EPOCH).unwrap_or_default().as_nanos() as u64;
+    let mut header = [0u8; FILE_HEADER];
+    header[..8].copy_from_slice(MAGIC);
+    header[8..].copy_from_slice(&epoch.to_le_bytes());
+    w.write(&header)?;
+    Ok(w)
+  }
+
+  pub fn recorder(path: &str) -> io::Result<Recorder> {
+    Ok(Arc::new(Mutex::new(CaptureWriter::create(path)?)))
+  }
+
+  pub fn records(&self) -> u64 {
+    self.records
+  }
+
+  // make room for len bytes at pos, moving the mapping forward when needed
+  fn reserve(&mut self, len: usize) -> io::Result<&mut [u8]> {
+    let mapped_end = self.map_offset + self.map.as_ref().map_or(0, |m| m.len as u64);
+    if self.map.is_none() || self.pos + len as u64 > mapped_end {
+      self.map = None;
+      let offset = self.pos & !(page_size() - 1);
+      let size = SEGMENT.max((self.pos - offset) as usize + len);
+      self.file.set_len(offset + size as u64)?;
+      self.map = Some(Mapping::new(&self.file, offset, size, true)?);
+      self.map_offset = offset;
+    }
+    let map = self.map.as_ref().unwrap();
+    let start = (self.pos - self.map_offset) as usize;
+    Ok(unsafe { std::slice::from_raw_parts_mut(map.ptr.add(start), len) })
+  }
+
+  fn write(&mut self, data: &[u8]) -> io::Result<()> {
+    self.reserve(data.len())?.copy_from_slice(data);
+    self.pos += data.len() as u64;
+    Ok(())
+  }
+
+  /// Append one datagram from camera cam, stamped with the time of the call
+  pub fn append(&mut self, cam: usize, data: &[u8]) -> io::Result<()> {
+    let ts = self.start.elapsed().as_nanos() as u64;
+    let padded = (RECORD_HEADER + data.len() + 7) & !7;
+    let rec = self.reserve(padded)?;
+    rec[0..8].copy_from_slice(&ts.to_le_bytes());
+    rec[8..12].copy_from_slice(&(data.len() as u32).to_le_bytes());
+    rec[12..14].copy_from_slice(&(cam as u16).to_le_bytes());
+    rec[14..16].fill(0);
+    rec[RECORD_HEADER..RECORD_HEADER + data.len()].copy_from_slice(data);
+    rec[RECORD_HEADER + data.len()..].fill(0);
+    self.pos += padded as u64;
+    self.records += 1;
+    Ok(())
+  }
+}
+
+impl Drop for CaptureWriter {
+  fn drop(&mut self) {
+    // cut the unused tail of the last segment
+    self.map = None;
+    let _ = self.file.set_len(self.pos);
+  }
+}
+
+pub struct Record {
+  /// Arrival time in ns since the capture started
+  pub ts: u64,
+  pub cam: usize,
+  pub data: Bytes,
+}
+
+/// A capture log mapped read-only. Records are slices of the mapping.
+pub struct Capture {
+  data: Bytes,
+  /// Capture start in ns since the unix epoch
+  pub start: u64,
+}
+
+impl Capture {
+  pub fn open(path: &str) -> io::Result<Capture> {
+    let bad = |what| io::Error::new(io::ErrorKind::InvalidData, format!("{}: {}", path, what));
+    let file = File::open(path)?;
+    let len = file.metadata()?.len() as usize;
+    if len < FILE_HEADER {
+      return Err(bad("not a capture log"));
+    }
+    let data = Bytes::from_owner(Mapping::new(&file, 0, len, false)?);
+    if &data[..8] != MAGIC {
+      return Err(bad("not a capture log"));
+    }
+    let start = u64::from_le_bytes(data[8..16].try_into().unwrap());
+    Ok(Capture { data, start })
+  }
+
+  pub fn records(&self) -> Records {
+    Records { data: self.data.clone(), pos: FILE_HEADER }
+  }
+}
+
+pub struct Records {
+  data: Bytes,
+  pos: usize,
+}
+
+impl Iterator for Records {
+  type Item = Record;
+
+  fn next(&mut self) -> Option<Record> {
+    let d = &self.data;
+    if self.pos + RECORD_HEADER > d.len() {
+      return None;
+    }
+    let h = &d[self.pos..self.pos + RECORD_HEADER];
+    let ts = u64::from_le_bytes(h[0..8].try_into().unwrap());
+    let len = u32::from_le_bytes(h[8..12].try_into().unwrap()) as usize;
+    let cam = u16::from_le_bytes(h[12..14].try_into().unwrap()) as usize;
+    let start = self.pos + RECORD_HEADER;
+    if len == 0 || start + len > d.len() {
+      return None;
+    }
+    self.pos = (start + len + 7) & !7;
+    Some(Record { ts, cam, data: d.slice(start..start + len) })
+  }
+}
@@ -0,0 +1,144 @@
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Mutex};
+
+/// Frame counters this far behind the newest are a restarted camera
+pub const MAX_FRAME_BACKSTEP: i64 = 1000;
+
+/// Delivery counters of one camera, shared by every connection that hears it
+/// and by its detector. Packet counts come from transport sequence numbers
+/// (RTP only), window and frame counts from the frame counter in every window.
+#[derive(Default)]
+pub struct Counters {
+  pub received: AtomicU64,
+  pub lost: AtomicU64,
+  pub reordered: AtomicU64,
+  pub duplicates: AtomicU64,
+  pub late: AtomicU64,
+  pub windows: AtomicU64,
+  pub frames: AtomicU64,
+  pub frames_skipped: AtomicU64,
+  pub windows_reordered: AtomicU64,
+  pub windows_duplicate: AtomicU64,
+  pub stale: AtomicU64,
+  // newest frame the detector fed to the filters, plus one; 0 for none yet
+  processed: AtomicU64,
+}
+
+impl Counters {
+  pub fn add(c: &AtomicU64, n: u64) {
+    c.fetch_add(n, Ordering::Relaxed);
+  }
+
+  // a packet given up on turned up after all
+  pub fn found(&self) {
+    let _ = self.lost.fetch_update(Ordering::Relaxed, Ordering::Relaxed, |l| l.checked_sub(1));
+  }
+
+  /// Record that the filters have seen frame ts of this camera
+  pub fn processed(&self, ts: u32) {
+    self.processed.fetch_max(ts as u64 + 1, Ordering::Relaxed);
+  }
+
+  /// Newest frame the filters have seen
+  pub fn last_processed(&self) -> Option<u32> {
+    match self.processed.load(Ordering::Relaxed) {
+      0 => None,
+      p => Some((p - 1) as u32),
+    }
+  }
+
+  /// Whether frame ts is older than the newest the filters have seen
+  pub fn is_stale(&self, ts: u32) -> bool {
+    let Some(done) = self.last_processed() else { return false };
+    let d = ts.wrapping_sub(done) as i32 as i64;
+    if d < -MAX_FRAME_BACKSTEP {
+      // the filters saw a frame from before the camera restarted
+      self.restart();
+      return false;
+    }
+    d < 0
+  }
+
+  // the camera restarted its frame counter
+  pub fn restart(&self) {
+    self.processed.store(0, Ordering::Relaxed);
+  }
+}
+
+#[derive(Clone, Debug)]
+pub struct LossStats {
+  pub cam: usize,
+  pub received: u64,
+  pub lost: u64,
+  pub reordered: u64,
+  pub duplicates: u64,
+  pub late: u64,
+  pub windows: u64,
+  pub frames: u64,
+  pub frames_skipped: u64,
+  pub windows_reordered: u64,
+  pub windows_duplicate: u64,
+  pub stale: u64,
+}
+
+impl LossStats {
+  /// Share of the packets the camera sent that never arrived, known only
+  /// for transports with sequence numbers
+  pub fn loss_rate(&self) -> Option<f64> {
+    let sent = self.received - self.duplicates + self.lost;
+    if sent == 0 { None } else { Some(self.lost as f64 / sent as f64) }
+  }
+
+  /// Share of frame numbers no window arrived for. Upper bound on frame
+  /// loss: a frame without a tag in view sends nothing either.
+  pub fn frame_gap_rate(&self) -> f64 {
+    let spanned = self.frames + self.frames_skipped;
+    if spanned == 0 { 0.0 } else { self.frames_skipped as f64 / spanned as f64 }
+  }
+}
+
+static REGISTRY: Mutex<Vec<(usize, Arc<Counters>)>> = Mutex::new(Vec::new());
+
+/// Counters of camera cam, created on first use
+pub fn counters(cam: usize) -> Arc<Counters> {
+  let mut reg = REGISTRY.lock().unwrap();
+  if let Some((_, c)) = reg.iter().find(|(i, _)| *i == cam) {
+    return c.clone();
+  }
+  let c = Arc::new(Counters::default());
+  reg.push((cam, c.clone()));
+  c
+}
+
+/// Snapshot of every camera heard so far
+pub fn stats() -> Vec<LossStats> {
+  let load = |c: &AtomicU64| c.load(Ordering::Relaxed);
+  REGISTRY.lock().unwrap().iter().map(|(cam, c)| LossStats {
+    cam: *cam,
+    received: load(&c.received),
+    lost: load(&c.lost),
+    reordered: load(&c.reordered),
+    duplicates: load(&c.duplicates),
+    late: load(&c.late),
+    windows: load(&c.windows),
+    frames: load(&c.frames),
+    frames_skipped: load(&c.frames_skipped),
+    windows_reordered: load(&c.windows_reordered),
+    windows_duplicate: load(&c.windows_duplicate),
+    stale: load(&c.stale),
+  }).collect()
+}
+
+static SOCKETS: Mutex<Vec<(usize, Arc<AtomicU64>)>> = Mutex::new(Vec::new());
+
+/// Kernel receive drops of ingest socket id, kept up to date by its thread
+pub fn socket_drops(id: usize) -> Arc<AtomicU64> {
+  let c = Arc::new(AtomicU64::new(0));
+  SOCKETS.lock().unwrap().push((id, c.clone()));
+  c
+}
+
+/// Datagrams each ingest socket lost to a full receive buffer
+pub fn kernel_drops() -> Vec<(usize, u64)> {
+  SOCKETS.lock().unwrap().iter().map(|(id, c)| (*id, c.load(Ordering::Relaxed))).collect()
+}
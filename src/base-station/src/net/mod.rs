@@ -1,3 +1,5 @@
 pub mod cam_ctn;
 pub mod protocol;
+pub mod capture;
 
+pub mod loss;
@@ -1,4 +1,4 @@
-//mod rtp;
+pub mod rtp;
 pub mod raw;
 pub mod ts_custom;
 
@@ -8,8 +8,28 @@ use tokio::io::Error;
 
 
 
+/// Where a window was cut from: the camera's frame counter and the window centre
+#[derive(Copy, Clone, PartialEq, Eq, Debug)]
+pub struct Window {
+  pub ts: u32,
+  pub px: u16,
+  pub py: u16,
+}
+
 pub trait Packet: Send + Sized {
   fn marshal<B: BufMut>(&self, buf: &mut B);
   fn unmarshal<B: Buf>(buf: &mut B) -> Result<Self, ()>; 
+  /// Camera that sent the packet, for protocols that carry one
+  fn cam_id(&self) -> Option<usize> {
+    None
+  }
+  /// Transport sequence number, for protocols that carry one
+  fn seq(&self) -> Option<u16> {
+    None
+  }
+  /// Frame and position of the window carried, for protocols that carry one
+  fn window(&self) -> Option<Window> {
+    None
+  }
 }
 
@@ -1,9 +1,9 @@
-use bytes::{Buf, BufMut};
+use bytes::{Buf, BufMut, Bytes};
 use super::Packet;
 
-impl Packet for Vec<u8> {
+impl Packet for Bytes {
   fn unmarshal<B: Buf>(buf: & mut B) -> Result<Self, ()> {
-    Ok(buf.chunk().to_vec())
+    Ok(buf.copy_to_bytes(buf.remaining()))
   }
 
   fn marshal<B: BufMut>(&self, buf: &mut B)  {
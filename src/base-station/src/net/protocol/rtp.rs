@@ -1,63 +1,259 @@
-use rtp::packet::Packet as RtpPacket;
-use rtp::Error;
-use rtp::extension::HeaderExtension;
-use webrtc_util::{Marshal, MarshalSize, Unmarshal};
-use bytes::buf::{Buf, BufMut};
-use serde::{Deserialize, Serialize};
-use crate::util::Point;
-use super::Packet;
+// RTP (RFC 3550) transport for TagStream windows, as sent by the firmware
+// with CONFIG_TRANSPORT_RTP.
+//
+//   fixed header     V=2, no padding, X=1, no CSRCs, payload type 96,
+//                    sequence number, timestamp = frame counter (one tick per
+//                    frame), SSRC = camera id
+//   extension        RFC 8285 one-byte header (profile 0xBEDE), one element
+//                    with id TAGSTREAM_EXTENSION_ID carrying the window
+//                    geometry: u16 width, u16 px, u16 py, u8 flags
+//   payload          width x width grayscale window
+//
+// Everything is big-endian. The decoder skips CSRCs, padding and unknown
+// extension elements so packets relayed by standard tooling still parse.
 
+use bytes::{Buf, BufMut, Bytes};
+use super::{Packet, Window};
+use super::ts_custom::{TagStreamHeader, TagStreamPacket};
 
-pub const TAGSTREAM_HEADER_EXTENSION_SIZE: usize = 4;
+pub const RTP_VERSION: u8 = 2;
+pub const RTP_HEADER_SIZE: usize = 12;
+pub const RTP_PAYLOAD_TYPE: u8 = 96;
+// One-byte header extension profile
+const EXTENSION_PROFILE: u16 = 0xBEDE;
+pub const TAGSTREAM_EXTENSION_ID: u8 = 1;
+// Extension element data, the one-byte element header not included
+pub const TAGSTREAM_EXTENSION_SIZE: usize = 7;
+// Profile, length, element header and data padded to a word
+pub const TAGSTREAM_EXTENSION_BLOCK: usize = 12;
+// Longest extension block parsed when it is split across buffer chunks
+const MAX_EXTENSION_BLOCK: usize = 64;
 pub const TAGSTREAM_HEADER_UID: &'static str = "urn:params:ts:rtp-ts:img_offset";
 
-#[derive(PartialEq, Eq, Debug, Default, Copy, Clone )]
+#[derive(PartialEq, Eq, Debug, Default, Copy, Clone)]
+pub struct RtpHeader {
+  pub marker: bool,
+  pub payload_type: u8,
+  pub seq: u16,
+  pub ts: u32,
+  pub ssrc: u32,
+}
+
+#[derive(PartialEq, Eq, Debug, Default, Copy, Clone)]
 pub struct TagStreamExtension {
-  pub offset: Point,
+  pub width: u16,
+  pub px: u16,
+  pub py: u16,
+  pub flags: u8,
 }
 
-impl MarshalSize for TagStreamExtension {
-  fn marshal_size(&self) -> usize {
-    return TAGSTREAM_HEADER_EXTENSION_SIZE;
-  }
+pub struct RtpPacket {
+  pub header: RtpHeader,
+  pub ext: TagStreamExtension,
+  pub data: Bytes,
 }
 
-impl Marshal for TagStreamExtension {
-  fn marshal_to(&self, mut buf: &mut [u8]) -> webrtc_util::Result<usize> {
-    buf.put_u16(self.offset.x);
-    buf.put_u16(self.offset.y);
-    Ok(TAGSTREAM_HEADER_EXTENSION_SIZE)
+// Find the TagStream element in a one-byte header extension block
+fn parse_extension(mut block: &[u8]) -> Option<TagStreamExtension> {
+  while let Some((&b, rest)) = block.split_first() {
+    block = rest;
+    // padding between elements
+    if b == 0 {
+      continue;
+    }
+    let (id, len) = (b >> 4, (b & 0x0f) as usize + 1);
+    // 15 ends the block
+    if id == 15 || len > block.len() {
+      return None;
+    }
+    let (mut data, rest) = block.split_at(len);
+    block = rest;
+    if id == TAGSTREAM_EXTENSION_ID && len == TAGSTREAM_EXTENSION_SIZE {
+      return Some(TagStreamExtension {
+        width: data.get_u16(),
+        px: data.get_u16(),
+        py: data.get_u16(),
+        flags: data.get_u8(),
+      });
+    }
   }
+  None
 }
 
-impl Unmarshal for TagStreamExtension {
-  fn unmarshal<B>(buf: &mut B) -> webrtc_util::Result<Self>
-  where
-    Self: Sized,
-    B: Buf {
-    if buf.remaining() < TAGSTREAM_HEADER_EXTENSION_SIZE {
-      Err(Error::ErrBufferTooSmall.into())
+impl Packet for RtpPacket {
+  fn unmarshal<B: Buf>(buf: &mut B) -> Result<Self, ()> {
+    if buf.remaining() < RTP_HEADER_SIZE {
+      return Err(());
+    }
+    let b0 = buf.get_u8();
+    let b1 = buf.get_u8();
+    if b0 >> 6 != RTP_VERSION || b0 & 0x10 == 0 {
+      return Err(());
+    }
+    let header = RtpHeader {
+      marker: b1 & 0x80 != 0,
+      payload_type: b1 & 0x7f,
+      seq: buf.get_u16(),
+      ts: buf.get_u32(),
+      ssrc: buf.get_u32(),
+    };
+
+    let csrc = (b0 & 0x0f) as usize * 4;
+    if buf.remaining() < csrc + 4 {
+      return Err(());
+    }
+    buf.advance(csrc);
+    let profile = buf.get_u16();
+    let len = buf.get_u16() as usize * 4;
+    if buf.remaining() < len || profile != EXTENSION_PROFILE {
+      return Err(());
+    }
+    // usually contiguous, copied when the buffer is not
+    let ext = if buf.chunk().len() >= len {
+      let ext = parse_extension(&buf.chunk()[..len]);
+      buf.advance(len);
+      ext
+    } else if len <= MAX_EXTENSION_BLOCK {
+      let mut block = [0u8; MAX_EXTENSION_BLOCK];
+      buf.copy_to_slice(&mut block[..len]);
+      parse_extension(&block[..len])
     } else {
-      Ok(TagStreamExtension {
-        offset: Point {
-          x: buf.get_u16(),
-          y: buf.get_u16()
-        }
-      })
+      None
+    }.ok_or(())?;
+
+    let mut data = buf.copy_to_bytes(buf.remaining());
+    if b0 & 0x20 != 0 {
+      // the last byte counts the padding, itself included
+      let pad = *data.last().ok_or(())? as usize;
+      if pad == 0 || pad > data.len() {
+        return Err(());
+      }
+      data.truncate(data.len() - pad);
+    }
+    Ok(RtpPacket { header, ext, data })
+  }
+
+  fn marshal<B: BufMut>(&self, buf: &mut B) {
+    let h = &self.header;
+    buf.put_u8(RTP_VERSION << 6 | 0x10);
+    buf.put_u8((h.marker as u8) << 7 | h.payload_type & 0x7f);
+    buf.put_u16(h.seq);
+    buf.put_u32(h.ts);
+    buf.put_u32(h.ssrc);
+    buf.put_u16(EXTENSION_PROFILE);
+    buf.put_u16(((TAGSTREAM_EXTENSION_BLOCK - 4) / 4) as u16);
+    buf.put_u8(TAGSTREAM_EXTENSION_ID << 4 | (TAGSTREAM_EXTENSION_SIZE - 1) as u8);
+    buf.put_u16(self.ext.width);
+    buf.put_u16(self.ext.px);
+    buf.put_u16(self.ext.py);
+    buf.put_u8(self.ext.flags);
+    buf.put_slice(&self.data)
+  }
+
+  fn cam_id(&self) -> Option<usize> {
+    Some(self.header.ssrc as usize)
+  }
+
+  fn seq(&self) -> Option<u16> {
+    Some(self.header.seq)
+  }
+
+  fn window(&self) -> Option<Window> {
+    Some(Window { ts: self.header.ts, px: self.ext.px, py: self.ext.py })
+  }
+}
+
+// The detector works on TagStream windows, whatever carried them
+impl From<RtpPacket> for TagStreamPacket {
+  fn from(p: RtpPacket) -> TagStreamPacket {
+    TagStreamPacket {
+      header: TagStreamHeader {
+        width: p.ext.width,
+        px: p.ext.px,
+        py: p.ext.py,
+        cam_id: p.header.ssrc as u8,
+        flags: p.ext.flags,
+        ts: p.header.ts,
+      },
+      data: p.data,
     }
   }
 }
 
+#[cfg(test)]
+mod tests {
+  use super::*;
 
-impl Packet for RtpPacket {
-  fn unmarshal<B: Buf>(buf: &mut B) -> Result<Self, ()> {
-    Ok(Unmarshal::unmarshal(buf).unwrap())
+  fn window() -> RtpPacket {
+    RtpPacket {
+      header: RtpHeader { marker: false, payload_type: RTP_PAYLOAD_TYPE, seq: 0xfffe, ts: 0x01020304, ssrc: 3 },
+      ext: TagStreamExtension { width: 4, px: 0x0140, py: 0x00f0, flags: 0 },
+      data: Bytes::from_static(&[1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16]),
+    }
   }
 
-  fn marshal<B: BufMut>(&self, buf: &mut B) {
-    //ferris please optimize this out
-    let mut slice: Vec<u8> = Vec::with_capacity(buf.remaining_mut());
-    self.marshal_to(&mut slice);
-    buf.put_slice(&slice)
+  // The bytes put_rtp_header and send_window in the firmware lay out for
+  // the same window
+  fn firmware_bytes() -> Vec<u8> {
+    let mut b = vec![
+      0x90, 96,                    // V=2, X=1; payload type
+      0xff, 0xfe,                  // sequence number
+      0x01, 0x02, 0x03, 0x04,      // frame counter
+      0x00, 0x00, 0x00, 0x03,      // camera id
+      0xbe, 0xde, 0x00, 0x02,      // one-byte extension profile, 2 words
+      0x16,                        // element id 1, 7 bytes
+      0x00, 0x04, 0x01, 0x40, 0x00, 0xf0, 0x00, // width, px, py, flags
+    ];
+    b.extend(1..=16u8);
+    b
+  }
+
+  #[test]
+  fn marshal_matches_firmware() {
+    let mut buf = Vec::new();
+    window().marshal(&mut buf);
+    assert_eq!(buf, firmware_bytes());
+    assert_eq!(buf.len(), RTP_HEADER_SIZE + TAGSTREAM_EXTENSION_BLOCK + 16);
+  }
+
+  #[test]
+  fn unmarshal_firmware_window() {
+    let p = RtpPacket::unmarshal(&mut Bytes::from(firmware_bytes())).unwrap();
+    let w = window();
+    assert_eq!(p.header, w.header);
+    assert_eq!(p.ext, w.ext);
+    assert_eq!(p.data, w.data);
+    assert_eq!(p.cam_id(), Some(3));
+    assert_eq!(p.seq(), Some(0xfffe));
+  }
+
+  // A relayed packet: a CSRC, an unknown element before the TagStream one
+  // and three bytes of padding
+  #[test]
+  fn unmarshal_skips_csrcs_elements_and_padding() {
+    let mut b = vec![0xb1, 96, 0xff, 0xfe, 0x01, 0x02, 0x03, 0x04, 0x00, 0x00, 0x00, 0x03];
+    b.extend([0xaa, 0xbb, 0xcc, 0xdd]);
+    b.extend([0xbe, 0xde, 0x00, 0x03]);
+    b.extend([0x21, 0x55, 0x66, 0x00]);
+    b.extend([0x16, 0x00, 0x04, 0x01, 0x40, 0x00, 0xf0, 0x00]);
+    b.extend(1..=16u8);
+    b.extend([0, 0, 3]);
+    let p = RtpPacket::unmarshal(&mut Bytes::from(b)).unwrap();
+    let w = window();
+    assert_eq!((p.header, p.ext, p.data), (w.header, w.ext, w.data));
+  }
+
+  #[test]
+  fn unmarshal_refuses_truncated_or_foreign() {
+    let b = firmware_bytes();
+    assert!(RtpPacket::unmarshal(&mut Bytes::copy_from_slice(&b[..RTP_HEADER_SIZE + 2])).is_err());
+    // no extension
+    let mut plain = b.clone();
+    plain[0] = 0x80;
+    assert!(RtpPacket::unmarshal(&mut Bytes::from(plain)).is_err());
+    // version 1
+    let mut old = b.clone();
+    old[0] = 0x50;
+    assert!(RtpPacket::unmarshal(&mut Bytes::from(old)).is_err());
   }
 }
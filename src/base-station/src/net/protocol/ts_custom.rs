@@ -1,42 +1,60 @@
-use bytes::{Buf, BufMut};
-use super::Packet;
+use bytes::{Buf, BufMut, Bytes};
+use super::{Packet, Window};
 
+pub const TAGSTREAM_HEADER_SIZE: usize = 12;
+
+// Little-endian, laid out like the firmware's TagHeader struct
 pub struct TagStreamHeader {
   pub width : u16,
   pub px : u16,
   pub py : u16,
+  pub cam_id : u8,
+  pub flags : u8,
   pub ts: u32,
 }
 
 pub struct TagStreamPacket {
   pub header: TagStreamHeader,
-  pub data: Vec<u8>,
+  pub data: Bytes,
 }
 
 impl Packet for TagStreamPacket {
   fn unmarshal<B: Buf>(buf: & mut B) -> Result<Self, ()> {
-    let mut header = TagStreamHeader {
-        width : u16::from_be(buf.get_u16()),
-        px : u16::from_be(buf.get_u16()),
-        py : u16::from_be(buf.get_u16()),
-        ts:  0
+    if buf.remaining() < TAGSTREAM_HEADER_SIZE {
+      return Err(());
+    }
+    let header = TagStreamHeader {
+        width : buf.get_u16_le(),
+        px : buf.get_u16_le(),
+        py : buf.get_u16_le(),
+        cam_id : buf.get_u8(),
+        flags : buf.get_u8(),
+        ts : buf.get_u32_le(),
       };
-    //throw away spacer due to struct alignment
-    buf.get_u16();
-    header.ts = u32::from_be(buf.get_u32());
 
     Ok(TagStreamPacket {
       header: header,
-      data: buf.chunk().to_vec()
+      data: buf.copy_to_bytes(buf.remaining())
     })
   }
 
   fn marshal<B: BufMut>(&self, buf: &mut B)  {
-    buf.put_u16(self.header.width);
-    buf.put_u16(self.header.px);
-    buf.put_u16(self.header.py);
-    buf.put_u32(self.header.ts);
+    buf.put_u16_le(self.header.width);
+    buf.put_u16_le(self.header.px);
+    buf.put_u16_le(self.header.py);
+    buf.put_u8(self.header.cam_id);
+    buf.put_u8(self.header.flags);
+    buf.put_u32_le(self.header.ts);
     buf.put_slice(&self.data)
   }
+
+  fn cam_id(&self) -> Option<usize> {
+    Some(self.header.cam_id as usize)
+  }
+
+  fn window(&self) -> Option<Window> {
+    let h = &self.header;
+    Some(Window { ts: h.ts, px: h.px, py: h.py })
+  }
 }
 
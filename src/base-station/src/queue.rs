@@ -0,0 +1,216 @@
+use std::collections::VecDeque;
+use std::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
+use std::sync::{Arc, Mutex, MutexGuard, OnceLock};
+use tokio::sync::Notify;
+
+/// What a full queue does with a new entry. Entries are never refused, the
+/// producer does not wait, so a slow stage can only make the pipeline drop
+/// data, never grow memory or latency.
+#[derive(Copy, Clone, PartialEq, Eq, Debug)]
+pub enum Overflow {
+  /// Drop the oldest entry to make room
+  DropOldest,
+  /// Replace the queued entry with the same key (a camera or a tag), so only
+  /// the newest one per key waits; falls back to DropOldest when full
+  LatestWins,
+}
+
+/// Counters of one queue, shared with the stats registry
+#[derive(Default)]
+pub struct Counters {
+  sent: AtomicU64,
+  dropped: AtomicU64,
+  depth: AtomicUsize,
+  max_depth: AtomicUsize,
+}
+
+#[derive(Clone, Debug)]
+pub struct QueueStats {
+  pub name: String,
+  pub capacity: usize,
+  pub sent: u64,
+  pub dropped: u64,
+  pub depth: usize,
+  pub max_depth: usize,
+}
+
+struct Shared<T> {
+  policy: Overflow,
+  capacity: usize,
+  entries: Mutex<VecDeque<(usize, T)>>,
+  notify: Notify,
+  space: Notify,
+  senders: AtomicUsize,
+  counters: Arc<Counters>,
+  // emptied entries the receiver handed back for senders to refill
+  spare: Mutex<Vec<T>>,
+  // called after every send, for receivers that do not wait in recv
+  on_send: OnceLock<Box<dyn Fn() + Send + Sync>>,
+}
+
+pub struct Tx<T> {
+  shared: Arc<Shared<T>>,
+}
+
+pub struct Rx<T> {
+  shared: Arc<Shared<T>>,
+}
+
+static REGISTRY: Mutex<Vec<(String, usize, Arc<Counters>)>> = Mutex::new(Vec::new());
+
+/// Create a bounded queue. The name and counters show up in stats().
+pub fn bounded<T>(name: impl Into<String>, capacity: usize, policy: Overflow) -> (Tx<T>, Rx<T>) {
+  let capacity = capacity.max(1);
+  let counters = Arc::new(Counters::default());
+  REGISTRY.lock().unwrap().push((name.into(), capacity, counters.clone()));
+
+  let shared = Arc::new(Shared {
+    policy,
+    capacity,
+    entries: Mutex::new(VecDeque::with_capacity(capacity)),
+    notify: Notify::new(),
+    space: Notify::new(),
+    senders: AtomicUsize::new(1),
+    counters,
+    spare: Mutex::new(Vec::with_capacity(capacity)),
+    on_send: OnceLock::new(),
+  });
+  (Tx { shared: shared.clone() }, Rx { shared })
+}
+
+/// Snapshot of every queue created so far
+pub fn stats() -> Vec<QueueStats> {
+  REGISTRY.lock().unwrap().iter().map(|(name, capacity, c)| QueueStats {
+    name: name.clone(),
+    capacity: *capacity,
+    sent: c.sent.load(Ordering::Relaxed),
+    dropped: c.dropped.load(Ordering::Relaxed),
+    depth: c.depth.load(Ordering::Relaxed),
+    max_depth: c.max_depth.load(Ordering::Relaxed),
+  }).collect()
+}
+
+impl<T> Tx<T> {
+  /// Queue v under key, applying the overflow policy. Never waits.
+  /// Returns false when an entry was dropped to make room.
+  pub fn send(&self, key: usize, v: T) -> bool {
+    let entries = self.shared.entries.lock().unwrap();
+    self.push(entries, key, v)
+  }
+
+  /// Queue v under key, waiting for room instead of dropping the oldest
+  /// entry. For sources that can be slowed down, like a replay.
+  pub async fn send_wait(&self, key: usize, v: T) -> bool {
+    loop {
+      {
+        let entries = self.shared.entries.lock().unwrap();
+        if entries.len() < self.shared.capacity {
+          return self.push(entries, key, v);
+        }
+      }
+      self.shared.space.notified().await;
+    }
+  }
+
+  fn push(&self, mut entries: MutexGuard<VecDeque<(usize, T)>>, key: usize, v: T) -> bool {
+    let s = &*self.shared;
+    let c = &*s.counters;
+    c.sent.fetch_add(1, Ordering::Relaxed);
+
+    let mut kept = true;
+    let latest = match s.policy {
+      Overflow::LatestWins => entries.iter_mut().find(|(k, _)| *k == key),
+      Overflow::DropOldest => None,
+    };
+    if let Some(e) = latest {
+      e.1 = v;
+      kept = false;
+    } else {
+      if entries.len() == s.capacity {
+        entries.pop_front();
+        kept = false;
+      }
+      entries.push_back((key, v));
+    }
+    if !kept {
+      c.dropped.fetch_add(1, Ordering::Relaxed);
+    }
+    c.depth.store(entries.len(), Ordering::Relaxed);
+    c.max_depth.fetch_max(entries.len(), Ordering::Relaxed);
+    drop(entries);
+
+    s.notify.notify_one();
+    if let Some(f) = s.on_send.get() {
+      f();
+    }
+    kept
+  }
+}
+
+impl<T> Tx<Vec<T>> {
+  /// An empty batch to fill for the next send: one the receiver recycled
+  /// when there is one, so a steady stream of batches does not allocate
+  pub fn spare(&self) -> Vec<T> {
+    self.shared.spare.lock().unwrap().pop().unwrap_or_default()
+  }
+}
+
+impl<T> Clone for Tx<T> {
+  fn clone(&self) -> Tx<T> {
+    self.shared.senders.fetch_add(1, Ordering::Relaxed);
+    Tx { shared: self.shared.clone() }
+  }
+}
+
+impl<T> Drop for Tx<T> {
+  fn drop(&mut self) {
+    if self.shared.senders.fetch_sub(1, Ordering::AcqRel) == 1 {
+      self.shared.notify.notify_one();
+    }
+  }
+}
+
+impl<T> Rx<T> {
+  /// Have f called after every send, so a receiver polling several queues
+  /// from a plain thread can sleep until one of them has something. Only
+  /// the first call has an effect.
+  pub fn on_send<F: Fn() + Send + Sync + 'static>(&self, f: F) {
+    let _ = self.shared.on_send.set(Box::new(f));
+  }
+
+  pub fn try_recv(&mut self) -> Option<T> {
+    let mut entries = self.shared.entries.lock().unwrap();
+    let v = entries.pop_front().map(|(_, v)| v);
+    self.shared.counters.depth.store(entries.len(), Ordering::Relaxed);
+    drop(entries);
+    if v.is_some() {
+      self.shared.space.notify_one();
+    }
+    v
+  }
+
+  /// Wait for the next entry, None once every sender is gone and the queue
+  /// is empty
+  pub async fn recv(&mut self) -> Option<T> {
+    loop {
+      if let Some(v) = self.try_recv() {
+        return Some(v);
+      }
+      if self.shared.senders.load(Ordering::Acquire) == 0 {
+        return self.try_recv();
+      }
+      self.shared.notify.notified().await;
+    }
+  }
+}
+
+impl<T> Rx<Vec<T>> {
+  /// Hand an emptied batch back for Tx::spare, up to the queue's capacity
+  pub fn recycle(&self, mut v: Vec<T>) {
+    v.clear();
+    let mut spare = self.shared.spare.lock().unwrap();
+    if spare.len() < self.shared.capacity {
+      spare.push(v);
+    }
+  }
+}
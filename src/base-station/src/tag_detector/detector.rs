@@ -7,6 +7,29 @@ use apriltag::{
 };
 use tokio::sync::Mutex; 
 pub type TagID = usize;
+
+/// A tag found in an image, in its pixel coordinates
+#[derive(Clone, Debug)]
+pub struct TagDetection {
+  pub id: TagID,
+  pub center: [f64;2],
+  pub corners: [[f64;2];4],
+  // how far the decoded bits were from flipping, higher is surer
+  pub decision_margin: f32,
+  // bits corrected to match the code
+  pub hamming: usize,
+}
+
+impl TagDetection {
+  /// The same detection moved by (dx, dy)
+  pub fn offset(mut self, dx: f64, dy: f64) -> TagDetection {
+    self.center = [self.center[0] + dx, self.center[1] + dy];
+    for c in self.corners.iter_mut() {
+      *c = [c[0] + dx, c[1] + dy];
+    }
+    self
+  }
+}
 pub struct SafeDetector(Detector);
 
 pub struct Detwrapper {
@@ -23,6 +46,8 @@ pub trait DetectorExt {
     builder.add_family_bits(family,1).build().unwrap()
   }
   fn detect_one(&mut self, img: &Image) -> Option<(TagID, [f64;2])>;
+  /// Every tag in img decoded with a decision margin of at least min_margin
+  fn detect_all(&mut self, img: &Image, min_margin: f32) -> Vec<TagDetection>;
 }
 
 
@@ -37,4 +62,17 @@ impl DetectorExt for Detector {
       }
     }
   }
+
+  fn detect_all(&mut self, img: &Image, min_margin: f32) -> Vec<TagDetection> {
+    self.detect(img).iter()
+      .filter(|det| det.decision_margin() >= min_margin)
+      .map(|det| TagDetection {
+        id: det.id(),
+        center: det.center(),
+        corners: det.corners(),
+        decision_margin: det.decision_margin(),
+        hamming: det.hamming(),
+      })
+      .collect()
+  }
 }
@@ -1,26 +1,214 @@
 use apriltag::Image;
 use apriltag::image_buf::DEFAULT_ALIGNMENT_U8;
 use apriltag_sys::image_u8;
+use std::collections::HashMap;
+use std::mem::ManuallyDrop;
+use std::ops::Deref;
 //use opencv::prelude::*;
 
+// Images kept per window size
+const POOL_PER_SIZE: usize = 4;
+// Border around every window of a mosaic, wider than the blur and edge
+// refinement reach so no quad can span two windows. White reads as more of
+// a tag's quiet zone and adds no edges of its own.
+const GUARD: usize = 8;
+const GUARD_FILL: u8 = 255;
+
 pub trait ImageExt {
-	fn as_aprilimg(&mut self, w:usize, h:usize) -> Image;
+	fn as_aprilimg(&self, w:usize, h:usize) -> Image;
 }
 impl ImageExt for [u8] {
-	fn as_aprilimg(&mut self, w:usize, h:usize) -> Image {
+	fn as_aprilimg(&self, w:usize, h:usize) -> Image {
     let mut image = Image::zeros_with_stride(
       w, h, w
     ).unwrap();
-    let len = image.as_slice().len();
-    for i in 0..(self.len()) {
-      if(len <= i) {
-        break;
+    copy_rows(self, w, h, image.as_slice_mut(), w);
+    image
+  }
+}
+
+// Copy the packed w x h pixels in src into rows of stride bytes, zeroing
+// whatever src is too short to cover
+fn copy_rows(src: &[u8], w: usize, h: usize, dst: &mut [u8], stride: usize) {
+  for y in 0..h {
+    let row = &mut dst[y * stride..y * stride + w];
+    let start = (y * w).min(src.len());
+    let end = (start + w).min(src.len());
+    let (have, missing) = row.split_at_mut(end - start);
+    have.copy_from_slice(&src[start..end]);
+    missing.fill(0);
+  }
+}
+
+/// Detector images for windows. A window whose pixels fill the packet is
+/// handed to the detector in place, the packet buffer wrapped as an image
+/// with the window width as stride; the detector only reads it. A short
+/// window is copied row by row into an image reused between windows of the
+/// same size.
+pub struct ImagePool {
+  free: HashMap<(usize, usize), Vec<Image>>,
+  // header of the wrapped packet buffer, boxed so the image can point at it
+  view: Box<image_u8>,
+}
+// the header only points at a packet while a WindowImage borrows both
+unsafe impl Send for ImagePool {}
+
+pub struct WindowImage<'a> {
+  image: ManuallyDrop<Image>,
+  // where a pooled image goes back to; None for a wrapped packet
+  pool: Option<&'a mut Vec<Image>>,
+}
+
+impl ImagePool {
+  pub fn new() -> ImagePool {
+    ImagePool {
+      free: HashMap::new(),
+      view: Box::new(image_u8 { width: 0, height: 0, stride: 0, buf: std::ptr::null_mut() }),
+    }
+  }
+
+  /// Image of the w x h window packed in data
+  pub fn window<'a>(&'a mut self, data: &'a [u8], w: usize, h: usize) -> WindowImage<'a> {
+    if w > 0 && h > 0 && data.len() >= w * h {
+      *self.view = image_u8 {
+        width: w as i32,
+        height: h as i32,
+        stride: w as i32,
+        buf: data.as_ptr() as *mut u8,
+      };
+      // never destroyed, the header and pixels are not the image's to free
+      let image = unsafe { Image::from_raw(&mut *self.view) };
+      return WindowImage { image: ManuallyDrop::new(image), pool: None };
+    }
+
+    let pool = self.free.entry((w, h)).or_default();
+    let mut image = pool.pop().unwrap_or_else(|| {
+      Image::zeros_with_alignment(w, h, DEFAULT_ALIGNMENT_U8).unwrap()
+    });
+    let stride = image.stride();
+    copy_rows(data, w, h, image.as_slice_mut(), stride);
+    WindowImage { image: ManuallyDrop::new(image), pool: Some(pool) }
+  }
+}
+
+impl Deref for WindowImage<'_> {
+  type Target = Image;
+
+  fn deref(&self) -> &Image {
+    &self.image
+  }
+}
+
+impl Drop for WindowImage<'_> {
+  fn drop(&mut self) {
+    if let Some(pool) = self.pool.take() {
+      let image = unsafe { ManuallyDrop::take(&mut self.image) };
+      if pool.len() < POOL_PER_SIZE {
+        pool.push(image);
       }
-      image[(i%w, i/h)] = self[i];
     }
-    image
   }
 }
+/// Where a window sits in a mosaic
+#[derive(Copy, Clone, Debug)]
+pub struct Tile {
+  pub x: usize,
+  pub y: usize,
+  pub w: usize,
+  pub h: usize,
+}
+
+/// Windows packed side by side into one image, so a single detector pass
+/// covers them all. Windows are placed left to right on shelves as high as
+/// their tallest window, each ringed by a guard border.
+pub struct Mosaic {
+  buf: Vec<u8>,
+  width: usize,
+  height: usize,
+  tiles: Vec<Tile>,
+  // where the next window goes, and the height of the shelf so far
+  x: usize,
+  y: usize,
+  shelf: usize,
+  view: Box<image_u8>,
+}
+
+impl Mosaic {
+  pub fn new(width: usize, height: usize) -> Mosaic {
+    Mosaic {
+      buf: vec![GUARD_FILL; width * height],
+      width,
+      height,
+      tiles: Vec::new(),
+      x: GUARD,
+      y: GUARD,
+      shelf: 0,
+      view: Box::new(image_u8 { width: 0, height: 0, stride: 0, buf: std::ptr::null_mut() }),
+    }
+  }
+
+  pub fn len(&self) -> usize {
+    self.tiles.len()
+  }
+
+  pub fn tiles(&self) -> &[Tile] {
+    &self.tiles
+  }
+
+  /// Place the w x h window packed in data, false when it does not fit
+  pub fn add(&mut self, data: &[u8], w: usize, h: usize) -> bool {
+    let (mut x, mut y, mut shelf) = (self.x, self.y, self.shelf);
+    if x + w + GUARD > self.width && shelf > 0 {
+      // start a shelf above the current one
+      (x, y, shelf) = (GUARD, y + shelf + GUARD, 0);
+    }
+    if w == 0 || x + w + GUARD > self.width || y + h + GUARD > self.height {
+      return false;
+    }
+    copy_rows(data, w, h, &mut self.buf[y * self.width + x..], self.width);
+    self.tiles.push(Tile { x, y, w, h });
+    (self.x, self.y, self.shelf) = (x + w + GUARD, y, shelf.max(h));
+    true
+  }
+
+  /// Pixels of tile t onwards, and the stride of their rows
+  pub fn pixels(&self, t: usize) -> (&[u8], usize) {
+    let tile = &self.tiles[t];
+    (&self.buf[tile.y * self.width + tile.x..], self.width)
+  }
+
+  /// The rows in use so far as a detector image
+  pub fn image(&mut self) -> WindowImage<'_> {
+    *self.view = image_u8 {
+      width: self.width as i32,
+      height: (self.y + self.shelf + GUARD).min(self.height) as i32,
+      stride: self.width as i32,
+      buf: self.buf.as_mut_ptr(),
+    };
+    let image = unsafe { Image::from_raw(&mut *self.view) };
+    WindowImage { image: ManuallyDrop::new(image), pool: None }
+  }
+
+  /// The window point (x, y) of the mosaic falls in
+  pub fn locate(&self, x: f64, y: f64) -> Option<usize> {
+    self.tiles.iter().position(|t| {
+      x >= t.x as f64 && x < (t.x + t.w) as f64 && y >= t.y as f64 && y < (t.y + t.h) as f64
+    })
+  }
+
+  /// Empty the mosaic for the next batch
+  pub fn clear(&mut self) {
+    for t in self.tiles.drain(..) {
+      for row in t.y..t.y + t.h {
+        self.buf[row * self.width + t.x..][..t.w].fill(GUARD_FILL);
+      }
+    }
+    self.x = GUARD;
+    self.y = GUARD;
+    self.shelf = 0;
+  }
+}
+
 /*
 impl ImageExt for Mat {
 	fn as_aprilimg(&mut self, w:usize, h:usize) -> Image {
@@ -1,3 +1,7 @@
 pub mod tag;
 pub mod detector;
 pub mod image;
+pub mod pool;
+pub mod track;
+pub mod profile;
+pub mod pose;
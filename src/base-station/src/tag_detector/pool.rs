@@ -0,0 +1,278 @@
+use super::detector::DetectorExt;
+use super::image::{ImagePool, Mosaic};
+use super::profile::Profile;
+use crate::config;
+use crate::queue;
+use crate::util;
+use apriltag::Detector;
+use std::collections::VecDeque;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Condvar, Mutex, RwLock};
+use std::time::{Duration, Instant};
+
+/// What a detection worker owns: a single-threaded detector and the images
+/// it decodes windows from
+pub struct Worker {
+  pub id: usize,
+  pub det: Detector,
+  pub images: ImagePool,
+  // set when windows are batched into mosaics
+  pub mosaic: Option<Mosaic>,
+  // what the detector is set up with
+  profile: Option<Profile>,
+}
+
+/// How many windows a worker gathers into one batch, and how long it waits
+/// for them once it has the first
+#[derive(Copy, Clone, Debug)]
+pub struct Batching {
+  pub windows: usize,
+  pub deadline: Duration,
+}
+
+impl Worker {
+  fn new(id: usize, batching: Option<Batching>) -> Worker {
+    let mut det = Detector::new("tagCustom48h12");
+    // a window is too small to split, the pool runs windows side by side
+    det.set_thread_number(1);
+    let mosaic = batching.map(|_| Mosaic::new(config::MOSAIC_SIZE, config::MOSAIC_SIZE));
+    Worker { id, det, images: ImagePool::new(), mosaic, profile: None }
+  }
+
+  /// Set the detector up with p for the next detections
+  pub fn use_profile(&mut self, p: &Profile) {
+    if self.profile.as_ref() != Some(p) {
+      p.apply(&mut self.det);
+      self.profile = Some(*p);
+    }
+  }
+}
+
+#[derive(Default)]
+struct Counters {
+  windows: AtomicU64,
+  stolen: AtomicU64,
+  busy_ns: AtomicU64,
+}
+
+#[derive(Clone, Debug)]
+pub struct WorkerStats {
+  pub worker: usize,
+  pub core: Option<usize>,
+  pub windows: u64,
+  // windows taken from another worker's cameras
+  pub stolen: u64,
+  // time spent detecting since the worker started
+  pub busy: Duration,
+}
+
+static REGISTRY: Mutex<Vec<(usize, Option<usize>, Arc<Counters>)>> = Mutex::new(Vec::new());
+
+/// Snapshot of every detection worker
+pub fn stats() -> Vec<WorkerStats> {
+  REGISTRY.lock().unwrap().iter().map(|(worker, core, c)| WorkerStats {
+    worker: *worker,
+    core: *core,
+    windows: c.windows.load(Ordering::Relaxed),
+    stolen: c.stolen.load(Ordering::Relaxed),
+    busy: Duration::from_nanos(c.busy_ns.load(Ordering::Relaxed)),
+  }).collect()
+}
+
+struct Source<P> {
+  cam: usize,
+  rx: Mutex<queue::Rx<Vec<P>>>,
+}
+
+struct Shared<P> {
+  // camera queues, in the order the cameras turned up; camera k belongs to
+  // worker k % workers
+  sources: RwLock<Vec<Source<P>>>,
+  // windows a worker has taken off a camera queue but not detected yet,
+  // popped from the front by their worker and from the back by thieves
+  local: Vec<Mutex<VecDeque<(usize, P)>>>,
+  counters: Vec<Arc<Counters>>,
+  // set when something was queued since a worker last looked
+  signal: Mutex<bool>,
+  wake: Condvar,
+}
+
+/// Detection workers shared by every camera, one per core, each with a
+/// single-threaded detector. A worker serves its own cameras first, then
+/// steals windows other workers took but have not got to and batches
+/// from other cameras' queues, so throughput follows the core count
+/// whether one camera is busy or many.
+pub struct DetectorPool<P> {
+  shared: Arc<Shared<P>>,
+}
+
+impl<P> Clone for DetectorPool<P> {
+  fn clone(&self) -> DetectorPool<P> {
+    DetectorPool { shared: self.shared.clone() }
+  }
+}
+
+impl<P: Send + 'static> DetectorPool<P> {
+  /// Start a worker pinned to each of cores, handing windows to detect
+  /// along with the camera they came from: one at a time, or as many as
+  /// batching gathers. detect takes the windows out of the batch.
+  pub fn new<F>(cores: &[usize], batching: Option<Batching>, detect: F) -> DetectorPool<P>
+  where
+    F: Fn(&mut Worker, &mut Vec<(usize, P)>) + Send + Sync + 'static
+  {
+    let n = cores.len().max(1);
+    let shared = Arc::new(Shared {
+      sources: RwLock::new(Vec::new()),
+      local: (0..n).map(|_| Mutex::new(VecDeque::new())).collect(),
+      counters: (0..n).map(|_| Arc::new(Counters::default())).collect(),
+      signal: Mutex::new(false),
+      wake: Condvar::new(),
+    });
+    let detect = Arc::new(detect);
+    for w in 0..n {
+      let core = cores.get(w).copied();
+      REGISTRY.lock().unwrap().push((w, core, shared.counters[w].clone()));
+      let (shared, detect) = (shared.clone(), detect.clone());
+      std::thread::Builder::new()
+        .name(format!("detect-{}", w))
+        .spawn(move || {
+          if let Some(core) = core {
+            if let Err(e) = util::pin_thread(&[core]) {
+              println!("detector {}: unable to pin to core {}: {}", w, core, e);
+            }
+          }
+          let mut worker = Worker::new(w, batching);
+          shared.run(&mut worker, batching, &*detect);
+        })
+        .expect("unable to start a detection worker");
+    }
+    println!("Started {} detection workers", n);
+    DetectorPool { shared }
+  }
+
+  /// Open the queue camera cam's windows are detected from
+  pub fn camera(&self, cam: usize, capacity: usize) -> queue::Tx<Vec<P>> {
+    let (tx, rx) = queue::bounded::<Vec<P>>(
+      format!("camera {}", cam), capacity, queue::Overflow::DropOldest);
+    let shared = Arc::downgrade(&self.shared);
+    rx.on_send(move || {
+      if let Some(s) = shared.upgrade() {
+        s.notify();
+      }
+    });
+    self.shared.sources.write().unwrap().push(Source { cam, rx: Mutex::new(rx) });
+    tx
+  }
+}
+
+impl<P> Shared<P> {
+  fn notify(&self) {
+    *self.signal.lock().unwrap() = true;
+    self.wake.notify_one();
+  }
+
+  fn run<F>(&self, worker: &mut Worker, batching: Option<Batching>, detect: &F)
+  where
+    F: Fn(&mut Worker, &mut Vec<(usize, P)>)
+  {
+    let c = &*self.counters[worker.id];
+    let mut jobs = Vec::new();
+    loop {
+      match self.next(worker.id) {
+        Some(job) => {
+          jobs.push(job);
+          if let Some(b) = batching {
+            self.gather(worker.id, b, &mut jobs);
+          }
+          let n = jobs.len() as u64;
+          let start = Instant::now();
+          detect(worker, &mut jobs);
+          jobs.clear();
+          c.busy_ns.fetch_add(start.elapsed().as_nanos() as u64, Ordering::Relaxed);
+          c.windows.fetch_add(n, Ordering::Relaxed);
+        }
+        None => self.sleep(None),
+      }
+    }
+  }
+
+  // Add windows to jobs until the batch is full or its deadline passes
+  fn gather(&self, w: usize, b: Batching, jobs: &mut Vec<(usize, P)>) {
+    let deadline = Instant::now() + b.deadline;
+    while jobs.len() < b.windows {
+      match self.next(w) {
+        Some(job) => jobs.push(job),
+        None => {
+          let now = Instant::now();
+          if now >= deadline {
+            break;
+          }
+          self.sleep(Some(deadline - now));
+        }
+      }
+    }
+  }
+
+  // Wait until something is queued, or for at most timeout
+  fn sleep(&self, timeout: Option<Duration>) {
+    let mut signal = self.signal.lock().unwrap();
+    match timeout {
+      None => while !*signal {
+        signal = self.wake.wait(signal).unwrap();
+      },
+      Some(t) => if !*signal {
+        signal = self.wake.wait_timeout(signal, t).unwrap().0;
+      },
+    }
+    *signal = false;
+  }
+
+  // The next window for worker w: its own backlog, a batch of one of its
+  // cameras, then whatever other workers and cameras have waiting
+  fn next(&self, w: usize) -> Option<(usize, P)> {
+    if let Some(job) = self.local[w].lock().unwrap().pop_front() {
+      return Some(job);
+    }
+    let n = self.local.len();
+    let sources = self.sources.read().unwrap();
+    if let Some(job) = self.take(w, sources.iter().enumerate().filter(|(k, _)| k % n == w)) {
+      return Some(job);
+    }
+    for v in (1..n).map(|i| (w + i) % n) {
+      if let Some(job) = self.local[v].lock().unwrap().pop_back() {
+        self.counters[w].stolen.fetch_add(1, Ordering::Relaxed);
+        return Some(job);
+      }
+    }
+    let job = self.take(w, sources.iter().enumerate().filter(|(k, _)| k % n != w));
+    if job.is_some() {
+      self.counters[w].stolen.fetch_add(1, Ordering::Relaxed);
+    }
+    job
+  }
+
+  // Pull a batch from the first of sources that has one, keeping all but
+  // its first window in w's backlog for it or a thief to get to
+  fn take<'a, I>(&self, w: usize, sources: I) -> Option<(usize, P)>
+  where
+    I: Iterator<Item = (usize, &'a Source<P>)>,
+    P: 'a
+  {
+    for (_, s) in sources {
+      // another worker is already pulling from this camera
+      let Ok(mut rx) = s.rx.try_lock() else { continue };
+      let Some(mut batch) = rx.try_recv() else { continue };
+      let mut windows = batch.drain(..).map(|p| (s.cam, p));
+      let first = windows.next();
+      self.local[w].lock().unwrap().extend(windows);
+      // the emptied batch goes back to the socket for its next packets
+      rx.recycle(batch);
+      drop(rx);
+      let Some(first) = first else { continue };
+      // there may be more where this came from, let an idle worker look
+      self.notify();
+      return Some(first);
+    }
+    None
+  }
+}
@@ -0,0 +1,79 @@
+use nalgebra::{Matrix3, SMatrix, SVector, Vector3};
+
+/// Pinhole intrinsics of a camera, in pixels
+#[derive(Copy, Clone, Debug)]
+pub struct Intrinsics {
+  pub fx: f64,
+  pub fy: f64,
+  pub cx: f64,
+  pub cy: f64,
+}
+
+/// A tag relative to a camera: the rotation from tag to camera axes and the
+/// tag centre in camera coordinates, in the unit of the tag size
+#[derive(Copy, Clone, Debug)]
+pub struct TagPose {
+  pub rotation: Matrix3<f64>,
+  pub translation: Vector3<f64>,
+}
+
+// Tag coordinates of the corners, in the order the detector reports them
+const TAG_CORNERS: [[f64; 2]; 4] = [[-1.0, 1.0], [1.0, 1.0], [1.0, -1.0], [-1.0, -1.0]];
+
+/// Intrinsics of every camera, a row of fx, fy, cx, cy per camera id
+pub fn load_intrinsics(path: &str) -> Vec<Intrinsics> {
+  let file = std::fs::read(path)
+    .expect(&format!("unable to find the camera intrinsics at \"{}\"", path));
+  let data = npyz::NpyFile::new(&file[..]).unwrap().into_vec::<f64>().unwrap();
+  data.chunks_exact(4).map(|k| Intrinsics { fx: k[0], fy: k[1], cx: k[2], cy: k[3] }).collect()
+}
+
+/// Homography taking tag coordinates (-1..1 across the tag) to the given
+/// corner pixels, None for a degenerate quad
+pub fn homography(corners: &[[f64; 2]; 4]) -> Option<Matrix3<f64>> {
+  // with h33 = 1, two equations per corner
+  let mut a = SMatrix::<f64, 8, 8>::zeros();
+  let mut b = SVector::<f64, 8>::zeros();
+  for (k, (&[x, y], &[u, v])) in TAG_CORNERS.iter().zip(corners).enumerate() {
+    let (ru, rv) = (2 * k, 2 * k + 1);
+    for (c, e) in [x, y, 1.0, 0.0, 0.0, 0.0, -u * x, -u * y].into_iter().enumerate() {
+      a[(ru, c)] = e;
+    }
+    for (c, e) in [0.0, 0.0, 0.0, x, y, 1.0, -v * x, -v * y].into_iter().enumerate() {
+      a[(rv, c)] = e;
+    }
+    b[ru] = u;
+    b[rv] = v;
+  }
+  let h = a.lu().solve(&b)?;
+  Some(Matrix3::new(h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7], 1.0))
+}
+
+/// Pose of a tag of side size seen through homography h by a camera with
+/// intrinsics k
+pub fn tag_pose(h: &Matrix3<f64>, k: &Intrinsics, size: f64) -> Option<TagPose> {
+  let k_inv = Matrix3::new(
+    1.0 / k.fx, 0.0, -k.cx / k.fx,
+    0.0, 1.0 / k.fy, -k.cy / k.fy,
+    0.0, 0.0, 1.0);
+  // columns are r1, r2 and t up to a common scale
+  let m = k_inv * h;
+  let (c1, c2, c3) = (m.column(0).into_owned(), m.column(1).into_owned(), m.column(2).into_owned());
+  let mut scale = (c1.norm() * c2.norm()).sqrt();
+  if scale < 1e-12 {
+    return None;
+  }
+  // the tag is in front of the camera
+  if c3.z < 0.0 {
+    scale = -scale;
+  }
+  let (r1, r2) = (c1 / scale, c2 / scale);
+  let r = Matrix3::from_columns(&[r1, r2, r1.cross(&r2)]);
+  // noise leaves r1 and r2 not quite orthonormal, take the nearest rotation
+  let svd = r.svd(true, true);
+  let (mut u, v_t) = (svd.u?, svd.v_t?);
+  if (u * v_t).determinant() < 0.0 {
+    u.column_mut(2).neg_mut();
+  }
+  Some(TagPose { rotation: u * v_t, translation: c3 / scale * (size / 2.0) })
+}
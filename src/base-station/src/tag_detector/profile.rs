@@ -0,0 +1,99 @@
+// Detector settings by window size.
+//
+// A profile file has one bucket per line, narrowest windows first:
+//   MAX_WIDTH DECIMATION SIGMA REFINE_EDGES SHARPENING
+// e.g. "128 1.0 2.0 1 0.25", with MAX_WIDTH "*" for no limit. A window is
+// detected with the first bucket at least as wide as it is, wider windows
+// with the last one. '#' starts a comment. tune_profiles writes these files from a capture log.
+
+use apriltag::Detector;
+use std::fmt;
+use std::io;
+
+#[derive(Copy, Clone, PartialEq, Debug)]
+pub struct Profile {
+  // work on the image scaled down this much to find quads
+  pub decimation: f32,
+  // gaussian blur before thresholding, 0 for none
+  pub sigma: f32,
+  // snap quad edges to the gradient of the full resolution image
+  pub refine_edges: bool,
+  // sharpen the decoded bits, helps small tags
+  pub sharpening: f64,
+}
+
+impl Profile {
+  pub fn apply(&self, det: &mut Detector) {
+    det.set_decimation(self.decimation);
+    det.set_sigma(self.sigma);
+    det.set_refine_edges(self.refine_edges);
+    det.set_shapening(self.sharpening);
+  }
+}
+
+pub struct Profiles {
+  buckets: Vec<(usize, Profile)>,
+}
+
+impl Default for Profiles {
+  // full resolution for small windows; above 128 px a tag spans enough
+  // pixels to be found at half resolution, with the blur halved to match
+  fn default() -> Profiles {
+    Profiles { buckets: vec![
+      (128, Profile { decimation: 1.0, sigma: 2.0, refine_edges: true, sharpening: 0.25 }),
+      (usize::MAX, Profile { decimation: 2.0, sigma: 1.0, refine_edges: true, sharpening: 0.25 }),
+    ] }
+  }
+}
+
+impl Profiles {
+  /// Buckets of (widest window, profile), narrowest first
+  pub fn new(mut buckets: Vec<(usize, Profile)>) -> Profiles {
+    buckets.sort_by_key(|(w, _)| *w);
+    if buckets.is_empty() {
+      return Profiles::default();
+    }
+    Profiles { buckets }
+  }
+
+  pub fn load(path: &str) -> io::Result<Profiles> {
+    let text = std::fs::read_to_string(path)?;
+    let mut buckets = Vec::new();
+    for (n, line) in text.lines().enumerate() {
+      let line = line.split('#').next().unwrap().trim();
+      if line.is_empty() {
+        continue;
+      }
+      let bad = || io::Error::new(io::ErrorKind::InvalidData, format!("{}:{}: bad profile", path, n + 1));
+      let f: Vec<&str> = line.split_whitespace().collect();
+      if f.len() != 5 {
+        return Err(bad());
+      }
+      let max = if f[0] == "*" { usize::MAX } else { f[0].parse().map_err(|_| bad())? };
+      buckets.push((max, Profile {
+        decimation: f[1].parse().map_err(|_| bad())?,
+        sigma: f[2].parse().map_err(|_| bad())?,
+        refine_edges: f[3] != "0",
+        sharpening: f[4].parse().map_err(|_| bad())?,
+      }));
+    }
+    Ok(Profiles::new(buckets))
+  }
+
+  /// Profile for windows w pixels wide
+  pub fn for_width(&self, w: usize) -> &Profile {
+    let last = &self.buckets[self.buckets.len() - 1].1;
+    self.buckets.iter().find(|(max, _)| w <= *max).map_or(last, |(_, p)| p)
+  }
+}
+
+impl fmt::Display for Profiles {
+  fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+    writeln!(f, "# max_width decimation sigma refine_edges sharpening")?;
+    for (max, p) in &self.buckets {
+      let max = if *max == usize::MAX { "*".to_string() } else { max.to_string() };
+      writeln!(f, "{} {} {} {} {}", max, p.decimation, p.sigma, p.refine_edges as u8, p.sharpening)?;
+    }
+    Ok(())
+  }
+}
@@ -0,0 +1,185 @@
+use super::detector::{TagDetection, TagID};
+use crate::config;
+use std::collections::HashMap;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::Mutex;
+
+// A tag seen in consecutive windows of one camera
+struct Track {
+  id: TagID,
+  // centre in camera pixels and its motion per frame
+  pos: [f64; 2],
+  vel: [f64; 2],
+  ts: u32,
+  // side of the tag in pixels, from the corners of the last decode
+  size: f64,
+  // decoded centre minus the darkness centroid, which the bits of the tag
+  // pull off centre
+  bias: [f64; 2],
+  verified: u32,
+}
+
+impl Track {
+  fn predict(&self, ts: u32) -> [f64; 2] {
+    let dt = ts.wrapping_sub(self.ts) as i32 as f64;
+    [self.pos[0] + self.vel[0] * dt, self.pos[1] + self.vel[1] * dt]
+  }
+
+  // a sighting from an older frame than the last one is no news
+  fn update(&mut self, pos: [f64; 2], ts: u32) {
+    let dt = ts.wrapping_sub(self.ts) as i32;
+    if dt > 0 {
+      for k in 0..2 {
+        let v = (pos[k] - self.pos[k]) / dt as f64;
+        self.vel[k] = 0.5 * self.vel[k] + 0.5 * v;
+      }
+      self.ts = ts;
+    }
+    if dt >= 0 {
+      self.pos = pos;
+    }
+  }
+}
+
+/// A window of a camera frame: where it sits and its pixels, rows stride
+/// bytes apart
+pub struct View<'a> {
+  pub ts: u32,
+  pub px: f64,
+  pub py: f64,
+  pub w: usize,
+  pub h: usize,
+  pub pixels: &'a [u8],
+  pub stride: usize,
+}
+
+/// Follows the tags each camera has decoded so most windows skip the full
+/// decode. A window in which exactly one known tag is expected gets only a
+/// darkness centroid around the predicted spot, corrected by the offset
+/// measured at the last decode; every verify_every frames, or when the
+/// window holds more or fewer tags than one or the centroid wanders off, the
+/// window is decoded in full again.
+pub struct Tracker {
+  cams: Mutex<HashMap<usize, Vec<Track>>>,
+  verify_every: u32,
+  tracked: AtomicU64,
+  verified: AtomicU64,
+}
+
+impl Tracker {
+  pub fn new(verify_every: u32) -> Tracker {
+    Tracker {
+      cams: Mutex::new(HashMap::new()),
+      verify_every: verify_every.max(1),
+      tracked: AtomicU64::new(0),
+      verified: AtomicU64::new(0),
+    }
+  }
+
+  /// The tag in camera cam's window v and its centre in the window, if a
+  /// track accounts for it without a decode
+  pub fn track(&self, cam: usize, v: &View) -> Option<(TagID, [f64; 2])> {
+    let mut cams = self.cams.lock().unwrap();
+    let tracks = cams.get_mut(&cam)?;
+    tracks.retain(|t| (v.ts.wrapping_sub(t.ts) as i32).abs() <= config::TRACK_MAX_AGE);
+
+    let mut inside = tracks.iter_mut().filter(|t| {
+      let [x, y] = t.predict(v.ts);
+      x >= v.px && x < v.px + v.w as f64 && y >= v.py && y < v.py + v.h as f64
+    });
+    let (t, None) = (inside.next()?, inside.next()) else { return None };
+    if v.ts.wrapping_sub(t.verified) as i32 >= self.verify_every as i32 {
+      return None;
+    }
+
+    let [x, y] = t.predict(v.ts);
+    let [cx, cy] = centroid(v, [x - v.px, y - v.py], t.size)?;
+    let c = [cx + t.bias[0], cy + t.bias[1]];
+    // a centroid this far off is not the tag it was taken for
+    if (c[0] + v.px - x).hypot(c[1] + v.py - y) > 0.5 * t.size {
+      return None;
+    }
+    t.update([c[0] + v.px, c[1] + v.py], v.ts);
+    self.tracked.fetch_add(1, Ordering::Relaxed);
+    Some((t.id, c))
+  }
+
+  /// Record a decode of tag det in camera cam's window v
+  pub fn verified(&self, cam: usize, v: &View, det: &TagDetection) {
+    let [x0, y0] = det.corners[0];
+    let [x2, y2] = det.corners[2];
+    let size = (x2 - x0).hypot(y2 - y0) / std::f64::consts::SQRT_2;
+    let bias = match centroid(v, det.center, size) {
+      Some([cx, cy]) => [det.center[0] - cx, det.center[1] - cy],
+      None => [0.0, 0.0],
+    };
+    let pos = [det.center[0] + v.px, det.center[1] + v.py];
+
+    let mut cams = self.cams.lock().unwrap();
+    let tracks = cams.entry(cam).or_default();
+    match tracks.iter_mut().find(|t| t.id == det.id) {
+      Some(t) => {
+        t.update(pos, v.ts);
+        t.size = size;
+        t.bias = bias;
+        if v.ts.wrapping_sub(t.verified) as i32 > 0 {
+          t.verified = v.ts;
+        }
+      }
+      None => tracks.push(Track {
+        id: det.id,
+        pos,
+        vel: [0.0, 0.0],
+        ts: v.ts,
+        size,
+        bias,
+        verified: v.ts,
+      }),
+    }
+    self.verified.fetch_add(1, Ordering::Relaxed);
+  }
+
+  /// Sightings from tracks and from full decodes so far
+  pub fn stats(&self) -> (u64, u64) {
+    (self.tracked.load(Ordering::Relaxed), self.verified.load(Ordering::Relaxed))
+  }
+}
+
+// Centroid of the pixels darker than the middle of their range, in the
+// square of side 1.5 size around at, in window coordinates
+fn centroid(v: &View, at: [f64; 2], size: f64) -> Option<[f64; 2]> {
+  let r = 0.75 * size;
+  let x0 = (at[0] - r).max(0.0) as usize;
+  let y0 = (at[1] - r).max(0.0) as usize;
+  let x1 = ((at[0] + r).ceil().max(0.0) as usize).min(v.w);
+  let y1 = ((at[1] + r).ceil().max(0.0) as usize).min(v.h);
+  if x0 >= x1 || y0 >= y1 || (y1 - 1) * v.stride + x1 > v.pixels.len() {
+    return None;
+  }
+  let rows = (y0..y1).map(|y| &v.pixels[y * v.stride + x0..y * v.stride + x1]);
+
+  let (mut lo, mut hi) = (u8::MAX, u8::MIN);
+  for row in rows.clone() {
+    for &p in row {
+      lo = lo.min(p);
+      hi = hi.max(p);
+    }
+  }
+  if hi - lo < config::TRACK_MIN_CONTRAST {
+    return None;
+  }
+  let mid = (lo as u32 + hi as u32) / 2;
+  let (mut sum, mut sx, mut sy) = (0u64, 0u64, 0u64);
+  for (y, row) in (y0..y1).zip(rows) {
+    for (x, &p) in (x0..x1).zip(row) {
+      let d = mid.saturating_sub(p as u32) as u64;
+      sum += d;
+      sx += d * x as u64;
+      sy += d * y as u64;
+    }
+  }
+  if sum == 0 {
+    return None;
+  }
+  Some([sx as f64 / sum as f64, sy as f64 / sum as f64])
+}
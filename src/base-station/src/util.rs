@@ -7,3 +7,23 @@ pub fn sync<F: Future>(future: F) -> F::Output {
   let rt = runtime::Runtime::new().unwrap();
   rt.block_on(future)
 }
+
+/// Restrict the calling thread to the given cores
+#[cfg(target_os = "linux")]
+pub fn pin_thread(cores: &[usize]) -> std::io::Result<()> {
+  unsafe {
+    let mut set: libc::cpu_set_t = std::mem::zeroed();
+    for &c in cores {
+      libc::CPU_SET(c, &mut set);
+    }
+    if libc::sched_setaffinity(0, std::mem::size_of::<libc::cpu_set_t>(), &set) < 0 {
+      return Err(std::io::Error::last_os_error());
+    }
+  }
+  Ok(())
+}
+
+#[cfg(not(target_os = "linux"))]
+pub fn pin_thread(_cores: &[usize]) -> std::io::Result<()> {
+  Err(std::io::Error::new(std::io::ErrorKind::Unsupported, "thread pinning needs Linux"))
+}
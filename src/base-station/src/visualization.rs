@@ -6,20 +6,23 @@ use kiss3d::nalgebra as na;
 use na::{Translation3, Point3, Vector3};
 use crate::{
   tag_detector::detector::TagID,
-  config,
-};
-
-use tokio::sync::{
-  mpsc,
-  mpsc::UnboundedReceiver,
+  queue,
 };
 
 
 type TagPoint = (TagID, na::Vector3<f64>);
 const POINT_RADIUS: f32 = 0.1; // Increase the radius for larger point representation
+const COLORS: [(f32, f32, f32); 6] = [
+  (1.0, 0.0, 0.0), // Red
+  (0.0, 1.0, 0.0), // Green
+  (0.0, 0.0, 1.0), // Blue
+  (1.0, 1.0, 0.0), // Yellow
+  (1.0, 0.0, 1.0), // Magenta
+  (0.0, 1.0, 1.0), // Cyan
+];
 
 
-pub fn visualize(points_rx: &mut UnboundedReceiver<TagPoint>) {
+pub fn visualize(points_rx: &mut queue::Rx<TagPoint>, tags: &[TagID]) {
   // Create a window for rendering.
   let mut window = Window::new("Kiss3d: moving point");
   println!("test");
@@ -34,15 +37,13 @@ pub fn visualize(points_rx: &mut UnboundedReceiver<TagPoint>) {
 
   // Create a spheres that will represent the point.
   let mut spheres: HashMap<TagID, SceneNode> = HashMap::new();
-  for i in config::TAGS {
-    spheres.insert(i, window.add_sphere(POINT_RADIUS));
+  for (n, &i) in tags.iter().enumerate() {
+    let mut sphere = window.add_sphere(POINT_RADIUS);
+    let (r, g, b) = COLORS[n % COLORS.len()];
+    sphere.set_color(r, g, b);
+    spheres.insert(i, sphere);
   }
 
-  // Set the color of the sphere (optional, default is white).
-  spheres.get_mut(&0).unwrap().set_color(1.0, 0.0, 0.0); // Red
-  spheres.get_mut(&1).unwrap().set_color(0.0, 1.0, 0.0); // Blue
-  spheres.get_mut(&2).unwrap().set_color(0.0, 0.0, 1.0); // Green
-
   // Axis length.
   let axis_length = 4.0;
   // Main loop.
@@ -60,7 +61,7 @@ pub fn visualize(points_rx: &mut UnboundedReceiver<TagPoint>) {
                      &Point3::new(0.0, 0.0, 1.0));
 
 
-    if let Ok((id, pos)) = points_rx.try_recv() {
+    while let Some((id, pos)) = points_rx.try_recv() {
       // Draw axis
       // Set the new position for the sphere.
       (&mut spheres.get_mut(&id).unwrap()).set_local_translation(
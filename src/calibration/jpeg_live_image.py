@@ -1,6 +1,7 @@
 import io
 from PIL import Image
 import socket 
+import struct
 
 # Setup UDP socket
 UDP_IP = None # use your IP address e.g. "35.2.34.134"
@@ -15,20 +16,39 @@ def save_image(image, filename):
     # Save the image to a file
     image.save(filename)
 
+# Datagram header written by jpg_udp_send: frame id, sequence number, camera id, flags
+HEADER = struct.Struct("<IHBB")
+FLAG_LAST = 0x01
+
 def update_image():
-    global jpeg_buffer
+    # Partially received frames, keyed by camera id: (frame id, {seq: payload}, last seq)
+    frames = {}
 
-    # Read JPEG data from UDP socket until a complete image is received
+    # Reassemble datagrams into JPEG frames until a complete image is received
     while True:
-        data, addr = sock.recvfrom(42769)
-        if data:
-            id = data[-1]
-            data = data[:-1]
+        data, addr = sock.recvfrom(2048)
+        if len(data) < HEADER.size:
+            continue
+        frame_id, seq, id, flags = HEADER.unpack_from(data)
+
+        # a new frame id from a camera drops whatever was left of its previous frame
+        cur = frames.get(id)
+        if cur is None or cur[0] != frame_id:
+            cur = (frame_id, {}, None)
+        chunks = cur[1]
+        chunks[seq] = data[HEADER.size:]
+        last = seq if flags & FLAG_LAST else cur[2]
+        frames[id] = (frame_id, chunks, last)
+
+        if last is None or len(chunks) != last + 1:
+            continue
+        del frames[id]
         # Use a context manager to open a file in binary write mode
         # You can replace 'image.jpg' with whatever file path you want
-            with open(f"calibration/image-{id}.jpg", 'wb') as image_file:
-                image_file.write(data)
-            print(f"Image received and saved from {addr}, id: {id}")
+        with open(f"calibration/image-{id}.jpg", 'wb') as image_file:
+            for i in range(last + 1):
+                image_file.write(chunks[i])
+        print(f"Image received and saved from {addr}, id: {id}, frame: {frame_id}")
         
 # Update the image
 update_image()
@@ -192,15 +192,24 @@ void app_main(void)
 
         ESP_LOGI(TAG, "Socket created, sending to %s:%d", HOST_IP_ADDR, PORT);
 
+    // frames go out as MTU-sized datagrams (see jpg_udp_header_t) instead of one oversized sendto
+    jpg_udp_target_t target = {
+        .sock = sock,
+        .dest_addr = (struct sockaddr *)&dest_addr,
+        .dest_len = sizeof(dest_addr),
+        .mtu = JPG_UDP_MTU_DEFAULT,
+        .cam_id = CAM_ID,
+        .frame_id = 0,
+    };
+
     while (1)
     {
         camera_fb_t *pic = esp_camera_fb_get();
-        pic->buf[pic->len] = CAM_ID; 
-        int err = sendto(sock, pic->buf, pic->len + 1, 0, (struct sockaddr *)&dest_addr, sizeof(dest_addr));
-        if (err < 0) {
+        if (!jpg_udp_send(pic->buf, pic->len, &target)) {
             ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
         }
-        ESP_LOGI(TAG, "Message sent");
+        ESP_LOGI(TAG, "Frame %lu sent", (unsigned long)target.frame_id);
+        ++target.frame_id;
         
         esp_camera_fb_return(pic);
     }
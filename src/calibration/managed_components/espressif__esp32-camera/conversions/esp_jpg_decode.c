@@ -14,7 +14,9 @@
 #include "esp_jpg_decode.h"
 
 #include "esp_system.h"
-#if ESP_IDF_VERSION_MAJOR >= 4 // IDF 4+
+#if CONFIG_CAMERA_JPEG_SW_DECODER
+#include "tjpgd.h"  // software decoder forced, it can skip chroma for luma output
+#elif ESP_IDF_VERSION_MAJOR >= 4 // IDF 4+
 #if CONFIG_IDF_TARGET_ESP32 // ESP32/PICO-D4
 #include "esp32/rom/tjpgd.h"
 #elif CONFIG_IDF_TARGET_ESP32S3
@@ -45,6 +47,7 @@ typedef struct {
         void * arg;
         size_t len;
         size_t index;
+        bool rgb2luma;
 } esp_jpg_decoder_t;
 
 static const char * jd_errors[] = {
@@ -69,6 +72,15 @@ static unsigned int _jpg_write(JDEC *decoder, void *bitmap, JRECT *rect)
 
     esp_jpg_decoder_t * jpeg = (esp_jpg_decoder_t *)decoder->device;
 
+    if (jpeg->rgb2luma) {
+        //decoder has no luma output, reduce the RGB block in place
+        size_t n = w * h;
+        for (size_t i = 0; i < n; i++) {
+            const uint8_t *c = data + i * 3;
+            data[i] = (77 * c[0] + 150 * c[1] + 29 * c[2]) >> 8;
+        }
+    }
+
     if (jpeg->writer) {
         return jpeg->writer(jpeg->arg, x, y, w, h, data);
     }
@@ -91,7 +103,7 @@ static unsigned int _jpg_read(JDEC *decoder, uint8_t *buf, unsigned int len)
     return len;
 }
 
-esp_err_t esp_jpg_decode(size_t len, jpg_scale_t scale, jpg_reader_cb reader, jpg_writer_cb writer, void * arg)
+static esp_err_t _jpg_decode(size_t len, jpg_scale_t scale, jpg_reader_cb reader, jpg_writer_cb writer, void * arg, bool luma)
 {
     static uint8_t work[3100];
     JDEC decoder;
@@ -103,6 +115,11 @@ esp_err_t esp_jpg_decode(size_t len, jpg_scale_t scale, jpg_reader_cb reader, jp
     jpeg.arg = arg;
     jpeg.scale = scale;
     jpeg.index = 0;
+#ifdef JD_HAS_LUMA
+    jpeg.rgb2luma = false;
+#else
+    jpeg.rgb2luma = luma;
+#endif
 
     JRESULT jres = jd_prepare(&decoder, _jpg_read, work, 3100, &jpeg);
     if(jres != JDR_OK){
@@ -116,6 +133,11 @@ esp_err_t esp_jpg_decode(size_t len, jpg_scale_t scale, jpg_reader_cb reader, jp
     //output start
     writer(arg, 0, 0, output_width, output_height, NULL);
     //output write
+#ifdef JD_HAS_LUMA
+    if (luma) {
+        jres = jd_decomp_luma(&decoder, _jpg_write, (uint8_t)jpeg.scale);
+    } else
+#endif
     jres = jd_decomp(&decoder, _jpg_write, (uint8_t)jpeg.scale);
     //output end
     writer(arg, output_width, output_height, output_width, output_height, NULL);
@@ -132,3 +154,12 @@ esp_err_t esp_jpg_decode(size_t len, jpg_scale_t scale, jpg_reader_cb reader, jp
     return ESP_OK;
 }
 
+esp_err_t esp_jpg_decode(size_t len, jpg_scale_t scale, jpg_reader_cb reader, jpg_writer_cb writer, void * arg)
+{
+    return _jpg_decode(len, scale, reader, writer, arg, false);
+}
+
+esp_err_t esp_jpg_decode_luma(size_t len, jpg_scale_t scale, jpg_reader_cb reader, jpg_writer_cb writer, void * arg)
+{
+    return _jpg_decode(len, scale, reader, writer, arg, true);
+}
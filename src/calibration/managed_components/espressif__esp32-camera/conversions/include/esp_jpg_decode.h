@@ -36,6 +36,16 @@ typedef bool (* jpg_writer_cb)(void * arg, uint16_t x, uint16_t y, uint16_t w, u
 
 esp_err_t esp_jpg_decode(size_t len, jpg_scale_t scale, jpg_reader_cb reader, jpg_writer_cb writer, void * arg);
 
+/**
+ * @brief Decode only the luminance of a JPEG, the writer receives 1 byte per pixel
+ *
+ * With the software decoder (CONFIG_CAMERA_JPEG_SW_DECODER or targets without
+ * a ROM decoder) chroma blocks are entropy decoded to advance the stream but
+ * never de-quantized, transformed or color converted. With the ROM decoder the
+ * Y value is computed from the decoded RGB block instead.
+ */
+esp_err_t esp_jpg_decode_luma(size_t len, jpg_scale_t scale, jpg_reader_cb reader, jpg_writer_cb writer, void * arg);
+
 #ifdef __cplusplus
 }
 #endif
@@ -26,6 +26,51 @@ extern "C" {
 
 typedef size_t (* jpg_out_cb)(void * arg, size_t index, const void* data, size_t len);
 
+struct sockaddr;
+
+#define JPG_UDP_MTU_DEFAULT     1400    /*!< Default datagram size (header + payload) */
+#define JPG_UDP_MTU_MAX         1472    /*!< Largest datagram that fits an unfragmented Ethernet frame */
+#define JPG_UDP_FLAG_LAST       0x01    /*!< Set on the final datagram of a frame */
+
+/**
+ * @brief Header prepended to every datagram sent by the JPEG UDP stream (little-endian)
+ */
+typedef struct __attribute__((packed)) {
+    uint32_t frame_id;      /*!< Frame the payload belongs to */
+    uint16_t seq;           /*!< Index of the datagram within the frame, starting at 0 */
+    uint8_t cam_id;         /*!< Camera that sent the frame */
+    uint8_t flags;          /*!< JPG_UDP_FLAG_* */
+} jpg_udp_header_t;
+
+/**
+ * @brief Destination and framing parameters for the JPEG UDP stream
+ */
+typedef struct {
+    int sock;                           /*!< Open SOCK_DGRAM socket */
+    const struct sockaddr *dest_addr;   /*!< Receiver address */
+    size_t dest_len;                    /*!< Length of dest_addr */
+    size_t mtu;                         /*!< Datagram size including header, 0 for JPG_UDP_MTU_DEFAULT */
+    uint8_t cam_id;                     /*!< Written to every header */
+    uint32_t frame_id;                  /*!< Written to every header */
+} jpg_udp_target_t;
+
+/**
+ * @brief Learn optimized Huffman tables from the frames being encoded
+ *
+ * The symbols of the next learn_frames encoded frames are counted while they are
+ * encoded with the current tables. Optimized tables are then built once and used
+ * single pass by every following frame, which gives close to two-pass bitrate for
+ * a camera looking at a similar scene. Tables keep a code for every symbol, so
+ * frames that differ from the learned ones still encode, just less compactly.
+ * Changing the quality starts learning over.
+ *
+ * Tables are shared by all encoders, encode from one task at a time.
+ *
+ * @param learn_frames      Frames to gather statistics from, 0 to go back to the standard tables
+ * @param refresh_frames    Gather statistics again after this many frames, 0 to never refresh
+ */
+void jpg_set_huffman_learning(uint16_t learn_frames, uint16_t refresh_frames);
+
 /**
  * @brief Convert image buffer to JPEG
  *
@@ -83,6 +128,47 @@ bool fmt2jpg(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixf
  */
 bool frame2jpg(camera_fb_t * fb, uint8_t quality, uint8_t ** out, size_t * out_len);
 
+/**
+ * @brief Convert image buffer to JPEG and send it as a sequence of datagrams
+ *
+ * Encoder output is packed into datagrams of at most target->mtu bytes, each
+ * starting with a jpg_udp_header_t, and sent as soon as a datagram is full.
+ * The complete JPEG is never held in memory.
+ *
+ * @param src       Source buffer in RGB565, RGB888, YUYV or GRAYSCALE format
+ * @param src_len   Length in bytes of the source buffer
+ * @param width     Width in pixels of the source image
+ * @param height    Height in pixels of the source image
+ * @param format    Format of the source image
+ * @param quality   JPEG quality of the resulting image
+ * @param target    Socket, destination and header fields to use
+ *
+ * @return true on success
+ */
+bool fmt2jpg_udp(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, const jpg_udp_target_t *target);
+
+/**
+ * @brief Convert camera frame buffer to JPEG and send it as a sequence of datagrams
+ *
+ * @param fb        Source camera frame buffer
+ * @param quality   JPEG quality of the resulting image
+ * @param target    Socket, destination and header fields to use
+ *
+ * @return true on success
+ */
+bool frame2jpg_udp(camera_fb_t * fb, uint8_t quality, const jpg_udp_target_t *target);
+
+/**
+ * @brief Send an already encoded JPEG using the same datagram framing as fmt2jpg_udp
+ *
+ * @param jpg       JPEG data
+ * @param jpg_len   Length in bytes of the JPEG data
+ * @param target    Socket, destination and header fields to use
+ *
+ * @return true on success
+ */
+bool jpg_udp_send(const uint8_t *jpg, size_t jpg_len, const jpg_udp_target_t *target);
+
 /**
  * @brief Convert image buffer to BMP buffer
  *
@@ -109,6 +195,48 @@ bool fmt2bmp(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixf
  */
 bool frame2bmp(camera_fb_t * fb, uint8_t ** out, size_t * out_len);
 
+/**
+ * @brief Convert image buffer to BMP and write it through a callback
+ *
+ * The BMP is produced one row at a time (one MCU row for JPEG sources), so only
+ * a row buffer is allocated no matter how large the image is.
+ *
+ * @param src       Source buffer in JPEG, RGB565, RGB888, YUYV or GRAYSCALE format
+ * @param src_len   Length in bytes of the source buffer
+ * @param width     Width in pixels of the source image
+ * @param height    Height in pixels of the source image
+ * @param format    Format of the source image
+ * @param cb        Callback to be called to write the bytes of the output BMP,
+ *                  returning less than len aborts the conversion
+ * @param arg       Pointer to be passed to the callback
+ *
+ * @return true on success
+ */
+bool fmt2bmp_cb(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, jpg_out_cb cb, void * arg);
+
+/**
+ * @brief Convert camera frame buffer to BMP and write it through a callback
+ *
+ * @param fb        Source camera frame buffer
+ * @param cb        Callback to be called to write the bytes of the output BMP
+ * @param arg       Pointer to be passed to the callback
+ *
+ * @return true on success
+ */
+bool frame2bmp_cb(camera_fb_t * fb, jpg_out_cb cb, void * arg);
+
+/**
+ * @brief Decode JPEG to BMP and write it through a callback, one MCU row at a time
+ *
+ * @param src       JPEG data
+ * @param src_len   Length in bytes of the JPEG data
+ * @param cb        Callback to be called to write the bytes of the output BMP
+ * @param arg       Pointer to be passed to the callback
+ *
+ * @return true on success
+ */
+bool jpg2bmp_cb(const uint8_t *src, size_t src_len, jpg_out_cb cb, void * arg);
+
 /**
  * @brief Convert image buffer to RGB888 buffer (used for face detection)
  *
@@ -123,6 +251,21 @@ bool fmt2rgb888(const uint8_t *src_buf, size_t src_len, pixformat_t format, uint
 
 bool jpg2rgb565(const uint8_t *src, size_t src_len, uint8_t * out, jpg_scale_t scale);
 
+/**
+ * @brief Decode the luminance of a JPEG into an 8-bit grayscale buffer
+ *
+ * Chroma is skipped instead of being converted to RGB and back, which makes
+ * this the cheapest way to feed marker or chessboard detection.
+ *
+ * @param src       Source buffer in JPEG format
+ * @param src_len   Length in bytes of the source buffer
+ * @param out       Pointer to the output buffer ((width >> scale) * (height >> scale))
+ * @param scale     Downscaling applied while decoding
+ *
+ * @return true on success
+ */
+bool jpg2gray(const uint8_t *src, size_t src_len, uint8_t * out, jpg_scale_t scale);
+
 #ifdef __cplusplus
 }
 #endif
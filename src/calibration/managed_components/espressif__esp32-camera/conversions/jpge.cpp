@@ -79,6 +79,14 @@ namespace jpge {
     static uint8 m_huff_bits[4][17];
     static uint8 m_huff_val[4][256];
 
+    // Huffman table learning state, shared by all encoders like the tables themselves.
+    // The symbol counters are only allocated once learning is enabled.
+    static uint32 (*m_huff_count)[256] = NULL;
+    static bool m_huff_optimized = false;   // tables above were built from m_huff_count
+    static bool m_huff_relearn = false;     // quality changed, the statistics no longer apply
+    static int m_huff_learned = 0;          // frames accumulated in m_huff_count
+    static int m_huff_used = 0;             // frames encoded with the optimized tables
+
     static inline uint8 clamp(int i) {
         if (i < 0) {
             i = 0;
@@ -183,6 +191,128 @@ namespace jpge {
         }
     }
 
+    static void load_standard_huffman_tables()
+    {
+        memcpy(m_huff_bits[0+0], s_dc_lum_bits, 17);    memcpy(m_huff_val[0+0], s_dc_lum_val, DC_LUM_CODES);
+        memcpy(m_huff_bits[2+0], s_ac_lum_bits, 17);    memcpy(m_huff_val[2+0], s_ac_lum_val, AC_LUM_CODES);
+        memcpy(m_huff_bits[0+1], s_dc_chroma_bits, 17); memcpy(m_huff_val[0+1], s_dc_chroma_val, DC_CHROMA_CODES);
+        memcpy(m_huff_bits[2+1], s_ac_chroma_bits, 17); memcpy(m_huff_val[2+1], s_ac_chroma_val, AC_CHROMA_CODES);
+
+        compute_huffman_table(&m_huff_codes[0+0][0], &m_huff_code_sizes[0+0][0], m_huff_bits[0+0], m_huff_val[0+0]);
+        compute_huffman_table(&m_huff_codes[2+0][0], &m_huff_code_sizes[2+0][0], m_huff_bits[2+0], m_huff_val[2+0]);
+        compute_huffman_table(&m_huff_codes[0+1][0], &m_huff_code_sizes[0+1][0], m_huff_bits[0+1], m_huff_val[0+1]);
+        compute_huffman_table(&m_huff_codes[2+1][0], &m_huff_code_sizes[2+1][0], m_huff_bits[2+1], m_huff_val[2+1]);
+
+        m_huff_initialized = true;
+        m_huff_optimized = false;
+    }
+
+    struct sym_freq {
+        uint m_key, m_sym_index;
+    };
+
+    // Radix sorts sym_freq[] array by 16-bit key m_key. Returns ptr to sorted values.
+    static inline sym_freq* radix_sort_syms(uint num_syms, sym_freq* pSyms0, sym_freq* pSyms1)
+    {
+        const uint cMaxPasses = 2;
+        uint32 hist[256 * cMaxPasses];
+        memset(hist, 0, sizeof(hist));
+        for (uint i = 0; i < num_syms; i++) {
+            uint freq = pSyms0[i].m_key;
+            hist[freq & 0xFF]++;
+            hist[256 + ((freq >> 8) & 0xFF)]++;
+        }
+        sym_freq* pCur_syms = pSyms0, *pNew_syms = pSyms1;
+        uint total_passes = cMaxPasses;
+        while ((total_passes > 1) && (num_syms == hist[(total_passes - 1) * 256])) {
+            total_passes--;
+        }
+        for (uint pass_shift = 0, pass = 0; pass < total_passes; pass++, pass_shift += 8) {
+            const uint32* pHist = &hist[pass << 8];
+            uint offsets[256], cur_ofs = 0;
+            for (uint i = 0; i < 256; i++) {
+                offsets[i] = cur_ofs;
+                cur_ofs += pHist[i];
+            }
+            for (uint i = 0; i < num_syms; i++) {
+                pNew_syms[offsets[(pCur_syms[i].m_key >> pass_shift) & 0xFF]++] = pCur_syms[i];
+            }
+            sym_freq* t = pCur_syms; pCur_syms = pNew_syms; pNew_syms = t;
+        }
+        return pCur_syms;
+    }
+
+    // calculate_minimum_redundancy() originally written by: Alistair Moffat, alistair@cs.mu.oz.au, Jyrki Katajainen, jyrki@diku.dk, November 1996.
+    static void calculate_minimum_redundancy(sym_freq *A, int n)
+    {
+        int root, leaf, next, avbl, used, dpth;
+        if (n == 0) {
+            return;
+        } else if (n == 1) {
+            A[0].m_key = 1;
+            return;
+        }
+        A[0].m_key += A[1].m_key; root = 0; leaf = 2;
+        for (next = 1; next < n - 1; next++) {
+            if (leaf >= n || A[root].m_key < A[leaf].m_key) { A[next].m_key = A[root].m_key; A[root++].m_key = next; } else A[next].m_key = A[leaf++].m_key;
+            if (leaf >= n || (root < next && A[root].m_key < A[leaf].m_key)) { A[next].m_key += A[root].m_key; A[root++].m_key = next; } else A[next].m_key += A[leaf++].m_key;
+        }
+        A[n - 2].m_key = 0;
+        for (next = n - 3; next >= 0; next--) {
+            A[next].m_key = A[A[next].m_key].m_key + 1;
+        }
+        avbl = 1; used = dpth = 0; root = n - 2; next = n - 1;
+        while (avbl > 0) {
+            while (root >= 0 && (int)A[root].m_key == dpth) { used++; root--; }
+            while (avbl > used) { A[next--].m_key = dpth; avbl--; }
+            avbl = 2 * used; dpth++; used = 0;
+        }
+    }
+
+    // Limits canonical Huffman code table's max code size to max_code_size.
+    static void huffman_enforce_max_code_size(int *pNum_codes, int code_list_len, int max_code_size)
+    {
+        if (code_list_len <= 1) {
+            return;
+        }
+        for (int i = max_code_size + 1; i <= MAX_HUFF_CODESIZE; i++) {
+            pNum_codes[max_code_size] += pNum_codes[i];
+        }
+        uint32 total = 0;
+        for (int i = max_code_size; i > 0; i--) {
+            total += (((uint32)pNum_codes[i]) << (max_code_size - i));
+        }
+        while (total != (1UL << max_code_size)) {
+            pNum_codes[max_code_size]--;
+            for (int i = max_code_size - 1; i > 0; i--) {
+                if (pNum_codes[i]) {
+                    pNum_codes[i]--;
+                    pNum_codes[i + 1] += 2;
+                    break;
+                }
+            }
+            total--;
+        }
+    }
+
+    // Every symbol the encoder can produce keeps a code, so frames unlike the learned ones stay encodable.
+    static void floor_huffman_counts()
+    {
+        for (int t = 0; t < 2; t++) {
+            uint32 *dc = m_huff_count[0 + t], *ac = m_huff_count[2 + t];
+            for (int i = 0; i < DC_LUM_CODES; i++) {
+                dc[i] = JPGE_MAX(dc[i], 1U);
+            }
+            ac[0x00] = JPGE_MAX(ac[0x00], 1U);
+            ac[0xF0] = JPGE_MAX(ac[0xF0], 1U);
+            for (int run = 0; run < 16; run++) {
+                for (int size = 1; size <= 10; size++) {
+                    ac[(run << 4) + size] = JPGE_MAX(ac[(run << 4) + size], 1U);
+                }
+            }
+        }
+    }
+
     void jpeg_encoder::flush_output_buffer()
     {
         if (m_out_buf_left != JPGE_OUT_BUF_SIZE) {
@@ -291,6 +421,93 @@ namespace jpge {
             emit_byte(val[i]);
     }
 
+    // Generates an optimized Huffman table from the learned symbol counts.
+    void jpeg_encoder::optimize_huffman_table(int table_num, int table_len)
+    {
+        sym_freq syms0[MAX_HUFF_SYMBOLS], syms1[MAX_HUFF_SYMBOLS];
+        syms0[0].m_key = 1; syms0[0].m_sym_index = 0;  // dummy symbol, assures that no valid code contains all 1's
+        int num_used_syms = 1;
+        const uint32 *pSym_count = &m_huff_count[table_num][0];
+
+        // counts of several frames can exceed the 16-bit keys of the radix sort
+        uint32 max_count = 0;
+        for (int i = 0; i < table_len; i++) {
+            max_count = JPGE_MAX(max_count, pSym_count[i]);
+        }
+        int shift = 0;
+        while ((max_count >> shift) > 0xFFFF) {
+            shift++;
+        }
+
+        for (int i = 0; i < table_len; i++) {
+            if (pSym_count[i]) {
+                syms0[num_used_syms].m_key = JPGE_MAX(pSym_count[i] >> shift, 1U);
+                syms0[num_used_syms++].m_sym_index = i + 1;
+            }
+        }
+        sym_freq* pSyms = radix_sort_syms(num_used_syms, syms0, syms1);
+        calculate_minimum_redundancy(pSyms, num_used_syms);
+
+        // Count the # of symbols of each code size.
+        int num_codes[1 + MAX_HUFF_CODESIZE];
+        memset(num_codes, 0, sizeof(num_codes));
+        for (int i = 0; i < num_used_syms; i++) {
+            num_codes[pSyms[i].m_key]++;
+        }
+
+        const uint JPGE_CODE_SIZE_LIMIT = 16; // the maximum possible size of a JPEG Huffman code (valid range is [9,16] - 9 vs. 8 because of the dummy symbol)
+        huffman_enforce_max_code_size(num_codes, num_used_syms, JPGE_CODE_SIZE_LIMIT);
+
+        // Compute m_huff_bits array, which contains the # of symbols per code size.
+        memset(m_huff_bits[table_num], 0, sizeof(m_huff_bits[table_num]));
+        for (int i = 1; i <= (int)JPGE_CODE_SIZE_LIMIT; i++) {
+            m_huff_bits[table_num][i] = static_cast<uint8>(num_codes[i]);
+        }
+
+        // Remove the dummy symbol added above, which must be in largest bucket.
+        for (int i = JPGE_CODE_SIZE_LIMIT; i >= 1; i--) {
+            if (m_huff_bits[table_num][i]) {
+                m_huff_bits[table_num][i]--;
+                break;
+            }
+        }
+
+        // Compute the m_huff_val array, which contains the symbol indices sorted by code size (smallest to largest).
+        for (int i = num_used_syms - 1; i >= 1; i--) {
+            m_huff_val[table_num][num_used_syms - 1 - i] = static_cast<uint8>(pSyms[i].m_sym_index - 1);
+        }
+
+        compute_huffman_table(&m_huff_codes[table_num][0], &m_huff_code_sizes[table_num][0], m_huff_bits[table_num], m_huff_val[table_num]);
+    }
+
+    // Selects the tables for the next frame and whether its symbols are counted.
+    void jpeg_encoder::update_huffman_tables()
+    {
+        m_huff_collect = false;
+        if (!m_huff_initialized || (!m_params.m_huff_learn_frames && m_huff_optimized)) {
+            load_standard_huffman_tables();
+        }
+        if (!m_params.m_huff_learn_frames) {
+            return;
+        }
+
+        bool refresh = m_params.m_huff_refresh_frames && (m_huff_used >= m_params.m_huff_refresh_frames);
+        if (m_huff_optimized && !m_huff_relearn && !refresh) {
+            return;
+        }
+        if (!m_huff_count) {
+            m_huff_count = static_cast<uint32 (*)[256]>(jpge_malloc(sizeof(uint32) * 4 * 256));
+            if (!m_huff_count) {
+                return;
+            }
+            m_huff_learned = 0;
+        }
+        if (!m_huff_learned) {
+            memset(m_huff_count, 0, sizeof(uint32) * 4 * 256);
+        }
+        m_huff_collect = true;
+    }
+
     // Emit all Huffman tables.
     void jpeg_encoder::emit_dhts()
     {
@@ -406,6 +623,49 @@ namespace jpge {
         }
     }
 
+    // Counts the symbols code_coefficients_pass_two() is about to emit.
+    void jpeg_encoder::code_coefficients_pass_one(int component_num)
+    {
+        int i, run_len, nbits, temp1;
+        int16 *pSrc = m_coefficient_array;
+        uint32 *dc_count = component_num ? m_huff_count[0 + 1] : m_huff_count[0 + 0];
+        uint32 *ac_count = component_num ? m_huff_count[2 + 1] : m_huff_count[2 + 0];
+
+        temp1 = pSrc[0] - m_last_dc_val[component_num];
+        if (temp1 < 0)
+            temp1 = -temp1;
+
+        nbits = 0;
+        while (temp1)
+        {
+            nbits++; temp1 >>= 1;
+        }
+
+        dc_count[nbits]++;
+        for (run_len = 0, i = 1; i < 64; i++)
+        {
+            if ((temp1 = m_coefficient_array[i]) == 0)
+                run_len++;
+            else
+            {
+                while (run_len >= 16)
+                {
+                    ac_count[0xF0]++;
+                    run_len -= 16;
+                }
+                if (temp1 < 0)
+                    temp1 = -temp1;
+                nbits = 1;
+                while (temp1 >>= 1)
+                    nbits++;
+                ac_count[(run_len << 4) + nbits]++;
+                run_len = 0;
+            }
+        }
+        if (run_len)
+            ac_count[0]++;
+    }
+
     void jpeg_encoder::code_coefficients_pass_two(int component_num)
     {
         int i, j, run_len, nbits, temp1, temp2;
@@ -474,6 +734,8 @@ namespace jpge {
     {
         DCT2D(m_sample_array);
         load_quantized_coefficients(component_num);
+        if (m_huff_collect)
+            code_coefficients_pass_one(component_num);
         code_coefficients_pass_two(component_num);
     }
 
@@ -622,21 +884,12 @@ namespace jpge {
             m_last_quality = m_params.m_quality;
             compute_quant_table(m_quantization_tables[0], s_std_lum_quant);
             compute_quant_table(m_quantization_tables[1], s_std_croma_quant);
+            // coefficient statistics depend on the quantizer, start learning over
+            m_huff_relearn = true;
+            m_huff_learned = 0;
         }
 
-        if(!m_huff_initialized){
-            m_huff_initialized = true;
-
-            memcpy(m_huff_bits[0+0], s_dc_lum_bits, 17);    memcpy(m_huff_val[0+0], s_dc_lum_val, DC_LUM_CODES);
-            memcpy(m_huff_bits[2+0], s_ac_lum_bits, 17);    memcpy(m_huff_val[2+0], s_ac_lum_val, AC_LUM_CODES);
-            memcpy(m_huff_bits[0+1], s_dc_chroma_bits, 17); memcpy(m_huff_val[0+1], s_dc_chroma_val, DC_CHROMA_CODES);
-            memcpy(m_huff_bits[2+1], s_ac_chroma_bits, 17); memcpy(m_huff_val[2+1], s_ac_chroma_val, AC_CHROMA_CODES);
-
-            compute_huffman_table(&m_huff_codes[0+0][0], &m_huff_code_sizes[0+0][0], m_huff_bits[0+0], m_huff_val[0+0]);
-            compute_huffman_table(&m_huff_codes[2+0][0], &m_huff_code_sizes[2+0][0], m_huff_bits[2+0], m_huff_val[2+0]);
-            compute_huffman_table(&m_huff_codes[0+1][0], &m_huff_code_sizes[0+1][0], m_huff_bits[0+1], m_huff_val[0+1]);
-            compute_huffman_table(&m_huff_codes[2+1][0], &m_huff_code_sizes[2+1][0], m_huff_bits[2+1], m_huff_val[2+1]);
-        }
+        update_huffman_tables();
 
         m_out_buf_left = JPGE_OUT_BUF_SIZE;
         m_pOut_buf = m_out_buf;
@@ -672,6 +925,21 @@ namespace jpge {
         emit_marker(M_EOI);
         flush_output_buffer();
         m_all_stream_writes_succeeded = m_all_stream_writes_succeeded && m_pStream->put_buf(NULL, 0);
+
+        // the tables of this frame are already emitted, new ones take effect with the next frame
+        if (m_huff_collect && (++m_huff_learned >= m_params.m_huff_learn_frames)) {
+            floor_huffman_counts();
+            optimize_huffman_table(0 + 0, DC_LUM_CODES);
+            optimize_huffman_table(2 + 0, AC_LUM_CODES);
+            optimize_huffman_table(0 + 1, DC_CHROMA_CODES);
+            optimize_huffman_table(2 + 1, AC_CHROMA_CODES);
+            m_huff_optimized = true;
+            m_huff_relearn = false;
+            m_huff_learned = 0;
+            m_huff_used = 0;
+        } else if (m_huff_optimized) {
+            m_huff_used++;
+        }
         m_pass_num++; // purposely bump up m_pass_num, for debugging
         return true;
     }
@@ -680,6 +948,7 @@ namespace jpge {
     {
         m_mcu_lines[0] = NULL;
         m_pass_num = 0;
+        m_huff_collect = false;
         m_all_stream_writes_succeeded = true;
     }
 
@@ -0,0 +1,91 @@
+// Copyright 2015-2016 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <string.h>
+#include "esp_attr.h"
+#include "line_convert.h"
+#include "yuv.h"
+
+size_t line_bytes_per_pixel(pixformat_t format)
+{
+    switch (format) {
+    case PIXFORMAT_GRAYSCALE:
+        return 1;
+    case PIXFORMAT_RGB565:
+    case PIXFORMAT_YUV422:
+        return 2;
+    case PIXFORMAT_RGB888:
+        return 3;
+    default:
+        return 0;
+    }
+}
+
+void IRAM_ATTR convert_line(const uint8_t *src, pixformat_t format, uint8_t *dst, size_t width, bool bgr)
+{
+    size_t i, o = 0, l;
+    //offsets of red and blue within an output pixel
+    const int ro = bgr ? 2 : 0, bo = 2 - ro;
+
+    if(format == PIXFORMAT_GRAYSCALE) {
+        memcpy(dst, src, width);
+    } else if(format == PIXFORMAT_RGB888) {
+        //source is B, G, R
+        l = width * 3;
+        if(bgr) {
+            memcpy(dst, src, l);
+            return;
+        }
+        for(i=0; i<l; i+=3) {
+            dst[i] = src[i+2];
+            dst[i+1] = src[i+1];
+            dst[i+2] = src[i];
+        }
+    } else if(format == PIXFORMAT_RGB565) {
+        l = width * 2;
+        for(i=0; i<l; i+=2, o+=3) {
+            dst[o+ro] = src[i] & 0xF8;
+            dst[o+1] = (src[i] & 0x07) << 5 | (src[i+1] & 0xE0) >> 3;
+            dst[o+bo] = (src[i+1] & 0x1F) << 3;
+        }
+    } else if(format == PIXFORMAT_YUV422) {
+        uint8_t y0, y1, u, v;
+        uint8_t r, g, b;
+        //whole Y0 U Y1 V pairs only, an odd last pixel is done on its own
+        l = (width & ~(size_t)1) * 2;
+        for(i=0; i<l; i+=4, o+=6) {
+            y0 = src[i];
+            u = src[i+1];
+            y1 = src[i+2];
+            v = src[i+3];
+
+            yuv2rgb(y0, u, v, &r, &g, &b);
+            dst[o+ro] = r;
+            dst[o+1] = g;
+            dst[o+bo] = b;
+
+            yuv2rgb(y1, u, v, &r, &g, &b);
+            dst[o+3+ro] = r;
+            dst[o+4] = g;
+            dst[o+3+bo] = b;
+        }
+        if(width & 1) {
+            //Y U with no V of its own in the row, borrow the previous pair's
+            v = width > 1 ? src[l-1] : 128;
+            yuv2rgb(src[l], src[l+1], v, &r, &g, &b);
+            dst[o+ro] = r;
+            dst[o+1] = g;
+            dst[o+bo] = b;
+        }
+    }
+}
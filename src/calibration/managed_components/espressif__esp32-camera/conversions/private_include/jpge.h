@@ -4,6 +4,8 @@
 #ifndef JPEG_ENCODER_H
 #define JPEG_ENCODER_H
 
+#include <stddef.h>
+
 namespace jpge
 {
     typedef unsigned char  uint8;
@@ -18,7 +20,7 @@ namespace jpge
 
     // JPEG compression parameters structure.
     struct params {
-            inline params() : m_quality(85), m_subsampling(H2V2) { }
+            inline params() : m_quality(85), m_subsampling(H2V2), m_huff_learn_frames(0), m_huff_refresh_frames(0) { }
 
             inline bool check() const {
                 if ((m_quality < 1) || (m_quality > 100)) {
@@ -27,6 +29,9 @@ namespace jpge
                 if ((uint)m_subsampling > (uint)H2V2) {
                     return false;
                 }
+                if ((m_huff_learn_frames < 0) || (m_huff_refresh_frames < 0)) {
+                    return false;
+                }
                 return true;
             }
 
@@ -39,6 +44,15 @@ namespace jpge
             // 2 = H2V1 subsampling (YCbCr 2x1x1, 4 blocks per MCU)
             // 3 = H2V2 subsampling (YCbCr 4x1x1, 6 blocks per MCU-- very common)
             subsampling_t m_subsampling;
+
+            // Huffman table learning, 0 = always use the standard tables.
+            // Symbol statistics of this many frames are gathered while encoding them, then optimized
+            // tables are built and used single pass for all following frames.
+            int m_huff_learn_frames;
+
+            // Gather statistics again and rebuild the tables after this many frames were
+            // encoded with them, 0 = keep the optimized tables until the quality changes.
+            int m_huff_refresh_frames;
     };
     
     // Output stream abstract class - used by the jpeg_encoder class to write to the output stream.
@@ -47,7 +61,7 @@ namespace jpge
         public:
             virtual ~output_stream() { };
             virtual bool put_buf(const void* Pbuf, int len) = 0;
-            virtual uint get_size() const = 0;
+            virtual size_t get_size() const = 0;
     };
     
     // Lower level jpeg_encoder class - useful if more control is needed than the above helper functions.
@@ -101,6 +115,7 @@ namespace jpge
             uint32 m_bit_buffer;
             uint m_bits_in;
             uint8 m_pass_num;
+            bool m_huff_collect;
             bool m_all_stream_writes_succeeded;
 
             bool jpg_open(int p_x_res, int p_y_res, int src_channels);
@@ -119,6 +134,9 @@ namespace jpge
             void emit_dhts();
             void emit_sos();
 
+            void update_huffman_tables();
+            void optimize_huffman_table(int table_num, int table_len);
+
             void compute_quant_table(int32 *dst, const int16 *src);
             void load_quantized_coefficients(int component_num);
 
@@ -127,6 +145,7 @@ namespace jpge
             void load_block_16_8(int x, int c);
             void load_block_16_8_8(int x, int c);
 
+            void code_coefficients_pass_one(int component_num);
             void code_coefficients_pass_two(int component_num);
             void code_block(int component_num);
 
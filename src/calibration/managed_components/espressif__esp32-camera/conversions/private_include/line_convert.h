@@ -0,0 +1,50 @@
+// Copyright 2015-2016 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef _CONVERSIONS_LINE_CONVERT_H_
+#define _CONVERSIONS_LINE_CONVERT_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "sensor.h"
+
+/**
+ * @brief Bytes per pixel of an uncompressed frame buffer format, 0 for JPEG and unknown formats
+ */
+size_t line_bytes_per_pixel(pixformat_t format);
+
+/**
+ * @brief Convert one line of RGB565, RGB888, YUV422 or GRAYSCALE pixels
+ *
+ * Color formats produce 3 bytes per pixel, in R, G, B order for the JPEG encoder or
+ * in B, G, R order (the byte order of PIXFORMAT_RGB888 and BMP) when bgr is set.
+ * GRAYSCALE is copied as is, 1 byte per pixel.
+ *
+ * @param src       First pixel of the line
+ * @param format    Format of the source line
+ * @param dst       Output, width * 3 bytes (width for GRAYSCALE)
+ * @param width     Pixels in the line
+ * @param bgr       Output B, G, R instead of R, G, B
+ */
+void convert_line(const uint8_t *src, pixformat_t format, uint8_t *dst, size_t width, bool bgr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CONVERSIONS_LINE_CONVERT_H_ */
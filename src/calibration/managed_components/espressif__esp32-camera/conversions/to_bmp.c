@@ -17,6 +17,7 @@
 #include "soc/efuse_reg.h"
 #include "esp_heap_caps.h"
 #include "yuv.h"
+#include "line_convert.h"
 #include "sdkconfig.h"
 #include "esp_jpg_decode.h"
 
@@ -57,6 +58,21 @@ typedef struct {
         uint8_t *output;
 } rgb_jpg_decoder;
 
+typedef struct {
+        rgb_jpg_decoder jpeg;   //first, _jpg_read takes the same arg
+        size_t row_len;
+        uint8_t *band;
+        jpg_out_cb cb;
+        void * arg;
+        size_t index;
+        bool ok;
+} bmp_jpg_stream_t;
+
+typedef struct {
+        uint8_t *buf;
+        size_t size;
+} bmp_buffer_t;
+
 static void *_malloc(size_t size)
 {
     // check if SPIRAM is enabled and allocate on SPIRAM if allocatable
@@ -159,8 +175,29 @@ static bool _rgb565_write(void * arg, uint16_t x, uint16_t y, uint16_t w, uint16
     return true;
 }
 
+static bool _gray_write(void * arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t *data)
+{
+    rgb_jpg_decoder * jpeg = (rgb_jpg_decoder *)arg;
+    if(!data){
+        if(x == 0 && y == 0){
+            //write start
+            jpeg->width = w;
+            jpeg->height = h;
+        }
+        return true;
+    }
+
+    uint8_t *o = jpeg->output + (size_t)y * jpeg->width + x;
+    for(size_t iy=0; iy<h; iy++) {
+        memcpy(o, data, w);
+        o += jpeg->width;
+        data += w;
+    }
+    return true;
+}
+
 //input buffer
-static unsigned int _jpg_read(void * arg, size_t index, uint8_t *buf, size_t len)
+static size_t _jpg_read(void * arg, size_t index, uint8_t *buf, size_t len)
 {
     rgb_jpg_decoder * jpeg = (rgb_jpg_decoder *)arg;
     if(buf) {
@@ -199,43 +236,18 @@ bool jpg2rgb565(const uint8_t *src, size_t src_len, uint8_t * out, jpg_scale_t s
     return true;
 }
 
-bool jpg2bmp(const uint8_t *src, size_t src_len, uint8_t ** out, size_t * out_len)
+bool jpg2gray(const uint8_t *src, size_t src_len, uint8_t * out, jpg_scale_t scale)
 {
-
     rgb_jpg_decoder jpeg;
     jpeg.width = 0;
     jpeg.height = 0;
     jpeg.input = src;
-    jpeg.output = NULL;
-    jpeg.data_offset = BMP_HEADER_LEN;
+    jpeg.output = out;
+    jpeg.data_offset = 0;
 
-    if(esp_jpg_decode(src_len, JPG_SCALE_NONE, _jpg_read, _rgb_write, (void*)&jpeg) != ESP_OK){
+    if(esp_jpg_decode_luma(src_len, scale, _jpg_read, _gray_write, (void*)&jpeg) != ESP_OK){
         return false;
     }
-
-    size_t output_size = jpeg.width*jpeg.height*3;
-
-    jpeg.output[0] = 'B';
-    jpeg.output[1] = 'M';
-    bmp_header_t * bitmap  = (bmp_header_t*)&jpeg.output[2];
-    bitmap->reserved = 0;
-    bitmap->filesize = output_size+BMP_HEADER_LEN;
-    bitmap->fileoffset_to_pixelarray = BMP_HEADER_LEN;
-    bitmap->dibheadersize = 40;
-    bitmap->width = jpeg.width;
-    bitmap->height = -jpeg.height;//set negative for top to bottom
-    bitmap->planes = 1;
-    bitmap->bitsperpixel = 24;
-    bitmap->compression = 0;
-    bitmap->imagesize = output_size;
-    bitmap->ypixelpermeter = 0x0B13 ; //2835 , 72 DPI
-    bitmap->xpixelpermeter = 0x0B13 ; //2835 , 72 DPI
-    bitmap->numcolorspallette = 0;
-    bitmap->mostimpcolor = 0;
-
-    *out = jpeg.output;
-    *out_len = output_size+BMP_HEADER_LEN;
-
     return true;
 }
 
@@ -292,102 +304,227 @@ bool fmt2rgb888(const uint8_t *src_buf, size_t src_len, pixformat_t format, uint
     return true;
 }
 
-bool fmt2bmp(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t ** out, size_t * out_len)
+//BMP rows are padded to a multiple of 4 bytes
+static size_t _bmp_row_len(uint16_t width, int bpp)
 {
-    if(format == PIXFORMAT_JPEG) {
-        return jpg2bmp(src, src_len, out, out_len);
-    }
-
-    *out = NULL;
-    *out_len = 0;
+    return ((size_t)width * bpp + 3) & ~(size_t)3;
+}
 
-    int pix_count = width*height;
+static bool _bmp_put(jpg_out_cb cb, void * arg, size_t *index, const void *data, size_t len)
+{
+    size_t written = cb(arg, *index, data, len);
+    *index += written;
+    return written == len;
+}
 
+//file and info headers, followed by the palette for 8-bit gray
+static bool _bmp_start(jpg_out_cb cb, void * arg, size_t *index, uint16_t width, uint16_t height, int bpp)
+{
     // With BMP, 8-bit greyscale requires a palette.
     // For a 640x480 image though, that's a savings
     // over going RGB-24.
-    int bpp = (format == PIXFORMAT_GRAYSCALE) ? 1 : 3;
-    int palette_size = (format == PIXFORMAT_GRAYSCALE) ? 4 * 256 : 0;
-    size_t out_size = (pix_count * bpp) + BMP_HEADER_LEN + palette_size;
-    uint8_t * out_buf = (uint8_t *)_malloc(out_size);
-    if(!out_buf) {
-        ESP_LOGE(TAG, "_malloc failed! %u", out_size);
+    int palette_size = (bpp == 1) ? 4 * 256 : 0;
+    size_t image_size = _bmp_row_len(width, bpp) * height;
+    uint8_t header[BMP_HEADER_LEN];
+    bmp_header_t bitmap;
+
+    header[0] = 'B';
+    header[1] = 'M';
+    bitmap.reserved = 0;
+    bitmap.filesize = image_size + BMP_HEADER_LEN + palette_size;
+    bitmap.fileoffset_to_pixelarray = BMP_HEADER_LEN + palette_size;
+    bitmap.dibheadersize = 40;
+    bitmap.width = width;
+    bitmap.height = -height;//set negative for top to bottom
+    bitmap.planes = 1;
+    bitmap.bitsperpixel = bpp * 8;
+    bitmap.compression = 0;
+    bitmap.imagesize = image_size;
+    bitmap.ypixelpermeter = 0x0B13 ; //2835 , 72 DPI
+    bitmap.xpixelpermeter = 0x0B13 ; //2835 , 72 DPI
+    bitmap.numcolorspallette = 0;
+    bitmap.mostimpcolor = 0;
+    memcpy(header + 2, &bitmap, sizeof(bitmap));
+
+    if(!_bmp_put(cb, arg, index, header, BMP_HEADER_LEN)) {
         return false;
     }
 
-    out_buf[0] = 'B';
-    out_buf[1] = 'M';
-    bmp_header_t * bitmap  = (bmp_header_t*)&out_buf[2];
-    bitmap->reserved = 0;
-    bitmap->filesize = out_size;
-    bitmap->fileoffset_to_pixelarray = BMP_HEADER_LEN + palette_size;
-    bitmap->dibheadersize = 40;
-    bitmap->width = width;
-    bitmap->height = -height;//set negative for top to bottom
-    bitmap->planes = 1;
-    bitmap->bitsperpixel = bpp * 8;
-    bitmap->compression = 0;
-    bitmap->imagesize = pix_count * bpp;
-    bitmap->ypixelpermeter = 0x0B13 ; //2835 , 72 DPI
-    bitmap->xpixelpermeter = 0x0B13 ; //2835 , 72 DPI
-    bitmap->numcolorspallette = 0;
-    bitmap->mostimpcolor = 0;
-
-    uint8_t * palette_buf = out_buf + BMP_HEADER_LEN;
-    uint8_t * pix_buf = palette_buf + palette_size;
-    uint8_t * src_buf = src;
-
     if (palette_size > 0) {
-        // Grayscale palette
-        for (int i = 0; i < 256; ++i) {
-            for (int j = 0; j < 3; ++j) {
-                *palette_buf = i;
-                palette_buf++;
+        // Grayscale palette, 16 entries at a time
+        uint8_t palette[16 * 4];
+        for (int i = 0; i < 256; i += 16) {
+            for (int j = 0; j < 16; j++) {
+                palette[j * 4 + 0] = i + j;
+                palette[j * 4 + 1] = i + j;
+                palette[j * 4 + 2] = i + j;
+                // Reserved / alpha channel.
+                palette[j * 4 + 3] = 0;
+            }
+            if(!_bmp_put(cb, arg, index, palette, sizeof(palette))) {
+                return false;
             }
-            // Reserved / alpha channel.
-            *palette_buf = 0;
-            palette_buf++;
         }
     }
+    return true;
+}
 
-    //convert data to RGB888
-    if(format == PIXFORMAT_RGB888) {
-        memcpy(pix_buf, src_buf, pix_count*3);
-    } else if(format == PIXFORMAT_RGB565) {
-        int i;
-        uint8_t hb, lb;
-        for(i=0; i<pix_count; i++) {
-            hb = *src_buf++;
-            lb = *src_buf++;
-            *pix_buf++ = (lb & 0x1F) << 3;
-            *pix_buf++ = (hb & 0x07) << 5 | (lb & 0xE0) >> 3;
-            *pix_buf++ = hb & 0xF8;
+//the header is written first and carries the file size, the buffer is allocated from it
+static size_t _bmp_buffer_write(void * arg, size_t index, const void* data, size_t len)
+{
+    bmp_buffer_t * bmp = (bmp_buffer_t *)arg;
+    if(!bmp->buf) {
+        uint32_t filesize;
+        if(index || len < 6) {
+            return 0;
         }
-    } else if(format == PIXFORMAT_GRAYSCALE) {
-        memcpy(pix_buf, src_buf, pix_count);
-    } else if(format == PIXFORMAT_YUV422) {
-        int i, maxi = pix_count / 2;
-        uint8_t y0, y1, u, v;
-        uint8_t r, g, b;
-        for(i=0; i<maxi; i++) {
-            y0 = *src_buf++;
-            u = *src_buf++;
-            y1 = *src_buf++;
-            v = *src_buf++;
+        memcpy(&filesize, (const uint8_t *)data + 2, sizeof(filesize));
+        bmp->buf = (uint8_t *)_malloc(filesize);
+        if(!bmp->buf) {
+            ESP_LOGE(TAG, "_malloc failed! %u", filesize);
+            return 0;
+        }
+        bmp->size = filesize;
+    }
+    if(index + len > bmp->size) {
+        return 0;
+    }
+    memcpy(bmp->buf + index, data, len);
+    return len;
+}
 
-            yuv2rgb(y0, u, v, &r, &g, &b);
-            *pix_buf++ = b;
-            *pix_buf++ = g;
-            *pix_buf++ = r;
+//collects the rows of one MCU row, the decoder outputs R, G, B blocks left to right and top to bottom
+static bool _bmp_band_write(void * arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t *data)
+{
+    bmp_jpg_stream_t * bmp = (bmp_jpg_stream_t *)arg;
+    if(!data){
+        if(x == 0 && y == 0){
+            //write start
+            bmp->jpeg.width = w;
+            bmp->jpeg.height = h;
+            bmp->row_len = _bmp_row_len(w, 3);
+            //MCUs are at most 16 lines high
+            bmp->band = (uint8_t *)_malloc(bmp->row_len * 16);
+            if(!bmp->band){
+                ESP_LOGE(TAG, "_malloc failed! %u", bmp->row_len * 16);
+                bmp->ok = false;
+                return false;
+            }
+            //keeps the row padding zero
+            memset(bmp->band, 0, bmp->row_len * 16);
+            bmp->ok = _bmp_start(bmp->cb, bmp->arg, &bmp->index, w, h, 3);
+            return bmp->ok;
+        }
+        //write end
+        return true;
+    }
+    if(!bmp->ok) {
+        return false;
+    }
 
-            yuv2rgb(y1, u, v, &r, &g, &b);
-            *pix_buf++ = b;
-            *pix_buf++ = g;
-            *pix_buf++ = r;
+    uint8_t *band = bmp->band + (y & 15) * bmp->row_len;
+    uint8_t *o;
+    size_t iy, ix, l = w * 3;
+
+    for(iy=0; iy<h; iy++) {
+        o = band + iy * bmp->row_len + x * 3;
+        for(ix=0; ix<l; ix+= 3) {
+            o[ix] = data[ix+2];
+            o[ix+1] = data[ix+1];
+            o[ix+2] = data[ix];
         }
+        data+=l;
+    }
+
+    //rightmost MCU completes the rows
+    if(x + w == bmp->jpeg.width) {
+        for(iy=0; iy<h && bmp->ok; iy++) {
+            bmp->ok = _bmp_put(bmp->cb, bmp->arg, &bmp->index, band + iy * bmp->row_len, bmp->row_len);
+        }
+    }
+    return bmp->ok;
+}
+
+bool jpg2bmp_cb(const uint8_t *src, size_t src_len, jpg_out_cb cb, void * arg)
+{
+    bmp_jpg_stream_t bmp;
+    bmp.jpeg.width = 0;
+    bmp.jpeg.height = 0;
+    bmp.jpeg.input = src;
+    bmp.jpeg.output = NULL;
+    bmp.jpeg.data_offset = 0;
+    bmp.band = NULL;
+    bmp.cb = cb;
+    bmp.arg = arg;
+    bmp.index = 0;
+    bmp.ok = false;
+
+    bool ret = esp_jpg_decode(src_len, JPG_SCALE_NONE, _jpg_read, _bmp_band_write, (void*)&bmp) == ESP_OK && bmp.ok;
+    free(bmp.band);
+    return ret;
+}
+
+bool jpg2bmp(const uint8_t *src, size_t src_len, uint8_t ** out, size_t * out_len)
+{
+    bmp_buffer_t bmp = {NULL, 0};
+
+    if(!jpg2bmp_cb(src, src_len, _bmp_buffer_write, &bmp)) {
+        free(bmp.buf);
+        return false;
+    }
+    *out = bmp.buf;
+    *out_len = bmp.size;
+    return true;
+}
+
+bool fmt2bmp_cb(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, jpg_out_cb cb, void * arg)
+{
+    if(format == PIXFORMAT_JPEG) {
+        return jpg2bmp_cb(src, src_len, cb, arg);
+    }
+
+    size_t src_bpp = line_bytes_per_pixel(format);
+    if(!src_bpp || src_len < (size_t)width * height * src_bpp) {
+        ESP_LOGE(TAG, "Unsupported format %d or short buffer %u", format, src_len);
+        return false;
+    }
+
+    int bpp = (format == PIXFORMAT_GRAYSCALE) ? 1 : 3;
+    size_t row_len = _bmp_row_len(width, bpp);
+    uint8_t * row = (uint8_t *)_malloc(row_len);
+    if(!row) {
+        ESP_LOGE(TAG, "_malloc failed! %u", row_len);
+        return false;
+    }
+    memset(row, 0, row_len);
+
+    size_t index = 0;
+    bool ok = _bmp_start(cb, arg, &index, width, height, bpp);
+    for(uint16_t y = 0; ok && y < height; y++) {
+        convert_line(src + (size_t)y * width * src_bpp, format, row, width, true);
+        ok = _bmp_put(cb, arg, &index, row, row_len);
+    }
+    free(row);
+    return ok;
+}
+
+bool frame2bmp_cb(camera_fb_t * fb, jpg_out_cb cb, void * arg)
+{
+    return fmt2bmp_cb(fb->buf, fb->len, fb->width, fb->height, fb->format, cb, arg);
+}
+
+bool fmt2bmp(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t ** out, size_t * out_len)
+{
+    bmp_buffer_t bmp = {NULL, 0};
+
+    *out = NULL;
+    *out_len = 0;
+    if(!fmt2bmp_cb(src, src_len, width, height, format, _bmp_buffer_write, &bmp)) {
+        free(bmp.buf);
+        return false;
     }
-    *out = out_buf;
-    *out_len = out_size;
+    *out = bmp.buf;
+    *out_len = bmp.size;
     return true;
 }
 
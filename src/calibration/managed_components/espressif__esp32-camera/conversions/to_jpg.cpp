@@ -19,7 +19,10 @@
 #include "esp_camera.h"
 #include "img_converters.h"
 #include "jpge.h"
-#include "yuv.h"
+#include "line_convert.h"
+#include "lwip/sockets.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 
 #if defined(ARDUINO_ARCH_ESP32) && defined(CONFIG_ARDUHAL_ESP_LOG)
 #include "esp32-hal-log.h"
@@ -29,6 +32,9 @@
 static const char* TAG = "to_jpg";
 #endif
 
+static uint16_t huff_learn_frames = 0;
+static uint16_t huff_refresh_frames = 0;
+
 static void *_malloc(size_t size)
 {
     void * res = malloc(size);
@@ -45,47 +51,7 @@ static void *_malloc(size_t size)
 
 static IRAM_ATTR void convert_line_format(uint8_t * src, pixformat_t format, uint8_t * dst, size_t width, size_t in_channels, size_t line)
 {
-    int i=0, o=0, l=0;
-    if(format == PIXFORMAT_GRAYSCALE) {
-        memcpy(dst, src + line * width, width);
-    } else if(format == PIXFORMAT_RGB888) {
-        l = width * 3;
-        src += l * line;
-        for(i=0; i<l; i+=3) {
-            dst[o++] = src[i+2];
-            dst[o++] = src[i+1];
-            dst[o++] = src[i];
-        }
-    } else if(format == PIXFORMAT_RGB565) {
-        l = width * 2;
-        src += l * line;
-        for(i=0; i<l; i+=2) {
-            dst[o++] = src[i] & 0xF8;
-            dst[o++] = (src[i] & 0x07) << 5 | (src[i+1] & 0xE0) >> 3;
-            dst[o++] = (src[i+1] & 0x1F) << 3;
-        }
-    } else if(format == PIXFORMAT_YUV422) {
-        uint8_t y0, y1, u, v;
-        uint8_t r, g, b;
-        l = width * 2;
-        src += l * line;
-        for(i=0; i<l; i+=4) {
-            y0 = src[i];
-            u = src[i+1];
-            y1 = src[i+2];
-            v = src[i+3];
-
-            yuv2rgb(y0, u, v, &r, &g, &b);
-            dst[o++] = r;
-            dst[o++] = g;
-            dst[o++] = b;
-
-            yuv2rgb(y1, u, v, &r, &g, &b);
-            dst[o++] = r;
-            dst[o++] = g;
-            dst[o++] = b;
-        }
-    }
+    convert_line(src + line * width * line_bytes_per_pixel(format), format, dst, width, false);
 }
 
 bool convert_image(uint8_t *src, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, jpge::output_stream *dst_stream)
@@ -107,6 +73,8 @@ bool convert_image(uint8_t *src, uint16_t width, uint16_t height, pixformat_t fo
     jpge::params comp_params = jpge::params();
     comp_params.m_subsampling = subsampling;
     comp_params.m_quality = quality;
+    comp_params.m_huff_learn_frames = huff_learn_frames;
+    comp_params.m_huff_refresh_frames = huff_refresh_frames;
 
     jpge::jpeg_encoder dst_image;
 
@@ -139,6 +107,12 @@ bool convert_image(uint8_t *src, uint16_t width, uint16_t height, pixformat_t fo
     return true;
 }
 
+void jpg_set_huffman_learning(uint16_t learn_frames, uint16_t refresh_frames)
+{
+    huff_learn_frames = learn_frames;
+    huff_refresh_frames = refresh_frames;
+}
+
 class callback_stream : public jpge::output_stream {
 protected:
     jpg_out_cb ocb;
@@ -172,6 +146,128 @@ bool frame2jpg_cb(camera_fb_t * fb, uint8_t quality, jpg_out_cb cb, void * arg)
 
 
 
+class udp_stream : public jpge::output_stream {
+protected:
+    const jpg_udp_target_t *target;
+    uint8_t *dgram;
+    size_t payload_max, fill, index;
+    uint16_t seq;
+    bool ok;
+
+    bool send_dgram(uint8_t flags)
+    {
+        jpg_udp_header_t *hdr = (jpg_udp_header_t *)dgram;
+        hdr->frame_id = target->frame_id;
+        hdr->seq = seq++;
+        hdr->cam_id = target->cam_id;
+        hdr->flags = flags;
+
+        size_t len = sizeof(jpg_udp_header_t) + fill;
+        //lwip reports ENOMEM while its pbuf pool is drained; yield a tick
+        //between tries so the stack gets to transmit and free some
+        for (int retry = 0; retry < 16; retry++) {
+            if (retry) {
+                vTaskDelay(1);
+            }
+            int err = sendto(target->sock, dgram, len, 0, target->dest_addr, target->dest_len);
+            if (err == (int)len) {
+                fill = 0;
+                return true;
+            }
+            if (err >= 0 || errno != ENOMEM) {
+                break;
+            }
+        }
+        ESP_LOGE(TAG, "JPG datagram %u of frame %u failed: errno %d", hdr->seq, target->frame_id, errno);
+        return false;
+    }
+
+public:
+    udp_stream(const jpg_udp_target_t *t) : target(t), dgram(NULL), fill(0), index(0), seq(0), ok(false)
+    {
+        size_t mtu = t->mtu ? t->mtu : JPG_UDP_MTU_DEFAULT;
+        if (mtu > JPG_UDP_MTU_MAX) {
+            mtu = JPG_UDP_MTU_MAX;
+        }
+        if (mtu <= sizeof(jpg_udp_header_t)) {
+            ESP_LOGE(TAG, "JPG datagram size %u too small", mtu);
+            return;
+        }
+        payload_max = mtu - sizeof(jpg_udp_header_t);
+        dgram = (uint8_t *)_malloc(mtu);
+        ok = dgram != NULL;
+    }
+
+    virtual ~udp_stream()
+    {
+        free(dgram);
+    }
+
+    bool valid() const
+    {
+        return ok;
+    }
+
+    virtual bool put_buf(const void* pBuf, int len)
+    {
+        if (!ok) {
+            return false;
+        }
+        if (!pBuf) {
+            //end of image
+            ok = send_dgram(JPG_UDP_FLAG_LAST);
+            return ok;
+        }
+        const uint8_t *p = static_cast<const uint8_t *>(pBuf);
+        while (len > 0) {
+            //a full datagram is only sent once more data shows up, so the last one can carry the flag
+            if (fill == payload_max && !(ok = send_dgram(0))) {
+                return false;
+            }
+            size_t n = payload_max - fill;
+            if ((size_t)len < n) {
+                n = len;
+            }
+            memcpy(dgram + sizeof(jpg_udp_header_t) + fill, p, n);
+            fill += n;
+            index += n;
+            p += n;
+            len -= n;
+        }
+        return true;
+    }
+
+    virtual size_t get_size() const
+    {
+        return index;
+    }
+};
+
+bool fmt2jpg_udp(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, const jpg_udp_target_t *target)
+{
+    udp_stream dst_stream(target);
+    if (!dst_stream.valid()) {
+        return false;
+    }
+    return convert_image(src, width, height, format, quality, &dst_stream);
+}
+
+bool frame2jpg_udp(camera_fb_t * fb, uint8_t quality, const jpg_udp_target_t *target)
+{
+    return fmt2jpg_udp(fb->buf, fb->len, fb->width, fb->height, fb->format, quality, target);
+}
+
+bool jpg_udp_send(const uint8_t *jpg, size_t jpg_len, const jpg_udp_target_t *target)
+{
+    udp_stream dst_stream(target);
+    if (!dst_stream.valid()) {
+        return false;
+    }
+    return dst_stream.put_buf(jpg, jpg_len) && dst_stream.put_buf(NULL, 0);
+}
+
+
+
 class memory_stream : public jpge::output_stream {
 protected:
     uint8_t *out_buf;
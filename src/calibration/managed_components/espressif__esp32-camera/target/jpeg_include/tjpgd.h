@@ -13,6 +13,8 @@
 
 /*---------------------------------------------------------------------------*/
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -33,9 +35,9 @@ typedef unsigned short	WORD;
 typedef unsigned short	WCHAR;
 
 /* These types must be 32-bit integer */
-typedef long			LONG;
-typedef unsigned long	ULONG;
-typedef unsigned long	DWORD;
+typedef int32_t			LONG;
+typedef uint32_t		ULONG;
+typedef uint32_t		DWORD;
 
 
 /* Error code */
@@ -68,6 +70,7 @@ struct JDEC {
 	BYTE* inbuf;			/* Bit stream input buffer */
 	BYTE dmsk;				/* Current bit in the current read byte */
 	BYTE scale;				/* Output scaling ratio */
+	BYTE luma;				/* Output luminance only (1 BYTE/pix) */
 	BYTE msx, msy;			/* MCU size in unit of block (width, height) */
 	BYTE qtid[3];			/* Quantization table ID of each component */
 	SHORT dcv[3];			/* Previous DC element of each component */
@@ -91,6 +94,10 @@ struct JDEC {
 JRESULT jd_prepare (JDEC*, UINT(*)(JDEC*,BYTE*,UINT), void*, UINT, void*);
 JRESULT jd_decomp (JDEC*, UINT(*)(JDEC*,void*,JRECT*), BYTE);
 
+/* Luminance-only decompression, chroma is parsed but never de-quantized, transformed or converted */
+#define JD_HAS_LUMA		1
+JRESULT jd_decomp_luma (JDEC*, UINT(*)(JDEC*,void*,JRECT*), BYTE);
+
 
 #ifdef __cplusplus
 }
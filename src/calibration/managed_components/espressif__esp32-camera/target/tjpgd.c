@@ -483,7 +483,7 @@ JRESULT mcu_load (
 )
 {
 	LONG *tmp = (LONG*)jd->workbuf;	/* Block working buffer for de-quantize and IDCT */
-	UINT blk, nby, nbc, i, z, id, cmp;
+	UINT blk, nby, nbc, i, z, id, cmp, skip;
 	INT b, d, e;
 	BYTE *bp;
 	const BYTE *hb, *hd;
@@ -498,6 +498,7 @@ JRESULT mcu_load (
 	for (blk = 0; blk < nby + nbc; blk++) {
 		cmp = (blk < nby) ? 0 : blk - nby + 1;	/* Component number 0:Y, 1:Cb, 2:Cr */
 		id = cmp ? 1 : 0;						/* Huffman table ID of the component */
+		skip = jd->luma && cmp;					/* Chroma is only parsed to advance the stream in luma mode */
 
 		/* Extract a DC element from input stream */
 		hb = jd->huffbits[id][0];				/* Huffman table for the DC element */
@@ -515,10 +516,12 @@ JRESULT mcu_load (
 			jd->dcv[cmp] = (SHORT)d;			/* Save current DC value for next block */
 		}
 		dqf = jd->qttbl[jd->qtid[cmp]];			/* De-quantizer table ID for this component */
-		tmp[0] = d * dqf[0] >> 8;				/* De-quantize, apply scale factor of Arai algorithm and descale 8 bits */
+		if (!skip) {
+			tmp[0] = d * dqf[0] >> 8;			/* De-quantize, apply scale factor of Arai algorithm and descale 8 bits */
+			for (i = 1; i < 64; i++) tmp[i] = 0;/* Clear rest of elements */
+		}
 
 		/* Extract following 63 AC elements from input stream */
-		for (i = 1; i < 64; i++) tmp[i] = 0;	/* Clear rest of elements */
 		hb = jd->huffbits[id][1];				/* Huffman table for the AC elements */
 		hc = jd->huffcode[id][1];
 		hd = jd->huffdata[id][1];
@@ -537,12 +540,16 @@ JRESULT mcu_load (
 				if (d < 0) return 0 - d;		/* Err: input device */
 				b = 1 << (b - 1);				/* MSB position */
 				if (!(d & b)) d -= (b << 1) - 1;/* Restore negative value if needed */
-				z = ZIG(i);						/* Zigzag-order to raster-order converted index */
-				tmp[z] = d * dqf[z] >> 8;		/* De-quantize, apply scale factor of Arai algorithm and descale 8 bits */
+				if (!skip) {
+					z = ZIG(i);					/* Zigzag-order to raster-order converted index */
+					tmp[z] = d * dqf[z] >> 8;	/* De-quantize, apply scale factor of Arai algorithm and descale 8 bits */
+				}
 			}
 		} while (++i < 64);		/* Next AC element */
 
-		if (JD_USE_SCALE && jd->scale == 3)
+		if (skip)
+			;							/* Chroma block is not needed for luma output */
+		else if (JD_USE_SCALE && jd->scale == 3)
 			*bp = (*tmp / 256) + 128;	/* If scale ratio is 1/8, IDCT can be ommited and only DC element is used */
 		else
 			block_idct(tmp, bp);		/* Apply IDCT and store the block to the MCU buffer */
@@ -556,6 +563,99 @@ JRESULT mcu_load (
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Output an MCU: Copy the Y blocks and output them in 1 BYTE/pix form   */
+/*-----------------------------------------------------------------------*/
+
+static
+JRESULT mcu_output_luma (
+	JDEC* jd,	/* Pointer to the decompressor object */
+	UINT (*outfunc)(JDEC*, void*, JRECT*),	/* Luma output function */
+	UINT x,		/* MCU position in the image (left of the MCU) */
+	UINT y		/* MCU position in the image (top of the MCU) */
+)
+{
+	UINT ix, iy, mx, my, rx, ry;
+	BYTE *py, *op;
+	JRECT rect;
+
+
+	mx = jd->msx * 8; my = jd->msy * 8;					/* MCU size (pixel) */
+	rx = (x + mx <= jd->width) ? mx : jd->width - x;	/* Output rectangular size (it may be clipped at right/bottom end) */
+	ry = (y + my <= jd->height) ? my : jd->height - y;
+	if (JD_USE_SCALE) {
+		rx >>= jd->scale; ry >>= jd->scale;
+		if (!rx || !ry) return JDR_OK;					/* Skip this MCU if all pixel is to be rounded off */
+		x >>= jd->scale; y >>= jd->scale;
+	}
+	rect.left = x; rect.right = x + rx - 1;				/* Rectangular area in the frame buffer */
+	rect.top = y; rect.bottom = y + ry - 1;
+
+	op = (BYTE*)jd->workbuf;
+	if (!JD_USE_SCALE || jd->scale != 3) {	/* Not for 1/8 scaling */
+
+		/* Gather the Y blocks into a raster ordered MCU */
+		for (iy = 0; iy < my; iy++) {
+			py = jd->mcubuf + iy * 8;
+			if (iy >= 8) py += 64;			/* Jump to the lower blocks if double block height */
+			for (ix = 0; ix < mx; ix++) {
+				if (ix == 8) py += 64 - 8;	/* Jump to next block if double block width */
+				*op++ = *py++;
+			}
+		}
+
+		/* Descale the MCU rectangular if needed */
+		if (JD_USE_SCALE && jd->scale) {
+			UINT x, y, l, s, w;
+			BYTE *sp;
+
+			s = jd->scale * 2;	/* Number of shifts for averaging */
+			w = 1 << jd->scale;	/* Width of square */
+			op = (BYTE*)jd->workbuf;
+			for (iy = 0; iy < my; iy += w) {
+				for (ix = 0; ix < mx; ix += w) {
+					sp = (BYTE*)jd->workbuf + iy * mx + ix;
+					l = 0;
+					for (y = 0; y < w; y++, sp += mx) {	/* Accumulate Y value in the square */
+						for (x = 0; x < w; x++) l += sp[x];
+					}
+					*op++ = (BYTE)(l >> s);				/* Put the averaged Y value as a pixel */
+				}
+			}
+		}
+
+	} else {	/* For only 1/8 scaling (left-top pixel in each block are the DC value of the block) */
+
+		for (iy = 0; iy < my; iy += 8) {
+			py = jd->mcubuf;
+			if (iy == 8) py += 64 * 2;
+			for (ix = 0; ix < mx; ix += 8) {
+				*op++ = *py;
+				py += 64;
+			}
+		}
+	}
+
+	/* Squeeze up pixel table if a part of MCU is to be truncated */
+	mx >>= jd->scale;
+	if (rx < mx) {
+		BYTE *s, *d;
+		UINT x, y;
+
+		s = d = (BYTE*)jd->workbuf;
+		for (y = 0; y < ry; y++) {
+			for (x = 0; x < rx; x++) *d++ = *s++;	/* Copy effective pixels */
+			s += mx - rx;	/* Skip truncated pixels */
+		}
+	}
+
+	/* Output the luma rectangular */
+	return outfunc(jd, jd->workbuf, &rect) ? JDR_OK : JDR_INTR;
+}
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Output an MCU: Convert YCrCb to RGB and output it in RGB form         */
 /*-----------------------------------------------------------------------*/
@@ -929,10 +1029,12 @@ JRESULT jd_prepare (
 /* Start to decompress the JPEG picture                                  */
 /*-----------------------------------------------------------------------*/
 
-JRESULT jd_decomp (
+static
+JRESULT decomp (
 	JDEC* jd,								/* Initialized decompression object */
-	UINT (*outfunc)(JDEC*, void*, JRECT*),	/* RGB output function */
-	BYTE scale								/* Output de-scaling factor (0 to 3) */
+	UINT (*outfunc)(JDEC*, void*, JRECT*),	/* RGB or luma output function */
+	BYTE scale,								/* Output de-scaling factor (0 to 3) */
+	BYTE luma								/* 1: output luminance only */
 )
 {
 	UINT x, y, mx, my;
@@ -942,6 +1044,7 @@ JRESULT jd_decomp (
 
 	if (scale > (JD_USE_SCALE ? 3 : 0)) return JDR_PAR;
 	jd->scale = scale;
+	jd->luma = luma;
 
 	mx = jd->msx * 8; my = jd->msy * 8;			/* Size of the MCU (pixel) */
 
@@ -958,13 +1061,36 @@ JRESULT jd_decomp (
 			}
 			rc = mcu_load(jd);					/* Load an MCU (decompress huffman coded stream and apply IDCT) */
 			if (rc != JDR_OK) return rc;
-			rc = mcu_output(jd, outfunc, x, y);	/* Output the MCU (color space conversion, scaling and output) */
+			if (luma)
+				rc = mcu_output_luma(jd, outfunc, x, y);	/* Output the Y blocks of the MCU (scaling and output) */
+			else
+				rc = mcu_output(jd, outfunc, x, y);	/* Output the MCU (color space conversion, scaling and output) */
 			if (rc != JDR_OK) return rc;
 		}
 	}
 
 	return rc;
 }
+
+
+JRESULT jd_decomp (
+	JDEC* jd,								/* Initialized decompression object */
+	UINT (*outfunc)(JDEC*, void*, JRECT*),	/* RGB output function */
+	BYTE scale								/* Output de-scaling factor (0 to 3) */
+)
+{
+	return decomp(jd, outfunc, scale, 0);
+}
+
+
+JRESULT jd_decomp_luma (
+	JDEC* jd,								/* Initialized decompression object */
+	UINT (*outfunc)(JDEC*, void*, JRECT*),	/* Luma output function (1 BYTE/pix) */
+	BYTE scale								/* Output de-scaling factor (0 to 3) */
+)
+{
+	return decomp(jd, outfunc, scale, 1);
+}
 #endif//SUPPORT_JPEG
 
 
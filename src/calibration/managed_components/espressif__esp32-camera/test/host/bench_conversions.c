@@ -0,0 +1,280 @@
+// Micro-benchmarks of the conversions library, built and run on the host
+//
+// Throughput is reported in MB/s of uncompressed image data (source frame for
+// encoders, output frame for decoders) and in megapixels/s, which is the one to
+// compare across output formats. --save writes the results as a
+// baseline, --check fails when any case falls more than --tolerance percent
+// below the baseline, which is what gates encoder and decoder changes.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "img_converters.h"
+#include "host_common.h"
+
+#define BENCH_MAX_CASES     64
+#define BENCH_BATCHES       5
+
+typedef struct {
+    char name[64];
+    double ms;
+    double mbps;
+    double mpps;
+} bench_result_t;
+
+typedef struct {
+    pixformat_t format;
+    const uint8_t *src;
+    size_t len;
+    uint16_t width, height;
+    uint8_t quality;
+    uint8_t *out;
+} bench_arg_t;
+
+typedef bool (*bench_fn_t)(bench_arg_t *arg);
+
+static bench_result_t s_results[BENCH_MAX_CASES];
+static size_t s_result_count;
+static double s_min_time = 0.2;
+static unsigned s_iterations;
+static const char *s_filter;
+
+static size_t _discard(void *arg, size_t index, const void *data, size_t len)
+{
+    return len;
+}
+
+static bool bench_encode(bench_arg_t *a)
+{
+    return fmt2jpg_cb((uint8_t *)a->src, a->len, a->width, a->height, a->format, a->quality, _discard, NULL);
+}
+
+static bool bench_decode_rgb888(bench_arg_t *a)
+{
+    return fmt2rgb888(a->src, a->len, PIXFORMAT_JPEG, a->out);
+}
+
+static bool bench_decode_rgb565(bench_arg_t *a)
+{
+    return jpg2rgb565(a->src, a->len, a->out, JPG_SCALE_NONE);
+}
+
+static bool bench_decode_gray(bench_arg_t *a)
+{
+    return jpg2gray(a->src, a->len, a->out, JPG_SCALE_NONE);
+}
+
+//best of BENCH_BATCHES, each batch runs for s_min_time or s_iterations frames
+static void bench_run(const char *name, bench_fn_t fn, bench_arg_t *arg, size_t frame_bytes, size_t pixels)
+{
+    if (s_filter && !strstr(name, s_filter)) {
+        return;
+    }
+    if (s_result_count == BENCH_MAX_CASES || !fn(arg)) {
+        fprintf(stderr, "%s: failed\n", name);
+        exit(1);
+    }
+
+    double best = 0;
+    for (int b = 0; b < BENCH_BATCHES; b++) {
+        unsigned frames = 0;
+        double start = now_seconds(), elapsed;
+        do {
+            fn(arg);
+            frames++;
+            elapsed = now_seconds() - start;
+        } while (s_iterations ? frames < s_iterations : elapsed < s_min_time);
+        double ms = elapsed * 1000.0 / frames;
+        if (!best || ms < best) {
+            best = ms;
+        }
+    }
+
+    bench_result_t *r = &s_results[s_result_count++];
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->ms = best;
+    r->mbps = frame_bytes / (best * 1000.0);
+    r->mpps = pixels / (best * 1000.0);
+    printf("%-48s %9.3f ms %9.2f MB/s %8.2f Mpix/s\n", r->name, r->ms, r->mbps, r->mpps);
+}
+
+static void bench_synthetic(uint16_t w, uint16_t h)
+{
+    static const pixformat_t formats[] = {PIXFORMAT_RGB565, PIXFORMAT_RGB888, PIXFORMAT_YUV422, PIXFORMAT_GRAYSCALE};
+    static const uint8_t qualities[] = {10, 50, 90};
+    char name[64];
+
+    for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+        size_t len;
+        uint8_t *ref;
+        uint8_t *frame = synth_frame(formats[f], w, h, &len, &ref);
+        for (size_t q = 0; q < sizeof(qualities) / sizeof(qualities[0]); q++) {
+            bench_arg_t arg = {
+                .format = formats[f],
+                .src = frame,
+                .len = len,
+                .width = w,
+                .height = h,
+                .quality = qualities[q],
+            };
+            snprintf(name, sizeof(name), "encode/%s/q%u/synthetic-%ux%u", format_name(formats[f]), qualities[q], w, h);
+            bench_run(name, bench_encode, &arg, len, (size_t)w * h);
+        }
+        if (formats[f] == PIXFORMAT_RGB565) {
+            //frames whose symbols are counted, and frames coded with the tables learned from them
+            bench_arg_t arg = {
+                .format = formats[f],
+                .src = frame,
+                .len = len,
+                .width = w,
+                .height = h,
+                .quality = 50,
+            };
+            jpg_set_huffman_learning(UINT16_MAX, 0);
+            snprintf(name, sizeof(name), "encode/%s/q50/synthetic-%ux%u/learning", format_name(formats[f]), w, h);
+            bench_run(name, bench_encode, &arg, len, (size_t)w * h);
+            jpg_set_huffman_learning(1, 0);
+            bench_encode(&arg);
+            snprintf(name, sizeof(name), "encode/%s/q50/synthetic-%ux%u/learned", format_name(formats[f]), w, h);
+            bench_run(name, bench_encode, &arg, len, (size_t)w * h);
+            jpg_set_huffman_learning(0, 0);
+        }
+        free(frame);
+        free(ref);
+    }
+}
+
+static void bench_pictures(void)
+{
+    char name[64];
+
+    for (size_t p = 0; p < test_pictures_count; p++) {
+        const test_picture_t *pic = &test_pictures[p];
+        size_t n = (size_t)pic->width * pic->height;
+        size_t len;
+        uint8_t *src = load_picture(pic, &len);
+        if (!src) {
+            exit(1);
+        }
+        uint8_t *out = malloc(n * 3);
+        bench_arg_t arg = {
+            .src = src,
+            .len = len,
+            .width = pic->width,
+            .height = pic->height,
+            .out = out,
+        };
+
+        snprintf(name, sizeof(name), "decode/rgb888/%s", pic->name);
+        bench_run(name, bench_decode_rgb888, &arg, n * 3, n);
+        snprintf(name, sizeof(name), "decode/rgb565/%s", pic->name);
+        bench_run(name, bench_decode_rgb565, &arg, n * 2, n);
+        snprintf(name, sizeof(name), "decode/gray/%s", pic->name);
+        bench_run(name, bench_decode_gray, &arg, n, n);
+
+        //re-encode the decoded picture, real content compresses differently from the synthetic frames
+        uint8_t *rgb = malloc(n * 3);
+        fmt2rgb888(src, len, PIXFORMAT_JPEG, rgb);
+        bench_arg_t enc = {
+            .format = PIXFORMAT_RGB888,
+            .src = rgb,
+            .len = n * 3,
+            .width = pic->width,
+            .height = pic->height,
+            .quality = 80,
+        };
+        snprintf(name, sizeof(name), "encode/rgb888/q80/%s", pic->name);
+        bench_run(name, bench_encode, &enc, n * 3, n);
+
+        free(rgb);
+        free(out);
+        free(src);
+    }
+}
+
+static bool save_results(const char *path)
+{
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        return false;
+    }
+    for (size_t i = 0; i < s_result_count; i++) {
+        fprintf(f, "%s,%.3f\n", s_results[i].name, s_results[i].mbps);
+    }
+    fclose(f);
+    return true;
+}
+
+static int check_results(const char *path, double tolerance)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "cannot open baseline %s\n", path);
+        return 1;
+    }
+    char line[128];
+    int regressions = 0;
+    while (fgets(line, sizeof(line), f)) {
+        char *comma = strrchr(line, ',');
+        if (!comma) {
+            continue;
+        }
+        *comma = 0;
+        double base = atof(comma + 1);
+        for (size_t i = 0; i < s_result_count; i++) {
+            if (strcmp(s_results[i].name, line)) {
+                continue;
+            }
+            double change = (s_results[i].mbps / base - 1.0) * 100.0;
+            if (change < -tolerance) {
+                printf("REGRESSION %-48s %9.2f MB/s, baseline %9.2f (%+.1f%%)\n", line, s_results[i].mbps, base, change);
+                regressions++;
+            }
+        }
+    }
+    fclose(f);
+    printf("%d regressions beyond %.1f%%\n", regressions, tolerance);
+    return regressions ? 1 : 0;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [--quick] [--iterations N] [--min-time S] [--filter TEXT]\n"
+                    "          [--save FILE] [--check FILE] [--tolerance PERCENT]\n", argv0);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *save = NULL, *check = NULL;
+    double tolerance = 10.0;
+
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if (!strcmp(argv[i], "--quick")) {
+            s_iterations = 1;
+        } else if (!strcmp(argv[i], "--iterations") && has_value) {
+            s_iterations = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--min-time") && has_value) {
+            s_min_time = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--filter") && has_value) {
+            s_filter = argv[++i];
+        } else if (!strcmp(argv[i], "--save") && has_value) {
+            save = argv[++i];
+        } else if (!strcmp(argv[i], "--check") && has_value) {
+            check = argv[++i];
+        } else if (!strcmp(argv[i], "--tolerance") && has_value) {
+            tolerance = atof(argv[++i]);
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    bench_synthetic(640, 480);
+    bench_pictures();
+
+    if (save && !save_results(save)) {
+        fprintf(stderr, "cannot write %s\n", save);
+        return 1;
+    }
+    return check ? check_results(check, tolerance) : 0;
+}
@@ -0,0 +1,160 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "host_common.h"
+#include "yuv.h"
+
+const test_picture_t test_pictures[] = {
+    {"testimg.jpeg", 227, 149},
+    {"test_inside.jpeg", 320, 240},
+    {"test_outside.jpeg", 480, 320},
+};
+const size_t test_pictures_count = sizeof(test_pictures) / sizeof(test_pictures[0]);
+
+uint8_t *load_picture(const test_picture_t *pic, size_t *len)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", TEST_PICTURES_DIR, pic->name);
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "cannot open %s\n", path);
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    *len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *buf = malloc(*len);
+    if (buf && fread(buf, 1, *len, f) != *len) {
+        free(buf);
+        buf = NULL;
+    }
+    fclose(f);
+    return buf;
+}
+
+static uint8_t clamp8(int v)
+{
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+static uint8_t luma(uint8_t r, uint8_t g, uint8_t b)
+{
+    return (77 * r + 150 * g + 29 * b) >> 8;
+}
+
+static void synth_pixel(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t *r, uint8_t *g, uint8_t *b)
+{
+    if (x < w / 2 && y < h / 2) {
+        uint8_t c = ((x / 8 + y / 8) & 1) ? 224 : 32;
+        *r = *g = *b = c;
+        return;
+    }
+    *r = x * 255 / w;
+    *g = y * 255 / h;
+    *b = (x + y) * 255 / (w + h);
+}
+
+size_t format_bpp(pixformat_t format)
+{
+    switch (format) {
+    case PIXFORMAT_GRAYSCALE:
+        return 1;
+    case PIXFORMAT_RGB565:
+    case PIXFORMAT_YUV422:
+        return 2;
+    case PIXFORMAT_RGB888:
+        return 3;
+    default:
+        return 0;
+    }
+}
+
+const char *format_name(pixformat_t format)
+{
+    switch (format) {
+    case PIXFORMAT_GRAYSCALE:
+        return "gray";
+    case PIXFORMAT_RGB565:
+        return "rgb565";
+    case PIXFORMAT_YUV422:
+        return "yuv422";
+    case PIXFORMAT_RGB888:
+        return "rgb888";
+    default:
+        return "?";
+    }
+}
+
+uint8_t *synth_frame(pixformat_t format, uint16_t width, uint16_t height, size_t *len, uint8_t **ref)
+{
+    size_t n = (size_t)width * height;
+    *len = n * format_bpp(format);
+    uint8_t *buf = malloc(*len);
+    *ref = malloc(format == PIXFORMAT_GRAYSCALE ? n : n * 3);
+    if (!buf || !*ref) {
+        free(buf);
+        free(*ref);
+        return NULL;
+    }
+
+    for (uint16_t y = 0; y < height; y++) {
+        for (uint16_t x = 0; x < width; x++) {
+            size_t i = (size_t)y * width + x;
+            uint8_t r, g, b;
+            synth_pixel(x, y, width, height, &r, &g, &b);
+
+            if (format == PIXFORMAT_GRAYSCALE) {
+                buf[i] = (*ref)[i] = luma(r, g, b);
+                continue;
+            }
+            if (format == PIXFORMAT_RGB565) {
+                //big-endian RGB565, as delivered by the sensors
+                buf[i * 2] = (r & 0xF8) | (g >> 5);
+                buf[i * 2 + 1] = ((g & 0x1C) << 3) | (b >> 3);
+                r &= 0xF8;
+                g &= 0xFC;
+                b &= 0xF8;
+            } else if (format == PIXFORMAT_RGB888) {
+                buf[i * 3] = b;
+                buf[i * 3 + 1] = g;
+                buf[i * 3 + 2] = r;
+            } else if (format == PIXFORMAT_YUV422) {
+                //Y0 U Y1 V, chroma of the left pixel is shared by the pair
+                uint8_t *p = buf + (i & ~(size_t)1) * 2;
+                uint8_t y0 = luma(r, g, b);
+                buf[i * 2] = y0;
+                if (!(i & 1)) {
+                    p[1] = clamp8(((-43 * r - 85 * g + 128 * b) >> 8) + 128);
+                    p[3] = clamp8(((128 * r - 107 * g - 21 * b) >> 8) + 128);
+                }
+                yuv2rgb(y0, p[1], p[3], &r, &g, &b);
+            }
+            (*ref)[i * 3] = b;
+            (*ref)[i * 3 + 1] = g;
+            (*ref)[i * 3 + 2] = r;
+        }
+    }
+    return buf;
+}
+
+double psnr(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    double se = 0;
+    for (size_t i = 0; i < len; i++) {
+        int d = a[i] - b[i];
+        se += d * d;
+    }
+    if (se == 0) {
+        return 99.0;
+    }
+    return 10.0 * log10(255.0 * 255.0 * len / se);
+}
+
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
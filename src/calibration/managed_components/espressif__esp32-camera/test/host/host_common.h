@@ -0,0 +1,53 @@
+// Helpers shared by the host conformance tests and benchmarks of the conversions library
+#ifndef _HOST_COMMON_H_
+#define _HOST_COMMON_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_camera.h"
+
+typedef struct {
+    const char *name;       /*!< File in test/pictures */
+    uint16_t width;
+    uint16_t height;
+} test_picture_t;
+
+extern const test_picture_t test_pictures[];
+extern const size_t test_pictures_count;
+
+/**
+ * @brief Read a bundled test picture, the returned buffer must be freed
+ */
+uint8_t *load_picture(const test_picture_t *pic, size_t *len);
+
+/**
+ * @brief Generate a synthetic frame in the given format
+ *
+ * The frame is a smooth gradient with a high contrast checkerboard in one quadrant,
+ * which covers both the flat areas and the edges the calibration code cares about.
+ *
+ * @param ref   Populated with what the frame holds after format quantization,
+ *              BGR888 (the byte order fmt2rgb888 produces) or 8-bit gray for GRAYSCALE
+ *
+ * @return frame buffer, both it and *ref must be freed
+ */
+uint8_t *synth_frame(pixformat_t format, uint16_t width, uint16_t height, size_t *len, uint8_t **ref);
+
+/**
+ * @brief Bytes per pixel of an uncompressed format
+ */
+size_t format_bpp(pixformat_t format);
+
+const char *format_name(pixformat_t format);
+
+/**
+ * @brief Peak signal to noise ratio in dB of two 8-bit buffers, 99 for identical buffers
+ */
+double psnr(const uint8_t *a, const uint8_t *b, size_t len);
+
+/**
+ * @brief Monotonic time in seconds
+ */
+double now_seconds(void);
+
+#endif /* _HOST_COMMON_H_ */
@@ -0,0 +1,5 @@
+#pragma once
+
+// Only the types referenced by camera_config_t
+typedef int ledc_timer_t;
+typedef int ledc_channel_t;
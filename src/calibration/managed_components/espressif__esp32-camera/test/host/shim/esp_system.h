@@ -0,0 +1,6 @@
+#pragma once
+
+#include "esp_err.h"
+
+// Selects the IDF 4+ include chain in esp_jpg_decode.c, which falls through to the software tjpgd
+#define ESP_IDF_VERSION_MAJOR 5
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <unistd.h>
+#include "freertos/FreeRTOS.h"
+
+static inline void vTaskDelay(TickType_t ticks)
+{
+    usleep((useconds_t)ticks * portTICK_PERIOD_MS * 1000);
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+// lwip exposes the BSD socket API, the host one is a drop-in replacement
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <unistd.h>
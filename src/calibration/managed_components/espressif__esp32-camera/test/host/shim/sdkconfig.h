@@ -0,0 +1,5 @@
+// Host build of the conversions library: no SPIRAM, no ROM JPEG decoder, no target selected.
+#pragma once
+
+// ESP-IDF's default tick rate, 10 ms a tick
+#define CONFIG_FREERTOS_HZ 100
@@ -0,0 +1,495 @@
+// Round-trip conformance tests of the conversions library, built and run on the host
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lwip/sockets.h"
+#include "img_converters.h"
+#include "host_common.h"
+#include "line_convert.h"
+#include "yuv.h"
+
+static int s_failures;
+
+#define CHECK(cond, ...) do { \
+        if (!(cond)) { \
+            s_failures++; \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+        } \
+    } while (0)
+
+static uint8_t luma(const uint8_t *bgr)
+{
+    return (77 * bgr[2] + 150 * bgr[1] + 29 * bgr[0]) >> 8;
+}
+
+static double decode_psnr(const uint8_t *jpg, size_t jpg_len, const uint8_t *ref, uint16_t w, uint16_t h)
+{
+    size_t n = (size_t)w * h;
+    uint8_t *out = malloc(n * 3);
+    double db = 0;
+    bool ok = fmt2rgb888(jpg, jpg_len, PIXFORMAT_JPEG, out);
+    CHECK(ok, "decode failed");
+    if (ok) {
+        db = psnr(ref, out, n * 3);
+    }
+    free(out);
+    return db;
+}
+
+//number of components in the baseline SOF segment, 0 if there is none
+static uint8_t sof_components(const uint8_t *jpg, size_t jpg_len, uint16_t *w, uint16_t *h)
+{
+    size_t i = 2;
+    while (i + 4 <= jpg_len && jpg[i] == 0xFF) {
+        uint16_t seg = (jpg[i + 2] << 8) | jpg[i + 3];
+        if (jpg[i + 1] == 0xC0 && i + 10 <= jpg_len) {
+            *h = (jpg[i + 5] << 8) | jpg[i + 6];
+            *w = (jpg[i + 7] << 8) | jpg[i + 8];
+            return jpg[i + 9];
+        }
+        i += 2 + seg;
+    }
+    return 0;
+}
+
+static void test_synthetic_roundtrip(void)
+{
+    static const pixformat_t formats[] = {PIXFORMAT_RGB565, PIXFORMAT_RGB888, PIXFORMAT_YUV422, PIXFORMAT_GRAYSCALE};
+    static const struct {
+        uint8_t quality;
+        double min_db;
+    } qualities[] = {{10, 27.0}, {50, 34.0}, {90, 37.0}};
+    //the second size does not fill the last MCU row or column
+    static const uint16_t sizes[][2] = {{320, 240}, {162, 122}};
+
+    for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            uint16_t w = sizes[s][0], h = sizes[s][1];
+            size_t len;
+            uint8_t *ref;
+            uint8_t *frame = synth_frame(formats[f], w, h, &len, &ref);
+            for (size_t q = 0; q < sizeof(qualities) / sizeof(qualities[0]); q++) {
+                uint8_t *jpg = NULL;
+                size_t jpg_len = 0;
+                bool ok = fmt2jpg(frame, len, w, h, formats[f], qualities[q].quality, &jpg, &jpg_len);
+                CHECK(ok, "%s %ux%u q%u encode failed", format_name(formats[f]), w, h, qualities[q].quality);
+                if (!ok) {
+                    continue;
+                }
+                if (formats[f] == PIXFORMAT_GRAYSCALE) {
+                    //tjpgd only decodes YCbCr, so single component output can only be checked structurally
+                    uint16_t jw = 0, jh = 0;
+                    uint8_t nc = sof_components(jpg, jpg_len, &jw, &jh);
+                    printf("synthetic %-6s %3ux%-3u q%-2u %6zu bytes (not decodable)\n", format_name(formats[f]), w, h, qualities[q].quality, jpg_len);
+                    CHECK(nc == 1 && jw == w && jh == h, "gray %ux%u SOF has %u components, %ux%u", w, h, nc, jw, jh);
+                    free(jpg);
+                    continue;
+                }
+                double db = decode_psnr(jpg, jpg_len, ref, w, h);
+                printf("synthetic %-6s %3ux%-3u q%-2u %6zu bytes %5.2f dB\n", format_name(formats[f]), w, h, qualities[q].quality, jpg_len, db);
+                CHECK(db >= qualities[q].min_db, "%s %ux%u q%u PSNR %.2f < %.2f", format_name(formats[f]), w, h, qualities[q].quality, db, qualities[q].min_db);
+                free(jpg);
+            }
+            free(frame);
+            free(ref);
+        }
+    }
+}
+
+static void test_picture_roundtrip(void)
+{
+    for (size_t p = 0; p < test_pictures_count; p++) {
+        const test_picture_t *pic = &test_pictures[p];
+        size_t n = (size_t)pic->width * pic->height;
+        size_t len;
+        uint8_t *src = load_picture(pic, &len);
+        CHECK(src, "%s missing", pic->name);
+        if (!src) {
+            continue;
+        }
+
+        uint8_t *rgb = malloc(n * 3);
+        uint8_t *again = malloc(n * 3);
+        CHECK(fmt2rgb888(src, len, PIXFORMAT_JPEG, rgb), "%s decode failed", pic->name);
+
+        uint8_t *jpg = NULL;
+        size_t jpg_len = 0;
+        CHECK(fmt2jpg(rgb, n * 3, pic->width, pic->height, PIXFORMAT_RGB888, 90, &jpg, &jpg_len), "%s encode failed", pic->name);
+        CHECK(fmt2rgb888(jpg, jpg_len, PIXFORMAT_JPEG, again), "%s re-decode failed", pic->name);
+        double db = psnr(rgb, again, n * 3);
+        printf("picture %-17s q90 %6zu bytes %5.2f dB\n", pic->name, jpg_len, db);
+        CHECK(db >= 40.0, "%s round-trip PSNR %.2f", pic->name, db);
+
+        free(jpg);
+        free(again);
+        free(rgb);
+        free(src);
+    }
+}
+
+static void test_picture_decoders_agree(void)
+{
+    for (size_t p = 0; p < test_pictures_count; p++) {
+        const test_picture_t *pic = &test_pictures[p];
+        size_t n = (size_t)pic->width * pic->height;
+        size_t len;
+        uint8_t *src = load_picture(pic, &len);
+        if (!src) {
+            continue;
+        }
+        uint8_t *rgb = malloc(n * 3);
+        uint16_t *rgb565 = malloc(n * 2);
+        uint8_t *gray = malloc(n);
+        uint8_t *scaled = malloc(n);
+
+        CHECK(fmt2rgb888(src, len, PIXFORMAT_JPEG, rgb), "%s rgb888 failed", pic->name);
+        CHECK(jpg2rgb565(src, len, (uint8_t *)rgb565, JPG_SCALE_NONE), "%s rgb565 failed", pic->name);
+        CHECK(jpg2gray(src, len, gray, JPG_SCALE_NONE), "%s gray failed", pic->name);
+
+        //RGB565 is the RGB888 output truncated
+        size_t mismatch = 0;
+        for (size_t i = 0; i < n; i++) {
+            const uint8_t *c = rgb + i * 3;
+            uint16_t v = ((c[2] & 0xF8) << 8) | ((c[1] & 0xFC) << 3) | (c[0] >> 3);
+            mismatch += rgb565[i] != v;
+        }
+        CHECK(mismatch == 0, "%s rgb565 differs from rgb888 in %zu pixels", pic->name, mismatch);
+
+        //luma path skips color conversion, so it only differs where RGB clipped
+        double mad = 0;
+        for (size_t i = 0; i < n; i++) {
+            mad += abs(luma(rgb + i * 3) - gray[i]);
+        }
+        mad /= n;
+        CHECK(mad < 1.0, "%s gray differs from rgb888 luma by %.3f on average", pic->name, mad);
+
+        //1/2 and 1/4 scaling average the full resolution luma, 1/8 takes the DC value of each block
+        for (jpg_scale_t scale = JPG_SCALE_2X; scale <= JPG_SCALE_MAX; scale++) {
+            uint16_t k = 1 << scale, sw = pic->width >> scale, sh = pic->height >> scale;
+            CHECK(jpg2gray(src, len, scaled, scale), "%s gray 1/%u failed", pic->name, k);
+            double err = 0;
+            for (uint16_t y = 0; y < sh; y++) {
+                for (uint16_t x = 0; x < sw; x++) {
+                    unsigned sum = 0;
+                    for (uint16_t yy = 0; yy < k; yy++) {
+                        for (uint16_t xx = 0; xx < k; xx++) {
+                            sum += gray[(y * k + yy) * pic->width + x * k + xx];
+                        }
+                    }
+                    err += abs((int)(sum / (k * k)) - scaled[y * sw + x]);
+                }
+            }
+            err /= (size_t)sw * sh;
+            CHECK(err < (scale == JPG_SCALE_8X ? 2.0 : 0.5), "%s gray 1/%u differs from box average by %.3f", pic->name, k, err);
+        }
+
+        free(scaled);
+        free(gray);
+        free(rgb565);
+        free(rgb);
+        free(src);
+    }
+}
+
+static void test_udp_stream(void)
+{
+    const uint16_t w = 320, h = 240;
+    size_t len;
+    uint8_t *ref;
+    uint8_t *frame = synth_frame(PIXFORMAT_RGB565, w, h, &len, &ref);
+    uint8_t *jpg = NULL;
+    size_t jpg_len = 0;
+    CHECK(fmt2jpg(frame, len, w, h, PIXFORMAT_RGB565, 80, &jpg, &jpg_len), "encode failed");
+
+    int rx = socket(AF_INET, SOCK_DGRAM, 0);
+    int tx = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t addr_len = sizeof(addr);
+    int rcvbuf = 1 << 20;
+    setsockopt(rx, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    CHECK(bind(rx, (struct sockaddr *)&addr, sizeof(addr)) == 0, "bind failed");
+    getsockname(rx, (struct sockaddr *)&addr, &addr_len);
+
+    jpg_udp_target_t target = {
+        .sock = tx,
+        .dest_addr = (struct sockaddr *)&addr,
+        .dest_len = sizeof(addr),
+        .mtu = 512,
+        .cam_id = 7,
+        .frame_id = 42,
+    };
+    CHECK(fmt2jpg_udp(frame, len, w, h, PIXFORMAT_RGB565, 80, &target), "udp encode failed");
+
+    //the whole frame is queued on the loopback socket by now
+    uint8_t *out = malloc(jpg_len);
+    uint8_t dgram[JPG_UDP_MTU_MAX];
+    size_t out_len = 0;
+    uint16_t expect_seq = 0;
+    bool last = false;
+    while (!last) {
+        ssize_t r = recv(rx, dgram, sizeof(dgram), MSG_DONTWAIT);
+        CHECK(r >= (ssize_t)sizeof(jpg_udp_header_t), "datagram %u missing", expect_seq);
+        if (r < (ssize_t)sizeof(jpg_udp_header_t)) {
+            break;
+        }
+        jpg_udp_header_t hdr;
+        memcpy(&hdr, dgram, sizeof(hdr));
+        size_t payload = r - sizeof(hdr);
+        CHECK(hdr.frame_id == 42 && hdr.cam_id == 7, "bad header");
+        CHECK(hdr.seq == expect_seq, "seq %u, expected %u", hdr.seq, expect_seq);
+        CHECK(out_len + payload <= jpg_len, "stream longer than the reference");
+        if (out_len + payload > jpg_len) {
+            break;
+        }
+        memcpy(out + out_len, dgram + sizeof(hdr), payload);
+        out_len += payload;
+        expect_seq++;
+        last = hdr.flags & JPG_UDP_FLAG_LAST;
+    }
+    CHECK(out_len == jpg_len && !memcmp(out, jpg, jpg_len), "reassembled stream differs from fmt2jpg");
+    CHECK(expect_seq == (jpg_len + 503) / 504, "%u datagrams", expect_seq);
+
+    close(tx);
+    close(rx);
+    free(out);
+    free(jpg);
+    free(frame);
+    free(ref);
+}
+
+static uint8_t *encode_decode(const uint8_t *src, size_t len, uint16_t w, uint16_t h, pixformat_t format, size_t *jpg_len, uint8_t **jpg)
+{
+    uint8_t *rgb = malloc((size_t)w * h * 3);
+    *jpg = NULL;
+    *jpg_len = 0;
+    CHECK(fmt2jpg((uint8_t *)src, len, w, h, format, 50, jpg, jpg_len), "encode failed");
+    CHECK(*jpg && fmt2rgb888(*jpg, *jpg_len, PIXFORMAT_JPEG, rgb), "decode failed");
+    return rgb;
+}
+
+static void test_huffman_learning(void)
+{
+    const uint16_t w = 320, h = 240;
+    size_t len, std_len, pic_len;
+    uint8_t *ref, *std_jpg, *jpg;
+    uint8_t *frame = synth_frame(PIXFORMAT_RGB565, w, h, &len, &ref);
+
+    //something unlike the frame the tables are learned from
+    const test_picture_t *pic = &test_pictures[2];
+    size_t pn = (size_t)pic->width * pic->height, src_len;
+    uint8_t *src = load_picture(pic, &src_len);
+    uint8_t *pic_rgb = malloc(pn * 3);
+    CHECK(src && fmt2rgb888(src, src_len, PIXFORMAT_JPEG, pic_rgb), "%s decode failed", pic->name);
+
+    jpg_set_huffman_learning(0, 0);
+    uint8_t *std_rgb = encode_decode(frame, len, w, h, PIXFORMAT_RGB565, &std_len, &std_jpg);
+    uint8_t *pic_std_jpg;
+    size_t pic_std_len;
+    free(encode_decode(pic_rgb, pn * 3, pic->width, pic->height, PIXFORMAT_RGB888, &pic_std_len, &pic_std_jpg));
+
+    //two frames are counted with the standard tables, the third one uses the learned ones
+    jpg_set_huffman_learning(2, 0);
+    size_t sizes[4];
+    for (int i = 0; i < 4; i++) {
+        uint8_t *rgb = encode_decode(frame, len, w, h, PIXFORMAT_RGB565, &sizes[i], &jpg);
+        //Huffman coding is lossless, the pixels must not change
+        CHECK(!memcmp(rgb, std_rgb, (size_t)w * h * 3), "frame %d decodes differently", i);
+        free(rgb);
+        free(jpg);
+    }
+    printf("huffman learning: standard %zu, learning %zu %zu, learned %zu %zu bytes\n", std_len, sizes[0], sizes[1], sizes[2], sizes[3]);
+    CHECK(sizes[0] == std_len && sizes[1] == std_len, "learning frames must use the standard tables");
+    CHECK(sizes[2] < std_len && sizes[3] == sizes[2], "learned tables are not smaller");
+
+    //tables learned from the synthetic frame still have a code for every symbol of the picture
+    uint8_t *rgb = encode_decode(pic_rgb, pn * 3, pic->width, pic->height, PIXFORMAT_RGB888, &pic_len, &jpg);
+    uint8_t *std_pic = malloc(pn * 3);
+    CHECK(fmt2rgb888(pic_std_jpg, pic_std_len, PIXFORMAT_JPEG, std_pic), "standard picture decode failed");
+    CHECK(!memcmp(rgb, std_pic, pn * 3), "%s decodes differently with learned tables", pic->name);
+    printf("huffman learning: %s standard %zu, foreign tables %zu bytes\n", pic->name, pic_std_len, pic_len);
+    free(rgb);
+    free(jpg);
+
+    //refresh after every frame: the picture re-learns its own tables
+    jpg_set_huffman_learning(1, 1);
+    free(encode_decode(pic_rgb, pn * 3, pic->width, pic->height, PIXFORMAT_RGB888, &pic_len, &jpg));
+    free(jpg);
+    rgb = encode_decode(pic_rgb, pn * 3, pic->width, pic->height, PIXFORMAT_RGB888, &pic_len, &jpg);
+    CHECK(!memcmp(rgb, std_pic, pn * 3), "%s decodes differently with its own tables", pic->name);
+    printf("huffman learning: %s own tables %zu bytes\n", pic->name, pic_len);
+    CHECK(pic_len < pic_std_len, "re-learned tables are not smaller");
+    free(rgb);
+    free(jpg);
+
+    //back to the standard tables, byte for byte
+    jpg_set_huffman_learning(0, 0);
+    CHECK(fmt2jpg(frame, len, w, h, PIXFORMAT_RGB565, 50, &jpg, &sizes[0]), "encode failed");
+    CHECK(sizes[0] == std_len && !memcmp(jpg, std_jpg, std_len), "standard tables not restored");
+    free(jpg);
+
+    free(std_pic);
+    free(pic_std_jpg);
+    free(std_rgb);
+    free(std_jpg);
+    free(pic_rgb);
+    free(src);
+    free(frame);
+    free(ref);
+}
+
+typedef struct {
+    uint8_t *buf;
+    size_t len;
+    size_t cap;
+    size_t max_chunk;
+} bmp_sink_t;
+
+static size_t bmp_sink(void *arg, size_t index, const void *data, size_t len)
+{
+    bmp_sink_t *sink = (bmp_sink_t *)arg;
+    if (index != sink->len || index + len > sink->cap) {
+        return 0;
+    }
+    memcpy(sink->buf + index, data, len);
+    sink->len += len;
+    if (len > sink->max_chunk) {
+        sink->max_chunk = len;
+    }
+    return len;
+}
+
+//pixel rows of a BMP match the reference, padding is zero
+static void check_bmp_pixels(const char *what, const uint8_t *bmp, size_t bmp_len, const uint8_t *ref, uint16_t w, uint16_t h, int bpp)
+{
+    size_t row_len = ((size_t)w * bpp + 3) & ~(size_t)3;
+    size_t offset = 54 + (bpp == 1 ? 1024 : 0);
+    int32_t height;
+    memcpy(&height, bmp + 22, sizeof(height));
+    CHECK(bmp[0] == 'B' && bmp[1] == 'M' && height == -h, "%s header", what);
+    CHECK(bmp_len == offset + row_len * h, "%s length %zu", what, bmp_len);
+    if (bmp_len != offset + row_len * h) {
+        return;
+    }
+    size_t bad = 0;
+    for (uint16_t y = 0; y < h; y++) {
+        const uint8_t *row = bmp + offset + y * row_len;
+        bad += memcmp(row, ref + (size_t)y * w * bpp, (size_t)w * bpp) != 0;
+        for (size_t i = (size_t)w * bpp; i < row_len; i++) {
+            bad += row[i] != 0;
+        }
+    }
+    CHECK(bad == 0, "%s has %zu bad rows", what, bad);
+}
+
+static void test_bmp(void)
+{
+    static const pixformat_t formats[] = {PIXFORMAT_RGB565, PIXFORMAT_RGB888, PIXFORMAT_YUV422, PIXFORMAT_GRAYSCALE};
+    //row length is not a multiple of 4 in either 24 or 8 bit
+    const uint16_t w = 162, h = 121;
+
+    for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+        int bpp = formats[f] == PIXFORMAT_GRAYSCALE ? 1 : 3;
+        size_t len;
+        uint8_t *ref;
+        uint8_t *frame = synth_frame(formats[f], w, h, &len, &ref);
+
+        uint8_t *bmp = NULL;
+        size_t bmp_len = 0;
+        CHECK(fmt2bmp(frame, len, w, h, formats[f], &bmp, &bmp_len), "%s bmp failed", format_name(formats[f]));
+        check_bmp_pixels(format_name(formats[f]), bmp, bmp_len, ref, w, h, bpp);
+
+        //streamed one row per callback, byte for byte the buffered file
+        bmp_sink_t sink = {.buf = malloc(bmp_len), .cap = bmp_len};
+        CHECK(fmt2bmp_cb(frame, len, w, h, formats[f], bmp_sink, &sink), "%s bmp stream failed", format_name(formats[f]));
+        CHECK(sink.len == bmp_len && !memcmp(sink.buf, bmp, bmp_len), "%s streamed bmp differs", format_name(formats[f]));
+        CHECK(sink.max_chunk <= 64 || sink.max_chunk == (((size_t)w * bpp + 3) & ~(size_t)3), "%s wrote %zu bytes at once", format_name(formats[f]), sink.max_chunk);
+
+        //a sink that gives up aborts the conversion
+        sink.len = 0;
+        sink.cap = bmp_len / 2;
+        CHECK(!fmt2bmp_cb(frame, len, w, h, formats[f], bmp_sink, &sink), "%s short write not reported", format_name(formats[f]));
+
+        free(sink.buf);
+        free(bmp);
+        free(frame);
+        free(ref);
+    }
+
+    for (size_t p = 0; p < test_pictures_count; p++) {
+        const test_picture_t *pic = &test_pictures[p];
+        size_t n = (size_t)pic->width * pic->height, len;
+        uint8_t *src = load_picture(pic, &len);
+        if (!src) {
+            continue;
+        }
+        uint8_t *rgb = malloc(n * 3);
+        CHECK(fmt2rgb888(src, len, PIXFORMAT_JPEG, rgb), "%s decode failed", pic->name);
+
+        uint8_t *bmp = NULL;
+        size_t bmp_len = 0;
+        CHECK(fmt2bmp(src, len, pic->width, pic->height, PIXFORMAT_JPEG, &bmp, &bmp_len), "%s bmp failed", pic->name);
+        check_bmp_pixels(pic->name, bmp, bmp_len, rgb, pic->width, pic->height, 3);
+
+        bmp_sink_t sink = {.buf = malloc(bmp_len), .cap = bmp_len};
+        CHECK(jpg2bmp_cb(src, len, bmp_sink, &sink), "%s bmp stream failed", pic->name);
+        CHECK(sink.len == bmp_len && !memcmp(sink.buf, bmp, bmp_len), "%s streamed bmp differs", pic->name);
+        CHECK(sink.max_chunk == (((size_t)pic->width * 3 + 3) & ~(size_t)3), "%s wrote %zu bytes at once", pic->name, sink.max_chunk);
+
+        free(sink.buf);
+        free(bmp);
+        free(rgb);
+        free(src);
+    }
+}
+
+//a YUV422 row of odd width converts its last pixel without touching
+//anything past the row on either side
+static void test_yuv_line_odd_width(void)
+{
+    static const uint16_t widths[] = {1, 5, 161};
+    for (size_t k = 0; k < sizeof(widths) / sizeof(widths[0]); k++) {
+        uint16_t w = widths[k];
+        size_t out_len = (size_t)w * 3;
+        uint8_t *src = malloc((size_t)w * 2);
+        uint8_t *dst = malloc(out_len + 8);
+        for (size_t i = 0; i < (size_t)w * 2; i++) {
+            src[i] = (uint8_t)(i * 37 + 11);
+        }
+        memset(dst, 0xA5, out_len + 8);
+        convert_line(src, PIXFORMAT_YUV422, dst, w, true);
+
+        size_t bad = 0;
+        for (uint16_t x = 0; x < w; x++) {
+            size_t p = x & ~1u;
+            uint8_t v = p + 2 < w ? src[p * 2 + 3] : (w > 1 ? src[p * 2 - 1] : 128);
+            uint8_t r, g, b;
+            yuv2rgb(src[x * 2], src[p * 2 + 1], v, &r, &g, &b);
+            bad += dst[x * 3] != b || dst[x * 3 + 1] != g || dst[x * 3 + 2] != r;
+        }
+        CHECK(bad == 0, "yuv422 width %u has %zu bad pixels", w, bad);
+        for (size_t i = out_len; i < out_len + 8; i++) {
+            CHECK(dst[i] == 0xA5, "yuv422 width %u wrote past the row at %zu", w, i - out_len);
+        }
+        free(src);
+        free(dst);
+    }
+}
+
+int main(void)
+{
+    test_synthetic_roundtrip();
+    test_picture_roundtrip();
+    test_picture_decoders_agree();
+    test_udp_stream();
+    test_huffman_learning();
+    test_bmp();
+    test_yuv_line_odd_width();
+
+    printf("%s, %d failures\n", s_failures ? "FAILED" : "OK", s_failures);
+    return s_failures ? 1 : 0;
+}
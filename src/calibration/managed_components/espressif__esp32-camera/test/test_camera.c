@@ -3,10 +3,13 @@
 #include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "unity.h"
 #include <mbedtls/base64.h>
 #include "esp_log.h"
 #include "driver/i2c.h"
+#include "esp_netif.h"
+#include "lwip/sockets.h"
 
 #include "esp_camera.h"
 
@@ -111,6 +114,8 @@
 #define I2C_MASTER_NUM              0      /*!< I2C master i2c port number, the number of i2c peripheral interfaces available will depend on the chip */
 #define I2C_MASTER_FREQ_HZ          100000 /*!< I2C master clock frequency */
 
+#define UDP_TEST_PORT               3399   /*!< Loopback port used by the JPEG datagram stream test */
+
 static const char *TAG = "test camera";
 
 typedef void (*decode_func_t)(uint8_t *jpegbuffer, uint32_t size, uint8_t *outbuffer);
@@ -380,6 +385,17 @@ static void print_rgb888_img(uint8_t *img, int width, int height)
     }
 }
 
+static void print_gray_img(uint8_t *img, int width, int height)
+{
+    const char temp2char[17] = "@MNHQ&#UJ*x7^i;.";
+    for (size_t j = 0; j < height; j++) {
+        for (size_t i = 0; i < width; i++) {
+            printf("%c", temp2char[15 - (img[j * width + i] >> 4)]);
+        }
+        printf("\n");
+    }
+}
+
 static void tjpgd_decode_rgb565(uint8_t *mjpegbuffer, uint32_t size, uint8_t *outbuffer)
 {
     jpg2rgb565(mjpegbuffer, size, outbuffer, JPG_SCALE_NONE);
@@ -390,14 +406,21 @@ static void tjpgd_decode_rgb888(uint8_t *mjpegbuffer, uint32_t size, uint8_t *ou
     fmt2rgb888(mjpegbuffer, size, PIXFORMAT_JPEG, outbuffer);
 }
 
+static void tjpgd_decode_gray(uint8_t *mjpegbuffer, uint32_t size, uint8_t *outbuffer)
+{
+    jpg2gray(mjpegbuffer, size, outbuffer, JPG_SCALE_NONE);
+}
+
 typedef enum {
     DECODE_RGB565,
     DECODE_RGB888,
+    DECODE_GRAY,
 } decode_type_t;
 
-static const decode_func_t g_decode_func[2][2] = {
+static const decode_func_t g_decode_func[3][2] = {
     {tjpgd_decode_rgb565,},
     {tjpgd_decode_rgb888,},
+    {tjpgd_decode_gray,},
 };
 
 
@@ -421,6 +444,9 @@ static float jpg_decode_test(uint8_t decoder_index, decode_type_t type, const ui
     if (DECODE_RGB565 == type) {
         ESP_LOGI(TAG, "jpeg decode to rgb565");
         print_rgb565_img(rgb_buf, img_w, img_h);
+    } else if (DECODE_GRAY == type) {
+        ESP_LOGI(TAG, "jpeg decode to gray");
+        print_gray_img(rgb_buf, img_w, img_h);
     } else {
         ESP_LOGI(TAG, "jpeg decode to rgb888");
         print_rgb888_img(rgb_buf, img_w, img_h);
@@ -451,7 +477,7 @@ static float jpg_decode_test(uint8_t decoder_index, decode_type_t type, const ui
     return fps;
 }
 
-static void img_jpeg_decode_test(uint16_t pic_index, uint16_t lib_index)
+static float img_jpeg_decode_test(uint16_t pic_index, uint16_t lib_index, decode_type_t type)
 {
     extern const uint8_t img1_start[] asm("_binary_testimg_jpeg_start");
     extern const uint8_t img1_end[]   asm("_binary_testimg_jpeg_end");
@@ -488,7 +514,7 @@ static void img_jpeg_decode_test(uint16_t pic_index, uint16_t lib_index)
 
     ESP_LOGI(TAG, "pic_index:%d", pic_index);
     ESP_LOGI(TAG, "lib_index:%d", lib_index);
-    jpg_decode_test(lib_index, DECODE_RGB565, imgs[pic_index].buf, imgs[pic_index].length, imgs[pic_index].w, imgs[pic_index].h, 16);
+    return jpg_decode_test(lib_index, type, imgs[pic_index].buf, imgs[pic_index].length, imgs[pic_index].w, imgs[pic_index].h, 16);
 }
 
 /**
@@ -512,17 +538,35 @@ static esp_err_t i2c_master_init(int i2c_port)
 
 TEST_CASE("Conversions image 227x149 jpeg decode test", "[camera]")
 {
-    img_jpeg_decode_test(0, 0);
+    img_jpeg_decode_test(0, 0, DECODE_RGB565);
 }
 
 TEST_CASE("Conversions image 320x240 jpeg decode test", "[camera]")
 {
-    img_jpeg_decode_test(1, 0);
+    img_jpeg_decode_test(1, 0, DECODE_RGB565);
 }
 
 TEST_CASE("Conversions image 480x320 jpeg decode test", "[camera]")
 {
-    img_jpeg_decode_test(2, 0);
+    img_jpeg_decode_test(2, 0, DECODE_RGB565);
+}
+
+TEST_CASE("Conversions jpeg luma decode performance test", "[camera]")
+{
+    float rgb565_fps[3], gray_fps[3];
+    for (size_t i = 0; i < 3; i++) {
+        rgb565_fps[i] = img_jpeg_decode_test(i, 0, DECODE_RGB565);
+        gray_fps[i] = img_jpeg_decode_test(i, 0, DECODE_GRAY);
+    }
+
+    printf("picture,  RGB565 fps,  gray fps\n");
+    for (size_t i = 0; i < 3; i++) {
+        printf("%7u, %11.2f, %9.2f\n", i, rgb565_fps[i], gray_fps[i]);
+#if CONFIG_CAMERA_JPEG_SW_DECODER
+        // chroma is skipped entirely, anything slower means the luma path is not taken
+        TEST_ASSERT_GREATER_THAN_FLOAT(rgb565_fps[i], gray_fps[i]);
+#endif
+    }
 }
 
 TEST_CASE("Camera driver uses an i2c port initialized by other devices test", "[camera]")
@@ -533,3 +577,108 @@ TEST_CASE("Camera driver uses an i2c port initialized by other devices test", "[
     TEST_ESP_OK(esp_camera_deinit());
     TEST_ESP_OK(i2c_driver_delete(I2C_MASTER_NUM));
 }
+
+typedef struct {
+    int sock;
+    uint8_t *buf;
+    size_t cap;
+    size_t len;
+    uint16_t next_seq;
+    bool in_order;
+    bool done;
+    jpg_udp_header_t last;
+    SemaphoreHandle_t finished;
+} udp_rx_ctx_t;
+
+static void udp_rx_task(void *arg)
+{
+    udp_rx_ctx_t *ctx = (udp_rx_ctx_t *)arg;
+    uint8_t dgram[JPG_UDP_MTU_MAX];
+    while (!ctx->done) {
+        int n = recv(ctx->sock, dgram, sizeof(dgram), 0);
+        if (n < (int)sizeof(jpg_udp_header_t)) {
+            break; // timed out
+        }
+        memcpy(&ctx->last, dgram, sizeof(jpg_udp_header_t));
+        if (ctx->last.seq != ctx->next_seq++) {
+            ctx->in_order = false;
+        }
+        size_t payload = n - sizeof(jpg_udp_header_t);
+        if (ctx->len + payload > ctx->cap) {
+            break;
+        }
+        memcpy(ctx->buf + ctx->len, dgram + sizeof(jpg_udp_header_t), payload);
+        ctx->len += payload;
+        ctx->done = ctx->last.flags & JPG_UDP_FLAG_LAST;
+    }
+    xSemaphoreGive(ctx->finished);
+    vTaskDelete(NULL);
+}
+
+TEST_CASE("Conversions jpeg udp stream reassembly test", "[camera]")
+{
+    const uint16_t w = 320, h = 240;
+    uint8_t *rgb = malloc(w * h * 2);
+    TEST_ASSERT_NOT_NULL(rgb);
+    for (size_t i = 0; i < w * h; i++) {
+        uint16_t x = i % w, y = i / w;
+        rgb[2 * i] = (x ^ y) & 0xF8;
+        rgb[2 * i + 1] = (x + y) & 0xFF;
+    }
+
+    uint8_t *ref = NULL;
+    size_t ref_len = 0;
+    TEST_ASSERT_TRUE(fmt2jpg(rgb, w * h * 2, w, h, PIXFORMAT_RGB565, 60, &ref, &ref_len));
+
+    TEST_ESP_OK(esp_netif_init());
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(UDP_TEST_PORT),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    int rx = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+    int tx = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+    TEST_ASSERT(rx >= 0 && tx >= 0);
+    TEST_ASSERT_EQUAL(0, bind(rx, (struct sockaddr *)&addr, sizeof(addr)));
+    struct timeval timeout = { .tv_sec = 1, .tv_usec = 0 };
+    setsockopt(rx, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    udp_rx_ctx_t ctx = {
+        .sock = rx,
+        .buf = malloc(ref_len),
+        .cap = ref_len,
+        .in_order = true,
+        .finished = xSemaphoreCreateBinary(),
+    };
+    TEST_ASSERT_NOT_NULL(ctx.buf);
+    // the receiver preempts the encoder on every datagram so lwip's small receive mailbox never overflows
+    xTaskCreate(udp_rx_task, "udp_rx", 4096, &ctx, uxTaskPriorityGet(NULL) + 1, NULL);
+
+    jpg_udp_target_t target = {
+        .sock = tx,
+        .dest_addr = (struct sockaddr *)&addr,
+        .dest_len = sizeof(addr),
+        .mtu = 512,
+        .cam_id = 7,
+        .frame_id = 42,
+    };
+    uint64_t t1 = esp_timer_get_time();
+    TEST_ASSERT_TRUE(fmt2jpg_udp(rgb, w * h * 2, w, h, PIXFORMAT_RGB565, 60, &target));
+    ESP_LOGI(TAG, "JPEG %u bytes streamed in %llu us", ref_len, esp_timer_get_time() - t1);
+    xSemaphoreTake(ctx.finished, portMAX_DELAY);
+
+    TEST_ASSERT_TRUE(ctx.done);
+    TEST_ASSERT_TRUE(ctx.in_order);
+    TEST_ASSERT_EQUAL(42, ctx.last.frame_id);
+    TEST_ASSERT_EQUAL(7, ctx.last.cam_id);
+    TEST_ASSERT_EQUAL((ref_len + 504 - 1) / 504, ctx.next_seq);
+    TEST_ASSERT_EQUAL(ref_len, ctx.len);
+    TEST_ASSERT_EQUAL_MEMORY(ref, ctx.buf, ref_len);
+
+    vSemaphoreDelete(ctx.finished);
+    close(rx);
+    close(tx);
+    free(ctx.buf);
+    free(ref);
+    free(rgb);
+}
@@ -19,6 +19,7 @@
 #include "freertos/task.h"
 #include "esp_clk_tree.h"
 #include "esp_system.h"
+#include "esp_random.h"
 #include "esp_event.h"
 #include "nvs_flash.h"
 #include "esp_netif.h"
@@ -35,9 +36,17 @@
 // decimation parameters, can be tuned
 #define DEC_RATE 4
 #define VALID_WIDTH 4 
-#define CAM_ID 2
+#define CAM_ID CONFIG_CAM_ID
 #define MAX_WINDOW_SIZE 50000
 
+// RTP (RFC 3550) framing, see net/protocol/rtp.rs in the camera server:
+// 12 byte fixed header, then an RFC 8285 one-byte header extension with the
+// window geometry, all big-endian
+#define RTP_PAYLOAD_TYPE 96
+#define RTP_EXT_PROFILE 0xBEDE
+#define RTP_EXT_ID 1
+#define RTP_EXT_SIZE 7
+
 #define HOST_IP_ADDR CONFIG_IPV4_ADDR
 #define PORT CONFIG_PORT
 
@@ -66,10 +75,14 @@ typedef struct TagPair{
     __uint16_t py;
 } TagPair;
 
+// cam_id and flags sit where the compiler used to pad before ts,
+// so the header is still 12 bytes
 typedef struct TagHeader {
     __uint16_t wwidth;
     __uint16_t px;
     __uint16_t py;
+    __uint8_t cam_id;
+    __uint8_t flags;
     __uint32_t ts;
 } TagHeader;
 
@@ -78,6 +91,7 @@ static camera_fb_t *pic;
 static uint8_t wbuf[MAX_WINDOW_SIZE];
 static __uint16_t task_ct;
 static __uint32_t frame_ct;
+static __uint16_t rtp_seq;
 
 static TaskHandle_t xHandle = NULL;
 static struct sockaddr_in dest_addr;
@@ -176,15 +190,49 @@ bool valid_region(TagPair* tp, camera_fb_t* fb, __uint32_t *idx, __uint16_t *col
     return true;
 }
 
+static __uint8_t *put_be16(__uint8_t *b, __uint16_t v) {
+    b[0] = v >> 8;
+    b[1] = v;
+    return b + 2;
+}
+
+static __uint8_t *put_be32(__uint8_t *b, __uint32_t v) {
+    b = put_be16(b, v >> 16);
+    return put_be16(b, v);
+}
+
+// RTP header for a window, returns its size
+static __uint8_t put_rtp_header(__uint8_t *b, const TagPair *tp) {
+    __uint16_t seq = __atomic_fetch_add(&rtp_seq, 1, __ATOMIC_RELAXED);
+    __uint8_t *p = b;
+    *p++ = 2 << 6 | 1 << 4; // version 2, extension, no padding or CSRCs
+    *p++ = RTP_PAYLOAD_TYPE;
+    p = put_be16(p, seq);
+    p = put_be32(p, frame_ct);
+    p = put_be32(p, CAM_ID);
+    p = put_be16(p, RTP_EXT_PROFILE);
+    p = put_be16(p, 2); // extension length in words
+    *p++ = RTP_EXT_ID << 4 | (RTP_EXT_SIZE - 1);
+    p = put_be16(p, tp->wwidth);
+    p = put_be16(p, tp->px);
+    p = put_be16(p, tp->py);
+    *p++ = 0; // flags
+    return p - b;
+}
+
 // send timestamp, xy, windowed bytes
 void send_window(void * in) {
     TagPair* tp = (TagPair*)in;
     __uint16_t whwidth = tp->wwidth/2;
 
-    TagHeader th = {tp->wwidth, tp->px, tp->py, frame_ct};
     ESP_LOGI(TAG, "Frame count: %lu", frame_ct);
+#if CONFIG_TRANSPORT_RTP
+    __uint8_t hoffset = put_rtp_header(wbuf, tp);
+#else
+    TagHeader th = {tp->wwidth, tp->px, tp->py, CAM_ID, 0, frame_ct};
     memcpy(wbuf, &th, sizeof(th));
     __uint8_t hoffset = sizeof(th);
+#endif
 
     __uint16_t spx = (tp->py - whwidth)*pic->width + (tp->px - whwidth);
     for(__uint16_t i = 0; i < tp->wwidth; ++i) {
@@ -267,6 +315,7 @@ void app_main(void)
     setvbuf(stdout, NULL, _IONBF, 0);
     task_ct = 0;
     frame_ct = 0;
+    rtp_seq = esp_random(); // RFC 3550 asks for a random start
 
     sock = socket(addr_family, SOCK_DGRAM, ip_protocol);
     dest_addr.sin_addr.s_addr = inet_addr(HOST_IP_ADDR);